@@ -0,0 +1,73 @@
+// bitmap.h: Packed bitset with summary levels
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <vector>
+
+class Bitmap {
+private:
+    const static size_t WORD_BITS = 64;
+
+    // Levels[0] holds one bit per element.  Each higher level holds one bit
+    // per word of the level below, set when that word has any bit set, so
+    // a search skips 64^k empty elements per word at level k.
+    std::vector< std::vector<uint64_t> > Levels;
+    size_t Bits;    // Number of elements
+    size_t Count;   // Number of set elements
+
+    // Find first set bit at or after position in level (-1 if none)
+    ssize_t find_level(size_t level, size_t position) const;
+
+public:
+    // Default constructor
+    Bitmap() : Bits(0), Count(0) {}
+
+    // Construct bitmap of nbits elements, all set to value
+    Bitmap(size_t nbits, bool value) { assign(nbits, value); }
+
+    // Resize bitmap to nbits elements, all set to value
+    void assign(size_t nbits, bool value);
+
+    // Release all storage
+    void clear();
+
+    // Return whether or not element is set
+    bool test(size_t bit) const {
+    	return (Levels[0][bit / WORD_BITS] >> (bit % WORD_BITS)) & 1;
+    }
+
+    // Set element
+    void set(size_t bit);
+
+    // Clear element
+    void reset(size_t bit);
+
+    // Find first set element at or after start, wrapping around to the
+    // beginning (-1 if no element is set)
+    ssize_t find_next(size_t start) const;
+
+    // Return number of consecutive set elements from start (at most max)
+    size_t run_length(size_t start, size_t max) const;
+
+    // Find a run of up to length consecutive set elements at or after start
+    // (wrapping), preferring the first run that is long enough, else the
+    // longest run among the candidates examined; stores the run length in
+    // found and returns its first element (-1 if no element is set)
+    ssize_t find_run(size_t start, size_t length, size_t *found) const;
+
+    // Return element words (one bit per element, least significant first);
+    // call refresh() after modifying them directly
+    uint64_t *words() { return Levels[0].data(); }
+    size_t nwords() const { return Levels[0].size(); }
+
+    // Rebuild summary levels and count from the element words
+    void refresh();
+
+    // Return number of elements
+    size_t size() const { return Bits; }
+
+    // Return number of set elements
+    size_t count() const { return Count; }
+};
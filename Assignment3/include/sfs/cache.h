@@ -0,0 +1,162 @@
+// cache.h: Write-back block cache
+
+#pragma once
+
+#include "sfs/disk.h"
+
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <stdint.h>
+
+class BlockCache {
+public:
+    // Replacement policies
+    enum Policy {
+    	LRU,	    // Evict least recently used block
+    	CLOCK,	    // Evict first unreferenced block under the clock hand
+    };
+
+    // Default number of blocks held in the cache
+    const static size_t DEFAULT_CAPACITY = 256;
+
+private:
+    const static size_t NONE = (size_t)-1;
+
+    struct Entry {
+    	int	BlockNumber;	// Cached block (-1 if slot is empty)
+    	bool	Dirty;		// Whether or not block must be written back
+    	bool	Referenced;	// CLOCK reference bit
+    	size_t	Pins;		// Outstanding pins (never evicted while > 0)
+    	size_t	Prev;		// LRU list: more recently used neighbour
+    	size_t	Next;		// LRU list: less recently used neighbour
+    };
+
+    Disk *		    disk;	// Backing disk (NULL if detached)
+    size_t		    Capacity;	// Number of slots
+    Policy		    policy;	// Replacement policy
+    std::vector<Entry>	    entries;	// Slot metadata
+    std::vector<char>	    buffer;	// Slot data (Capacity * BLOCK_SIZE)
+    std::unordered_map<int, size_t> index; // Block number -> slot
+    size_t		    Used;	// Number of occupied slots
+    size_t		    Head;	// LRU list: most recently used slot
+    size_t		    Tail;	// LRU list: least recently used slot
+    size_t		    Hand;	// CLOCK hand
+    size_t		    Hits;	// Number of requests served from cache
+    size_t		    Misses;	// Number of requests sent to disk
+    size_t		    Writebacks;	// Number of dirty blocks written to disk
+    size_t		    Prefetches;	// Number of blocks installed by prefetch
+    size_t		    Generation;	// Number of disk writes issued by the cache
+    size_t		    Pinned;	// Number of slots with pins
+    bool		    Reporting;	// Whether or not stats are printed on exit
+    std::mutex		    Lock;	// Guards everything above
+
+    char *slot_data(size_t slot) { return &buffer[slot * Disk::BLOCK_SIZE]; }
+
+    // Look up block, returning its slot (or NONE) and updating recency
+    size_t lookup(int blocknum);
+
+    // Return a free slot for blocknum, evicting (and writing back) if needed
+    // (NONE if every slot is pinned)
+    size_t install(int blocknum);
+
+    // Choose an unpinned victim slot according to the replacement policy
+    // (NONE if every slot is pinned)
+    size_t victim();
+
+    // Unlocked single block operations (Lock held)
+    void read_block(int blocknum, char *data);
+    void write_block(int blocknum, char *data);
+    void flush_blocks();
+
+    // Return whether or not a request of count blocks should bypass the
+    // cache rather than evict most of it
+    bool streaming(size_t count) const { return count > Capacity / 2; }
+
+    // Take one pin on slot, unless that would pin more than half the cache
+    bool take_pin(size_t slot);
+
+    // LRU list maintenance
+    void unlink(size_t slot);
+    void push_front(size_t slot);
+
+public:
+    // Default constructor
+    BlockCache() : disk(NULL), Capacity(0), policy(LRU), Used(0), Head(NONE),
+    	Tail(NONE), Hand(0), Hits(0), Misses(0), Writebacks(0), Prefetches(0),
+    	Generation(0), Pinned(0), Reporting(false) {}
+
+    // Destructor
+    ~BlockCache();
+
+    // Attach cache to disk
+    // @param	disk	    Disk to cache
+    // @param	capacity    Number of blocks to cache (0 disables caching)
+    // @param	policy	    Replacement policy
+    void attach(Disk *disk, size_t capacity, Policy policy);
+
+    // Write back all dirty blocks and drop every cached block
+    void detach();
+
+    // Return whether or not cache is attached to a disk
+    bool attached() const { return disk != NULL; }
+
+    // Read block through cache
+    // @param	blocknum    Block to read from
+    // @param	data	    Buffer to read into
+    void read(int blocknum, char *data);
+
+    // Write block through cache (block is written back on eviction or flush)
+    // @param	blocknum    Block to write to
+    // @param	data	    Buffer to write from
+    void write(int blocknum, char *data);
+
+    // Read several blocks through cache, fetching every miss with one
+    // vectored disk request
+    // @param	blocks	    Blocks to read from
+    // @param	data	    Buffers to read into (one per block)
+    void read(const std::vector<int> &blocks, const std::vector<char *> &data);
+
+    // Write several blocks through cache; requests larger than half the
+    // cache are written straight to disk with one vectored request
+    // @param	blocks	    Blocks to write to
+    // @param	data	    Buffers to write from (one per block)
+    void write(const std::vector<int> &blocks, const std::vector<char *> &data);
+
+    // Replace cached copies of blocks that were just written to disk behind
+    // the cache, leaving them clean; blocks that are not cached stay so
+    // @param	blocks	    Blocks written
+    // @param	data	    Data written (one buffer per block)
+    void update(const std::vector<int> &blocks, const std::vector<char *> &data);
+
+    // Read blocks that are not cached into the cache without holding the
+    // cache while the disk works; blocks written meanwhile are dropped so a
+    // stale copy is never installed.  Hits and misses are not counted.
+    // @param	blocks	    Blocks to read ahead
+    void prefetch(const std::vector<int> &blocks);
+
+    // Write back all dirty blocks in ascending block order
+    void flush();
+
+    // Pin blocks in cache so their memory stays valid and is never evicted
+    // until unpinned; writes to a block still update that memory.  Misses
+    // are read with one vectored request without holding the cache, and no
+    // more than half the cache is ever pinned, so blocks past that (or that
+    // a write raced with) are left for the caller to copy.
+    // @param	blocks	    Blocks to pin
+    // @param	install	    Whether to read blocks in on a miss
+    // @param	data	    Block data (NULL for each block not pinned)
+    void pin(const std::vector<int> &blocks, bool install, std::vector<const char *> &data);
+
+    // Release one pin taken by pin
+    // @param	blocknum    Block to unpin
+    void unpin(int blocknum);
+
+    // Return cache statistics
+    size_t capacity() const { return Capacity; }
+    size_t hits() const { return Hits; }
+    size_t misses() const { return Misses; }
+    size_t writebacks() const { return Writebacks; }
+    size_t prefetches() const { return Prefetches; }
+};
@@ -0,0 +1,174 @@
+// directory.h: Hashed directories
+
+#pragma once
+
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// A directory is an ordinary file holding an htree-style hashed index:
+// block 0 is the root of the index, mapping ranges of name hashes to leaf
+// blocks (directly, or through one level of index blocks once the root
+// fills), and each leaf holds the entries whose hashes fall in its range.
+// Entries with the same hash never straddle leaves, so lookup, link and
+// unlink read at most three blocks however large the directory grows.
+// A full leaf splits at its median hash.  Emptied leaves are kept, so
+// unlink never moves entries between blocks.
+//
+// Directories only map names to inode numbers: they keep no link counts,
+// and removing a named inode is up to the caller.  Operations on one
+// Directory are serialized, so share a single one between threads.
+class Directory {
+public:
+    const static uint32_t MAGIC_NUMBER = 0x52494453;	// "SDIR"
+
+    // Longest name, in bytes
+    const static size_t NAME_LENGTH = 55;
+
+    // Entries per leaf and index entries per root and index block
+    const static size_t ENTRIES_PER_LEAF = Disk::BLOCK_SIZE / 64 - 1;
+    const static size_t INDEXES_PER_ROOT = (Disk::BLOCK_SIZE - 32) / 8;
+    const static size_t INDEXES_PER_NODE = (Disk::BLOCK_SIZE - 8) / 8;
+
+    // Name and inode of one entry
+    struct Entry {
+    	std::string Name;
+    	size_t	    Inode;
+    };
+
+private:
+    // Start of the root of the index
+    struct Header {
+    	uint32_t MagicNumber;	// MAGIC_NUMBER
+    	uint32_t Levels;	// Levels of index blocks below the root (0 or 1)
+    	uint32_t Entries;	// Number of entries in directory
+    	uint32_t Blocks;	// Number of blocks in directory file
+    	uint32_t Indexes;	// Number of index entries in root
+    	uint32_t Reserved[3];
+    };
+
+    // First hash a leaf (or index block) covers, sorted by Hash; the first
+    // index entry of every block covers everything below the second one
+    struct Index {
+    	uint32_t Hash;
+    	uint32_t Block;
+    };
+
+    struct Record {
+    	uint32_t Inode;
+    	uint32_t Hash;
+    	uint8_t	 Length;
+    	char	 Name[NAME_LENGTH];
+    };
+
+    union Block {
+    	struct {			// Root (block 0)
+    	    Header Head;
+    	    Index  Indexes[INDEXES_PER_ROOT];
+    	} Root;
+    	struct {			// Index block
+    	    uint32_t Count;
+    	    uint32_t Reserved;
+    	    Index    Indexes[INDEXES_PER_NODE];
+    	} Node;
+    	struct {			// Leaf
+    	    uint32_t Count;
+    	    uint32_t Reserved[15];
+    	    Record   Records[ENTRIES_PER_LEAF];
+    	} Leaf;
+    	char Data[Disk::BLOCK_SIZE];
+    };
+
+    // Blocks visited on the way to a name's leaf
+    struct Path {
+    	size_t	 RootSlot;	// Index entry of root followed
+    	size_t	 NodeBlock;	// Index block followed (0 if none)
+    	size_t	 NodeSlot;	// Its index entry followed
+    	size_t	 LeafBlock;	// Leaf holding the name's hash
+    };
+
+    FileSystem *FS;
+    size_t	Inumber;
+    std::mutex	Lock;
+
+    // Read or write one block of the directory file
+    bool load(size_t block, Block &data);
+    bool save(size_t block, Block &data);
+
+    // Return index entry of sorted indexes that covers hash
+    static size_t search(const Index *indexes, size_t count, uint32_t hash);
+
+    // Insert an index entry after slot, shifting the rest up
+    static void insert(Index *indexes, size_t count, size_t slot, uint32_t hash, uint32_t block);
+
+    // Walk from the root to the leaf covering hash
+    // @param	root	    Root block (already loaded)
+    // @param	hash	    Hash of name
+    // @param	path	    Blocks visited
+    // @param	node	    Index block visited (loaded if there is one)
+    bool walk(Block &root, uint32_t hash, Path &path, Block &node);
+
+    // Return slot of name in leaf (-1 if absent)
+    static ssize_t find(const Block &leaf, const char *name, size_t length, uint32_t hash);
+
+    // Add an index entry for a leaf split off at hash, splitting the root
+    // into an index block or an index block in two when full
+    bool add_index(Block &root, Path &path, Block &node, uint32_t hash, uint32_t block);
+
+public:
+    // Default constructor
+    Directory() : FS(NULL), Inumber(0) {}
+
+    // Make an existing (empty) inode an empty directory, marking its inode
+    // as one (see FileSystem::set_directory)
+    // @param	fs	    Mounted file system
+    // @param	inumber	    Inode to format
+    static bool format(FileSystem *fs, size_t inumber);
+
+    // Create an empty directory
+    // @param	fs	    Mounted file system
+    // Returns its inode or -1 on error.
+    static ssize_t create(FileSystem *fs);
+
+    // Return whether or not inumber is marked as a directory
+    static bool is_directory(FileSystem *fs, size_t inumber);
+
+    // Open a directory
+    // @param	fs	    Mounted file system
+    // @param	inumber	    Inode of directory
+    // Returns false if inumber does not hold a directory.
+    bool open(FileSystem *fs, size_t inumber);
+
+    // Return inode of directory
+    size_t inode() const { return Inumber; }
+
+    // Return inode name refers to, or -1 if there is no such entry
+    ssize_t lookup(const char *name);
+
+    // Add an entry
+    // @param	name	    Name of entry (1 to NAME_LENGTH bytes, no '/')
+    // @param	inumber	    Inode it refers to
+    // Returns false if name is invalid or taken, or the directory is full.
+    bool link(const char *name, size_t inumber);
+
+    // Remove an entry, leaving the inode it refers to alone
+    // Returns false if there is no such entry.
+    bool unlink(const char *name);
+
+    // Return every entry, leaf by leaf in hash order (entries within a
+    // leaf are unordered)
+    // Returns the number of entries or -1 on error.
+    ssize_t readdir(std::vector<Entry> &entries);
+
+    // Return number of entries (-1 on error)
+    ssize_t size();
+
+    // Return hash of name
+    static uint32_t hash(const char *name, size_t length);
+};
@@ -2,28 +2,139 @@
 
 #pragma once
 
+#include "sfs/model.h"
+#include "sfs/scheduler.h"
+#include "sfs/stats.h"
+#include "sfs/trace.h"
+#include "sfs/uring.h"
+
 #include <stdlib.h>
+#include <sys/uio.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
 
+// Block I/O is positional, so a single Disk may be shared between threads
 class Disk {
+public:
+    // I/O backends
+    enum Backend {
+    	SYNC,	    // Blocking preadv/pwritev, one run of blocks at a time
+    	URING,	    // io_uring, keeping up to the queue depth of runs in flight
+    	MMAP,	    // Shared memory mapping of the image, blocks copied in memory
+    };
+
+    // Access pattern hints
+    enum Access {
+    	NORMAL,	    // No particular pattern
+    	SEQUENTIAL, // Read ahead aggressively, drop pages behind
+    	RANDOM,	    // Do not read ahead
+    	WILLNEED,   // Start reading the range now
+    };
+
+    // Durability modes: when writes are made durable with fdatasync
+    enum Durability {
+    	NO_SYNC,	// Never; the OS writes back whenever it likes
+    	SYNC_ON_FLUSH,	// When the file system is synced or unmounted
+    	SYNC_PERIODIC,	// Also every sync interval
+    	SYNC_ALWAYS,	// Before every file system update returns
+    };
+
+    // Default number of requests kept in flight
+    const static size_t DEFAULT_QUEUE_DEPTH = 32;
+
+    // Default interval between periodic syncs, in milliseconds
+    const static size_t DEFAULT_SYNC_INTERVAL = 1000;
+
+    // Most queued requests dispatched in one round
+    const static size_t DISPATCH_BATCH = 1024;
+
 private:
+    // Run of adjacent blocks transferred by one request
+    struct Run {
+    	off_t	Offset;	    // Byte offset of first block
+    	size_t	First;	    // Index of first buffer
+    	size_t	Count;	    // Number of blocks
+    };
+
     int	    FileDescriptor; // File descriptor of disk image
     size_t  Blocks;	    // Number of blocks in disk image
-    size_t  Reads;	    // Number of reads performed
-    size_t  Writes;	    // Number of writes performed
+    std::atomic<size_t> Reads;  // Number of reads performed
+    std::atomic<size_t> Writes; // Number of writes performed
+    std::atomic<size_t> LogicalBytes; // Number of bytes clients asked to write
+    std::atomic<size_t> Syncs;	// Number of syncs performed
     size_t  Mounts;	    // Number of mounts
 
+    Backend		    Mode;	// Selected backend
+    size_t		    QueueDepth;	// Requests kept in flight
+    Uring		    Ring;	// io_uring rings (URING only)
+    std::mutex		    RingLock;	// Guards Ring, InFlight and Reaping
+    std::condition_variable RingReady;	// Signalled after completions are reaped
+    size_t		    InFlight;	// Requests submitted but not reaped
+    bool		    Reaping;	// Whether or not a thread waits for completions
+    char *		    Map;	// Mapped image (MMAP only)
+
+    Durability		    Policy;	// Selected durability mode
+    size_t		    Interval;	// Milliseconds between periodic syncs
+    std::mutex		    SyncLock;	// Guards the fields below
+    std::condition_variable SyncDone;	// Signalled when a sync completes
+    bool		    Syncing;	// Whether or not a sync is running
+    size_t		    Completed;	// Number of syncs completed
+    size_t		    Synced;	// Writes already covered by a sync
+
+    Stats		    Statistics;	// Latency of block I/O and syncs
+
+    DiskModel		    Model;	// Timing model of a mechanical disk
+    bool		    Modeled;	// Whether or not requests go through Model
+
+    // Request queue (unless the policy is Scheduler::NONE): callers queue
+    // their blocks, and whichever finds no dispatch running takes the next
+    // round of requests from every caller in policy order and transfers
+    // them, merging adjacent ones, while the others wait for theirs
+    Scheduler		    Queue;
+    std::mutex		    QueueLock;	// Guards Queue and Dispatching
+    std::condition_variable QueueDone;	// Signalled after each round
+    bool		    Dispatching; // Whether or not a round is running
+
     // Check parameters
     // @param	blocknum    Block to operate on
     // @param	data	    Buffer to operate on
     // Throws invalid_argument exception on error.
     void sanity_check(int blocknum, char *data);
 
+    // Transfer several blocks, merging runs of adjacent blocks into a
+    // single preadv/pwritev call
+    // @param	blocks	    Blocks to operate on
+    // @param	data	    Buffers to operate on (one per block)
+    // @param	write	    Whether to write (true) or read (false)
+    // Throws runtime_error exception on error.
+    void transfer(const std::vector<int> &blocks, const std::vector<char *> &data, bool write);
+
+    // Transfer blocks in the order given, without the queue
+    void issue(const std::vector<int> &blocks, const std::vector<char *> &data, bool write);
+
+    // Queue blocks and wait until they are dispatched
+    void enqueue(const std::vector<int> &blocks, const std::vector<char *> &data, bool write);
+
+    // Transfer one round of queued requests, recording errors in their
+    // completions instead of throwing
+    void dispatch(const std::vector<Scheduler::Request> &batch);
+
+    // Submit runs to the io_uring and wait for their completion; requests
+    // from other threads share the ring and its queue depth
+    void transfer_uring(const std::vector<Run> &runs, const std::vector<struct iovec> &iov, bool write);
+
 public:
     // Number of bytes per block
     const static size_t BLOCK_SIZE = 4096;
     
     // Default constructor
-    Disk() : FileDescriptor(0), Blocks(0), Reads(0), Writes(0), Mounts(0) {}
+    Disk() : FileDescriptor(0), Blocks(0), Reads(0), Writes(0), LogicalBytes(0), Syncs(0), Mounts(0),
+    	Mode(SYNC), QueueDepth(DEFAULT_QUEUE_DEPTH), InFlight(0), Reaping(false),
+    	Map(NULL), Policy(SYNC_ON_FLUSH), Interval(DEFAULT_SYNC_INTERVAL), Syncing(false),
+    	Completed(0), Synced(0), Modeled(false), Dispatching(false) {}
     
     // Destructor
     ~Disk();
@@ -34,9 +145,112 @@ public:
     // Throws runtime_error exception on error.
     void open(const char *path, size_t nblocks);
 
+    // Select I/O backend (after open)
+    // @param	backend	    Backend to use
+    // @param	queue_depth Requests kept in flight
+    // Returns false, keeping the SYNC backend, if backend is unavailable.
+    bool set_backend(Backend backend, size_t queue_depth = DEFAULT_QUEUE_DEPTH);
+
+    // Parse a backend: sync, uring or mmap (returns false if unknown)
+    static bool parse(const char *name, Backend *backend);
+
+    // Hint how the whole image will be accessed
+    // @param	access	    Expected access pattern
+    void advise(Access access);
+
+    // Hint how a range of blocks will be accessed
+    // @param	blocknum    First block of range
+    // @param	count	    Number of blocks in range
+    // @param	access	    Expected access pattern
+    void advise(int blocknum, size_t count, Access access);
+
+    // Zero a range of blocks by releasing their storage in the image file
+    // (punching a hole, or else zeroing the range in place) instead of
+    // writing them; discarded blocks do not count as writes
+    // @param	blocknum    First block of range
+    // @param	count	    Number of blocks in range
+    // Returns false if the image file supports neither, leaving the blocks
+    // untouched.
+    bool discard(int blocknum, size_t count);
+
+    // Return block's memory in the mapped image (NULL unless MMAP); writes
+    // through the pointer bypass the write counter
+    // @param	blocknum    Block to look up
+    char *map(int blocknum);
+
+    // Write modified mapped blocks back to the image file (MMAP only)
+    // Throws runtime_error exception on error.
+    void flush();
+
+    // Make every write completed so far durable (fdatasync, after flushing
+    // the mapped image); callers that arrive while a sync is running share
+    // the next one, and nothing happens if nothing was written since the
+    // last one or the durability mode is NO_SYNC
+    // Throws runtime_error exception on error.
+    void sync();
+
+    // Select durability mode; the file system reads it at mount
+    // @param	durability  Durability mode
+    // @param	interval    Milliseconds between periodic syncs
+    void set_durability(Durability durability, size_t interval = DEFAULT_SYNC_INTERVAL) {
+    	Policy	 = durability;
+    	Interval = interval;
+    }
+
+    // Parse a durability mode: none, flush, always or a sync interval in
+    // milliseconds, which selects SYNC_PERIODIC (returns false if unknown)
+    static bool parse(const char *spec, Durability *durability, size_t *interval);
+
+    // Select request scheduling policy (while no I/O is in progress)
+    // @param	policy	    Scheduler::NONE transfers every request directly
+    void set_scheduler(Scheduler::Policy policy) { Queue.set_policy(policy); }
+
+    // Return request scheduling policy
+    Scheduler::Policy scheduler() const { return Queue.policy(); }
+
+    // Model the time every request would take on a mechanical disk (after
+    // open); each run of adjacent blocks counts as one request
+    // @param	geometry    Disk geometry
+    // Returns false, leaving modeling off, if geometry cannot hold the disk.
+    bool set_model(const DiskModel::Geometry &geometry) {
+    	Modeled = Model.setup(geometry, Blocks);
+    	return Modeled;
+    }
+
+    // Return timing model (NULL unless modeling)
+    DiskModel *model() { return Modeled ? &Model : NULL; }
+
+    // Return durability mode and periodic sync interval
+    Durability durability() const { return Policy; }
+    size_t sync_interval() const { return Interval; }
+
+    // Return selected backend
+    Backend backend() const { return Mode; }
+
+    // Return number of requests kept in flight
+    size_t queue_depth() const { return QueueDepth; }
+
     // Return size of disk (in terms of blocks)
     size_t size() const { return Blocks; }
 
+    // Return number of blocks read and written
+    size_t reads() const { return Reads; }
+    size_t writes() const { return Writes; }
+
+    // Return number of syncs performed
+    size_t syncs() const { return Syncs; }
+
+    // Return latency histograms of block reads, block writes and syncs
+    Stats &stats() { return Statistics; }
+
+    // Record bytes a client of the file system wrote, which the blocks
+    // physically written are measured against
+    // @param	bytes	    Number of logical bytes written
+    void account(size_t bytes) { LogicalBytes += bytes; }
+
+    // Return physical bytes written per logical byte (0 if none written)
+    double write_amplification() const;
+
     // Return whether or not disk is mounted
     bool mounted() const { return Mounts > 0; }
 
@@ -55,4 +269,14 @@ public:
     // @param	blocknum    Block to write to
     // @param	data	    Buffer to write from
     void write(int blocknum, char *data);
+
+    // Read several blocks from disk
+    // @param	blocks	    Blocks to read from
+    // @param	data	    Buffers to read into (one per block)
+    void read(const std::vector<int> &blocks, const std::vector<char *> &data);
+
+    // Write several blocks to disk
+    // @param	blocks	    Blocks to write to
+    // @param	data	    Buffers to write from (one per block)
+    void write(const std::vector<int> &blocks, const std::vector<char *> &data);
 };
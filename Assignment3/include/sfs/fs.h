@@ -2,11 +2,27 @@
 
 #pragma once
 
+#include "sfs/bitmap.h"
+#include "sfs/cache.h"
 #include "sfs/disk.h"
+#include "sfs/stats.h"
+#include "sfs/trace.h"
+#include "sfs/workload.h"
 
-#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+#include <pthread.h>
+#include <stdint.h>
+
 class FileSystem
 {
 public:
@@ -14,6 +30,47 @@ public:
     const static uint32_t INODES_PER_BLOCK = 128;
     const static uint32_t POINTERS_PER_INODE = 5;
     const static uint32_t POINTERS_PER_BLOCK = 1024;
+    const static uint32_t EXTENTS_PER_INODE = 2;
+    const static uint32_t EXTENTS_PER_BLOCK = 512;
+    const static uint32_t TREE_POINTERS_PER_INODE = 2;
+    const static uint32_t TREE_LEVELS = 3;
+    const static uint32_t BITS_PER_BLOCK = Disk::BLOCK_SIZE * 8;
+
+    // On-disk format versions (images from before versioning read as 0)
+    const static uint32_t VERSION_ORIGINAL = 0;
+    const static uint32_t VERSION_BITMAPS = 1; // Persistent allocation bitmaps
+    const static uint32_t VERSION_EXTENTS = 2; // Extent-mapped inodes
+    const static uint32_t VERSION_LAZY_INODES = 3; // Inode blocks initialized on first use
+    const static uint32_t VERSION_LARGE_FILES = 4; // Pointer-tree inodes with 64-bit sizes
+    const static uint32_t VERSION_JOURNAL = 5; // Metadata write-ahead journal
+    const static uint32_t VERSION_DIRECTORIES = 6; // Root directory in the superblock, directory inodes typed
+    const static uint32_t VERSION = VERSION_DIRECTORIES;
+
+    // Inode layouts (stored in Inode::Valid, so any layout reads as valid)
+    const static uint32_t LAYOUT_POINTERS = 1; // Direct and indirect pointers
+    const static uint32_t LAYOUT_EXTENTS = 2;  // (start, length) extents
+    const static uint32_t LAYOUT_TREE = 3;     // Direct, indirect, double and triple indirect pointers
+    const static uint32_t LAYOUT_MASK = 0xffff;
+
+    // Inode types, kept above the layout in Inode::Valid (VERSION_DIRECTORIES
+    // and later; inodes without a type are regular files)
+    const static uint32_t TYPE_DIRECTORY = 0x10000; // Holds a Directory
+
+    // Readahead window bounds, in blocks
+    const static size_t READAHEAD_MIN = 4;
+    const static size_t DEFAULT_READAHEAD = 64;
+
+    // Journal region bounds, in blocks (smaller disks go without a journal)
+    const static uint32_t JOURNAL_MIN_BLOCKS = 16;
+    const static uint32_t JOURNAL_MAX_BLOCKS = 1024;
+    const static uint32_t JOURNAL_MAGIC = 0x4a4e4c44;
+    const static uint32_t JOURNAL_COMMIT_MAGIC = 0x4a434d54;
+    const static uint32_t BLOCKS_PER_DESCRIPTOR = 1020;
+
+    // Superblock states
+    const static uint32_t STATE_CLEAN = 0x434c454e;
+    const static uint32_t STATE_DIRTY = 0x44495254;     // Mounted; bitmaps are rebuilt after a crash
+    const static uint32_t STATE_JOURNALED = 0x4a524e4c; // Mounted; the journal is replayed after a crash
 
 private:
     struct SuperBlock
@@ -22,14 +79,61 @@ private:
         uint32_t Blocks;      // Number of blocks in file system
         uint32_t InodeBlocks; // Number of blocks reserved for inodes
         uint32_t Inodes;      // Number of inodes in file system
+        uint32_t Version;     // On-disk format version
+        uint32_t State;       // Whether or not file system was cleanly unmounted
+        uint32_t BitmapBlocks;      // Number of blocks reserved for the free block bitmap
+        uint32_t InodeBitmapBlocks; // Number of blocks reserved for the free inode bitmap
+        uint32_t InodeHighWater;    // Number of inode blocks initialized (the rest read as empty)
+        uint32_t JournalBlocks;     // Number of blocks reserved for the journal (0 if none)
+        uint32_t RootDirectory;     // Inode of the root directory plus one (0 if none)
+    };
+
+    struct JournalDescriptor
+    {                      // First block of a logged transaction
+        uint32_t Magic;    // JOURNAL_MAGIC
+        uint32_t Count;    // Number of logged blocks that follow
+        uint64_t Sequence; // Transaction number
+        uint32_t Homes[BLOCKS_PER_DESCRIPTOR]; // Where each logged block belongs
+    };
+
+    struct JournalCommit
+    {                      // Block after the logged blocks
+        uint32_t Magic;    // JOURNAL_COMMIT_MAGIC
+        uint32_t Count;    // Same as the descriptor
+        uint64_t Sequence; // Same as the descriptor
+        uint64_t Checksum; // Of the descriptor and every logged block
+    };
+
+    struct Extent
+    {
+        uint32_t Start;  // First block of extent
+        uint32_t Length; // Number of blocks in extent
     };
 
     struct Inode
     {
-        uint32_t Valid;                      // Whether or not inode is valid
-        uint32_t Size;                       // Size of file
-        uint32_t Direct[POINTERS_PER_INODE]; // Direct pointers
-        uint32_t Indirect;                   // Indirect pointer
+        uint32_t Valid; // Whether or not inode is valid (and its layout)
+        uint32_t Size;  // Size of file (low half for LAYOUT_TREE)
+        union
+        {
+            struct // LAYOUT_POINTERS
+            {
+                uint32_t Direct[POINTERS_PER_INODE]; // Direct pointers
+                uint32_t Indirect;                   // Indirect pointer
+            };
+            struct // LAYOUT_EXTENTS
+            {
+                Extent Extents[EXTENTS_PER_INODE]; // Inline extents
+                uint32_t ExtentCount;              // Number of extents
+                uint32_t ExtentBlock;              // Block of further extents
+            };
+            struct // LAYOUT_TREE
+            {
+                uint32_t TreeDirect[TREE_POINTERS_PER_INODE]; // Direct pointers
+                uint32_t TreeIndirect[TREE_LEVELS];           // Single, double and triple indirect pointers
+                uint32_t SizeHigh;                            // High half of size
+            };
+        };
     };
 
     union Block
@@ -37,29 +141,274 @@ private:
         SuperBlock Super;                      // Superblock
         Inode Inodes[INODES_PER_BLOCK];        // Inode block
         uint32_t Pointers[POINTERS_PER_BLOCK]; // Pointer block
+        Extent Extents[EXTENTS_PER_BLOCK];     // Extent block
+        JournalDescriptor Descriptor;          // Journal descriptor block
+        JournalCommit Commit;                  // Journal commit block
         char Data[Disk::BLOCK_SIZE];           // Data block
     };
 
     // TODO: Internal helper functions
     bool load_inode(size_t inumber, Inode *node);
     bool save_inode(size_t inumber, Inode *node);
+    Inode *inode_block(size_t block_number);
+    void sync_inodes();
+    static void load_bitmap(Disk *disk, Bitmap &bitmap, size_t start);
+    static void save_bitmap(Disk *disk, Bitmap &bitmap, size_t start, std::vector<bool> &dirty);
+    void rebuild_bitmaps();
+    void sync_bitmaps();
+    void mark_free_block(size_t block, bool free);
+    void mark_free_inode(size_t inumber, bool free);
+    void write_state(uint32_t state);
     ssize_t allocate_free_block();
+    ssize_t allocate_run(size_t goal, size_t length, size_t *allocated);
+    void release_run(size_t start, size_t length);
+    size_t max_file_size(const Inode &inode);
+    static uint32_t layout(const Inode &inode) { return inode.Valid & LAYOUT_MASK; }
+    static size_t file_size(const Inode &inode);
+    static void set_file_size(Inode &inode, size_t size);
+    static void split_buffers(char *data, size_t length, size_t skip, size_t count, char *head, char *tail, std::vector<char *> &buffers);
+    static void copy_partial(char *data, size_t length, size_t skip, const std::vector<char *> &buffers, char *head, char *tail, bool to_data);
+    void map_blocks(size_t inumber, Inode &inode, size_t first, size_t count, std::vector<int> &blocks);
+    size_t allocate_blocks(Inode &inode, size_t first, size_t count, std::vector<int> &blocks);
+    size_t allocate_pointers(Inode &inode, size_t first, size_t count, std::vector<int> &blocks);
+    size_t allocate_tree(Inode &inode, size_t first, size_t count, std::vector<int> &blocks);
+    static bool tree_path(size_t block, size_t *level, size_t *digits, size_t *leaf_first);
+    std::shared_ptr<Block> load_leaf(Inode &inode, size_t block, size_t *leaf_first);
+    static void tree_blocks(Disk *disk, FileSystem *fs, uint32_t root, size_t depth, std::vector<int> &pointers, std::vector<int> &data);
+    void forget_stream(size_t inumber, bool leaf_only);
+    size_t allocate_extents(Inode &inode, size_t first, size_t count, std::vector<int> &blocks);
+    void extent_blocks(const std::vector<Extent> &extents, size_t first, size_t count, std::vector<int> &blocks);
+    void load_extents(Inode &inode, std::vector<Extent> &extents);
+    void save_extents(Inode &inode, const std::vector<Extent> &extents);
+    void owned_blocks(Inode &inode, std::vector<int> &blocks);
+    void readahead(size_t inumber, size_t offset, size_t length, size_t size);
+    void prefetch(size_t inumber, size_t first, size_t count);
+    static void bitmap_block(Bitmap &bitmap, size_t index, char *data);
+    void read_metadata(int block, char *data);
+    void write_metadata(const std::vector<int> &blocks, const std::vector<char *> &data);
+    void journal_dirtied(size_t blocks);
+    size_t journal_capacity() const;
+    void revoke(const std::vector<int> &blocks);
+    void commit();
+    void commit_transaction();
+    void replay_journal();
+    static uint64_t checksum(const char *data, size_t length, uint64_t hash);
+    ssize_t create_inode();
+    bool remove_inode(size_t inumber);
+    ssize_t write_inode(size_t inumber, char *data, size_t length, size_t offset);
+    void periodic_sync();
+    void sync_all();
 
     // TODO: Internal member variables
     Disk *disk;
+    SuperBlock super;
     unsigned int num_blocks;
     unsigned int num_inode_blocks;
     unsigned int num_inodes;
-    std::vector<int> free_bitmap;
+    Bitmap free_bitmap;
+    size_t alloc_cursor;
+    Bitmap inode_bitmap;
+    size_t inode_cursor;
+
+    // On-disk bitmap regions (VERSION_BITMAPS and later) and the bitmap
+    // blocks changed since the last sync
+    unsigned int bitmap_start;
+    unsigned int inode_bitmap_start;
+    unsigned int journal_start;
+    unsigned int journal_blocks;
+    unsigned int data_start;
+    std::vector<bool> bitmap_dirty;
+    std::vector<bool> inode_bitmap_dirty;
+
+    // In-memory inode table: one packed block of inodes per inode block,
+    // loaded on first use and written back whole when marked dirty.  Blocks
+    // at or past the high-water mark were never initialized on disk, so they
+    // start out empty instead of being read.
+    std::vector<Block *> inode_table;
+    std::vector<bool> inode_dirty;
+    unsigned int inode_high_water;
+
+    BlockCache cache;
+    size_t cache_capacity;
+    BlockCache::Policy cache_policy;
+
+    // Concurrency: a reader/writer lock per inode orders writers of a file
+    // against its readers, table_lock guards the inode table and alloc_lock
+    // the bitmaps and cursors.  Locks are taken in that order, before the
+    // block cache's own lock.
+    std::vector<pthread_rwlock_t> inode_locks;
+    std::mutex table_lock;
+    std::mutex alloc_lock;
+    pthread_rwlock_t *inode_lock(size_t inumber);
+
+    // Asynchronous requests run on a pool of disk->queue_depth() I/O threads,
+    // started on first use and drained at unmount
+    std::vector<std::thread> async_workers;
+    std::deque<std::function<void()> > async_queue;
+    std::mutex async_lock;
+    std::condition_variable async_ready;
+    bool async_stop;
+    std::future<ssize_t> submit_async(std::function<ssize_t()> request);
+    void async_worker();
+    void stop_async();
+
+    // Readahead: each inode's read stream is sequential while every read
+    // starts where the last one ended.  Its window doubles with each
+    // sequential read (up to readahead_max) and halves on a random one, and
+    // the blocks ahead of the stream are prefetched on the I/O threads.
+    // A stream also keeps the last pointer block it resolved, so mapping
+    // consecutive reads does not walk the pointer tree every time; writes
+    // that may change the tree drop it.
+    struct Stream
+    {
+        size_t Next;   // Offset a sequential read starts at
+        size_t Window; // Blocks to keep read ahead (0 until sequential)
+        size_t Ahead;  // First block not yet read ahead
+        std::shared_ptr<Block> Leaf; // Last pointer block mapped (may be null)
+        size_t LeafFirst;            // First file block Leaf points to
+
+        Stream() : Next(0), Window(0), Ahead(0), LeafFirst(0) {}
+    };
+    std::unordered_map<size_t, Stream> streams;
+    std::mutex stream_lock;
+    size_t readahead_max;
+
+    // Journal (images with a journal region): metadata updates collect in a
+    // running transaction until it is committed as a whole.  Inode and
+    // bitmap blocks are picked up from their dirty flags, and pointer and
+    // extent blocks are held in journal_running instead of the block cache
+    // (so reads of them look there first).  A commit logs every block of the
+    // transaction to the journal, syncs, writes the blocks home and syncs
+    // again, so the journal only ever holds the last transaction and mount
+    // just replays it.  Operations hold journal_barrier shared while they
+    // update metadata, and a commit holds it exclusively just long enough to
+    // take the transaction over, so everything finished by then goes out in
+    // one group commit.
+    std::unordered_map<int, Block> journal_running;
+    std::unordered_map<int, Block> journal_committing;
+    std::atomic<size_t> journal_size;    // Blocks dirtied since the last commit
+    std::atomic<bool> journal_queued;    // Whether or not a commit is queued
+    uint64_t journal_sequence;
+    bool super_dirty;                    // Superblock changed outside the high-water mark (guarded by table_lock)
+    std::mutex journal_lock;             // Guards both transactions
+    std::condition_variable journal_idle; // Signalled when a commit has written its blocks home
+    pthread_rwlock_t journal_barrier;
+    std::mutex commit_lock;              // Guards committing and commits
+    std::condition_variable commit_done;
+    bool committing;
+    size_t commits;
+
+    // Durability: with Disk::SYNC_ALWAYS every create, remove and write
+    // syncs before returning (concurrent ones sharing a commit and an
+    // fdatasync), and with Disk::SYNC_PERIODIC a thread syncs every
+    // interval until unmount
+    Disk::Durability durability;
+    std::thread sync_thread;
+    std::mutex sync_lock;
+    std::condition_variable sync_wake;
+    bool sync_stop;
+
+    // Latency of every public operation and of inode loads and block
+    // allocations; the disk keeps its own for block I/O
+    Stats statistics;
 
 public:
-    static void debug(Disk *disk);
+    // mount, unmount, format and debug must not overlap other calls; every
+    // other operation may be called from many threads at once
+    FileSystem(size_t cache_capacity = BlockCache::DEFAULT_CAPACITY,
+               BlockCache::Policy cache_policy = BlockCache::LRU);
+    ~FileSystem();
+
+    void debug(Disk *disk);
     static bool format(Disk *disk);
 
     bool mount(Disk *disk);
+    void unmount();
+    // Write back everything cached; with a journal this commits every
+    // update made so far
+    void sync();
     ssize_t create();
     bool remove(size_t inumber);
-    ssize_t stat(size_t inumber);
+    // Return the logical size of inumber (holes included), storing the
+    // number of blocks it occupies (data and mapping blocks) in blocks
+    ssize_t stat(size_t inumber, size_t *blocks = nullptr);
     ssize_t read(size_t inumber, char *data, size_t length, size_t offset);
     ssize_t write(size_t inumber, char *data, size_t length, size_t offset);
+
+    // Queue read or write without waiting for it; the future yields what
+    // read or write returns.  data must stay valid until the future is
+    // ready, and requests to the same inode may complete in any order.
+    std::future<ssize_t> read_async(size_t inumber, char *data, size_t length, size_t offset);
+    std::future<ssize_t> write_async(size_t inumber, char *data, size_t length, size_t offset);
+
+    // Read-only view of a byte range of a file: a sequence of spans into
+    // blocks pinned in the block cache or the mapped image, falling back to
+    // private copies only when neither can hold a block.  Spans stay valid
+    // until the view is unpinned (or destroyed), which must happen before
+    // unmount; later writes to the file may show through.
+    class View
+    {
+    public:
+        struct Span
+        {
+            const char *Data;
+            size_t Length;
+        };
+
+        View() : cache(nullptr) {}
+        ~View() { release(); }
+
+        const std::vector<Span> &spans() const { return span_list; }
+        size_t size() const;
+
+    private:
+        friend class FileSystem;
+
+        BlockCache *cache;                       // Cache holding the pins
+        std::vector<Span> span_list;
+        std::vector<int> pinned;                 // Blocks pinned in cache
+        std::vector<std::vector<char> > copies;  // Blocks that could not be pinned
+
+        void release();
+
+        View(const View &) = delete;
+        View &operator=(const View &) = delete;
+    };
+
+    // Pin a view of up to length bytes of inumber starting at offset,
+    // releasing whatever the view held before
+    // Returns the number of bytes in the view or -1 on error.
+    ssize_t pin(size_t inumber, size_t length, size_t offset, View &view);
+
+    // Release a view's pins
+    void unpin(View &view) { view.release(); }
+
+    // Set the largest readahead window in blocks (0 disables readahead)
+    void set_readahead(size_t blocks) { readahead_max = blocks; }
+
+    // Return the inode of the root directory, or -1 if there is none (or
+    // the image predates VERSION_DIRECTORIES)
+    ssize_t root();
+
+    // Record inumber as the root directory; the file system only keeps the
+    // number, the directory itself is up to the caller (see Directory)
+    // Returns false if inumber is not a valid inode or the image predates
+    // VERSION_DIRECTORIES.
+    bool set_root(size_t inumber);
+
+    // Return whether or not inumber is marked as a directory
+    bool is_directory(size_t inumber);
+
+    // Mark inumber as a directory, or as a regular file again; like
+    // set_root, the contents are up to the caller
+    // Returns false if inumber is not a valid inode or the image predates
+    // VERSION_DIRECTORIES.
+    bool set_directory(size_t inumber, bool directory);
+
+    size_t inodes() const { return num_inodes; }
+    ssize_t free_blocks();
+    ssize_t free_inodes();
+
+    // Return operation latency histograms
+    Stats &stats() { return statistics; }
 };
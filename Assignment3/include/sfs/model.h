@@ -0,0 +1,93 @@
+// model.h: Mechanical disk timing model
+
+#pragma once
+
+#include "sfs/stats.h"
+
+#include <mutex>
+#include <vector>
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Seek, rotate and transfer model of a single-head disk, after Assignment1's
+// disk.py: blocks are laid out track by track from the outside in, zones of
+// tracks hold different numbers of blocks, and each track starts skew
+// blocks further round than the one outside it.  Every request (a run of
+// adjacent blocks) is served in the order it arrives, back to back: the arm
+// seeks to the track of its first block, waits for the block to come round
+// and transfers until the run ends, crossing tracks as it goes.  The time
+// is only accumulated; real I/O is not delayed.
+class DiskModel {
+public:
+    // Disk geometry
+    struct Geometry {
+    	size_t		    Tracks;	// Number of tracks (0 fits the disk)
+    	std::vector<size_t> Zones;	// Blocks per track of each zone, outside in
+    	size_t		    RPM;	// Rotational speed
+    	uint64_t	    Settle;	// Nanoseconds to start and settle any seek
+    	uint64_t	    SeekPerTrack; // Nanoseconds per track crossed
+    	size_t		    Skew;	// Blocks each track is rotated past the previous
+
+    	// Default geometry: a 7200 RPM disk with three zones
+    	Geometry() : Tracks(0), RPM(7200), Settle(1000000), SeekPerTrack(2000), Skew(4) {
+    	    Zones.push_back(192);
+    	    Zones.push_back(160);
+    	    Zones.push_back(128);
+	}
+    };
+
+private:
+    Geometry		Layout;
+    std::vector<size_t> TrackStart;	// First block of each track (and one past the last)
+    uint64_t		Period;		// Nanoseconds per rotation
+
+    std::mutex		Lock;		// Guards the fields below
+    size_t		Track;		// Track the head is on
+    uint64_t		Clock;		// Modeled nanoseconds since reset
+    uint64_t		SeekTime;	// Totals of each component, in nanoseconds
+    uint64_t		RotateTime;
+    uint64_t		TransferTime;
+    uint64_t		Distance;	// Tracks crossed
+    Histogram		Service;	// Per request service time (ns) and bytes
+    Histogram		Seeks;		// Per request seek distance (tracks)
+    Histogram		Rotations;	// Per request rotational delay (ns)
+
+    // Return track holding block
+    size_t track_of(size_t block) const;
+
+    // Return slot of track that block occupies (its position in a rotation)
+    size_t slot_of(size_t block, size_t track) const;
+
+public:
+    // Lay out geometry over a disk
+    // @param	geometry    Disk geometry
+    // @param	blocks	    Number of blocks on the disk
+    // Returns false if the geometry cannot hold the disk.
+    bool setup(const Geometry &geometry, size_t blocks);
+
+    // Model one request
+    // @param	block	    First block of request
+    // @param	count	    Number of adjacent blocks
+    // @param	block_size  Bytes per block
+    // Returns modeled service time in nanoseconds.
+    uint64_t serve(size_t block, size_t count, size_t block_size);
+
+    // Forget every request, parking the head on the outer track
+    void reset();
+
+    // Print totals and seek distance and rotational delay statistics
+    void print(FILE *stream);
+
+    // Return modeled nanoseconds spent serving requests since reset
+    uint64_t elapsed();
+
+    // Return geometry
+    const Geometry &geometry() const { return Layout; }
+
+    // Parse a geometry spec: "hdd" for the defaults, or comma-separated
+    // key=value pairs out of tracks, rpm, settle (us), seek (ns per
+    // track), skew and zones (blocks per track, colon-separated)
+    // Returns false if spec is malformed.
+    static bool parse(const char *spec, Geometry *geometry);
+};
@@ -0,0 +1,103 @@
+// scheduler.h: Disk request scheduling policies
+
+#pragma once
+
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <stdint.h>
+
+// Pending block requests and the order they are dispatched in.  Requests
+// are indexed both by arrival and by block, so each policy picks its next
+// request in logarithmic time however many are queued.  Not thread-safe;
+// Disk guards it with its queue lock.
+class Scheduler {
+public:
+    // Dispatch policies (as modeled by Assignment1's disk.py)
+    enum Policy {
+    	NONE,	    // No queue: each caller transfers its own blocks directly
+    	FIFO,	    // Arrival order
+    	SSTF,	    // Shortest seek first: nearest block to the head
+    	SCAN,	    // Elevator: sweep up, then down, then up again
+    	CSCAN,	    // Circular scan: sweep up, then jump back to the lowest block
+    	DEADLINE,   // Circular scan, but serve requests that waited too long first
+    };
+
+    // Default deadlines of DEADLINE, in microseconds
+    const static uint64_t READ_DEADLINE = 500;
+    const static uint64_t WRITE_DEADLINE = 5000;
+
+    // Caller's share of the queue: it waits until all its requests are done
+    struct Completion {
+    	size_t	    Remaining;	// Requests not yet dispatched
+    	std::string Error;	// First error of any of them (empty if none)
+
+    	Completion(size_t requests) : Remaining(requests) {}
+    };
+
+    // One block to read or write
+    struct Request {
+    	int	    Block;
+    	char *	    Data;
+    	bool	    Write;
+    	uint64_t    Arrival;	// Nanoseconds, for DEADLINE
+    	Completion *Done;
+    };
+
+private:
+    typedef std::pair<int, uint64_t> Position; // (block, sequence)
+
+    Policy				    Selected;
+    uint64_t			    Deadlines[2];   // Read and write deadlines, in nanoseconds
+    std::map<uint64_t, Request>	    Arrivals;	    // Pending requests by sequence
+    std::set<Position>		    Positions;	    // Same requests by block
+    uint64_t			    Sequence;	    // Next request's sequence
+    int				    Head;	    // Block the last dispatched request ended at
+    bool			    Ascending;	    // Direction of the SCAN sweep
+
+    // Return first pending request at or above block (end if none)
+    std::set<Position>::iterator above(int block);
+
+    // Return first pending request of the highest block below block (end if none)
+    std::set<Position>::iterator below(int block);
+
+    // Pick the next request under the selected policy
+    // @param	now	    Current time, for DEADLINE
+    std::set<Position>::iterator pick(uint64_t now);
+
+public:
+    // Default constructor
+    Scheduler() : Selected(NONE), Sequence(0), Head(0), Ascending(true) {
+    	set_deadlines(READ_DEADLINE, WRITE_DEADLINE);
+    }
+
+    // Select policy (with no requests pending)
+    void set_policy(Policy policy) { Selected = policy; }
+    Policy policy() const { return Selected; }
+
+    // Set how long DEADLINE lets reads and writes wait, in microseconds
+    void set_deadlines(uint64_t read, uint64_t write) {
+    	Deadlines[0] = read * 1000;
+    	Deadlines[1] = write * 1000;
+    }
+
+    // Queue a request
+    void add(const Request &request);
+
+    // Return number of requests pending
+    size_t pending() const { return Arrivals.size(); }
+
+    // Take up to limit pending requests in the order they should be
+    // dispatched, moving the head past each one
+    // @param	limit	    Most requests to take
+    // @param	now	    Current time in nanoseconds
+    // @param	batch	    Requests taken
+    void next(size_t limit, uint64_t now, std::vector<Request> &batch);
+
+    // Return name of policy, or parse one (returns false if unknown)
+    static const char *name(Policy policy);
+    static bool parse(const char *name, Policy *policy);
+};
@@ -0,0 +1,114 @@
+// stats.h: Operation counters and latency histograms
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Log-bucketed latency histogram: each power of two of nanoseconds is split
+// into SUB_BUCKETS buckets, so a percentile is exact to within a quarter of
+// its magnitude.  Recording is a handful of relaxed atomic adds.
+class Histogram {
+public:
+    const static size_t SUB_BUCKETS = 4;
+    const static size_t BUCKETS = 64 * SUB_BUCKETS;
+
+private:
+    std::atomic<uint64_t> Buckets[BUCKETS];
+    std::atomic<uint64_t> Count;	// Number of operations
+    std::atomic<uint64_t> Bytes;	// Bytes moved by them
+    std::atomic<uint64_t> Total;	// Sum of their latencies
+    std::atomic<uint64_t> Max;		// Largest latency
+
+    // Return bucket of latency and largest latency in bucket
+    static size_t bucket(uint64_t nanoseconds);
+    static uint64_t bucket_limit(size_t bucket);
+
+public:
+    // Default constructor
+    Histogram() { reset(); }
+
+    // Record one operation
+    // @param	nanoseconds Latency of operation
+    // @param	bytes	    Bytes it moved
+    void record(uint64_t nanoseconds, uint64_t bytes);
+
+    // Add another histogram's operations to this one
+    void add(const Histogram &other);
+
+    // Forget every operation
+    void reset();
+
+    // Return latency below which fraction of operations fall (rounded up
+    // to the top of its bucket, 0 if there are none)
+    uint64_t percentile(double fraction) const;
+
+    // Return counters
+    uint64_t count() const { return Count.load(std::memory_order_relaxed); }
+    uint64_t bytes() const { return Bytes.load(std::memory_order_relaxed); }
+    uint64_t total() const { return Total.load(std::memory_order_relaxed); }
+    uint64_t max() const { return Max.load(std::memory_order_relaxed); }
+};
+
+class Stats {
+public:
+    // Instrumented operations
+    enum Operation {
+    	CREATE,
+    	REMOVE,
+    	STAT,
+    	READ,
+    	WRITE,
+    	LOAD_INODE,
+    	ALLOCATE_BLOCK,
+    	DISK_READ,
+    	DISK_WRITE,
+    	DISK_SYNC,
+    	OPERATIONS,	// Number of operations
+    };
+
+    // Times an operation from construction to destruction
+    class Timer {
+    public:
+    	Timer(Histogram &histogram) : histogram(histogram), moved(0),
+    	    start(std::chrono::steady_clock::now()) {}
+
+    	~Timer() {
+    	    std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start;
+    	    histogram.record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(), moved);
+	}
+
+	// Set bytes the operation moved
+	void bytes(uint64_t bytes) { moved = bytes; }
+
+    private:
+    	Histogram &histogram;
+    	uint64_t   moved;
+    	std::chrono::steady_clock::time_point start;
+    };
+
+private:
+    Histogram Histograms[OPERATIONS];
+
+public:
+    // Return histogram of operation
+    Histogram &operator[](Operation operation) { return Histograms[operation]; }
+    const Histogram &operator[](Operation operation) const { return Histograms[operation]; }
+
+    // Forget every operation
+    void reset();
+
+    // Return name of operation
+    static const char *name(Operation operation);
+
+    // Print every operation's counters and latency percentiles, summed
+    // over several sources, as a table or as one JSON object
+    // @param	stream	    Stream to print to
+    // @param	sources	    Statistics to sum
+    // @param	json	    Whether to print JSON (true) or a table (false)
+    static void print(FILE *stream, const std::vector<const Stats *> &sources, bool json);
+};
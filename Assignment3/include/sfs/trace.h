@@ -0,0 +1,109 @@
+// trace.h: Timeline of file system and disk operations
+
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Opt-in tracing: while started, every Span records when it began and how
+// long it took into a ring buffer owned by the calling thread, so spans
+// never contend with each other.  Spans nest by time, and stop dumps them
+// as Chrome trace-event JSON (loadable by chrome://tracing and Perfetto).
+class Trace {
+public:
+    // Events each thread keeps; older ones are overwritten
+    const static size_t RING_EVENTS = 1 << 16;
+
+    // Times the enclosing scope (does nothing unless tracing is started)
+    class Span {
+    public:
+    	// @param	category    Subsystem (fs, dir or disk)
+    	// @param	name	    Operation
+    	// @param	inode	    Inode operated on (-1 if none)
+    	// @param	block	    Block operated on (-1 if none)
+    	// @param	count	    Number of blocks (-1 if not a batch)
+    	Span(const char *category, const char *name, int64_t inode = -1, int64_t block = -1, int64_t count = -1)
+    	    : Active(Trace::enabled()) {
+	    if (Active) {
+	    	Category = category;
+	    	Name	 = name;
+	    	Inode	 = inode;
+	    	Block	 = block;
+	    	Count	 = count;
+	    	Start	 = Trace::now();
+	    }
+	}
+
+	~Span() {
+	    if (Active) {
+	    	Trace::record(Category, Name, Start, Trace::now() - Start, Inode, Block, Count);
+	    }
+	}
+
+	// Tag span with what it turned out to operate on
+	void inode(int64_t inode) { Inode = inode; }
+	void block(int64_t block) { Block = block; }
+	void count(int64_t count) { Count = count; }
+
+    private:
+    	bool	     Active;
+    	const char * Category;
+    	const char * Name;
+    	int64_t	     Inode;
+    	int64_t	     Block;
+    	int64_t	     Count;
+    	uint64_t     Start;
+
+    	Span(const Span &) = delete;
+    	Span &operator=(const Span &) = delete;
+    };
+
+    // Return whether or not tracing is started
+    static bool enabled() { return Enabled.load(std::memory_order_relaxed); }
+
+    // Start tracing, forgetting spans recorded before
+    static void start();
+
+    // Stop tracing and write every span recorded since start
+    // @param	path	    File to write the trace-event JSON to
+    // Returns number of spans written or -1 on error.
+    static ssize_t stop(const char *path);
+
+private:
+    // Recorded span; fields are atomic so a dump may read a ring while its
+    // thread overwrites the oldest events
+    struct Event {
+    	std::atomic<const char *> Category;
+    	std::atomic<const char *> Name;
+    	std::atomic<uint64_t>	  Start;
+    	std::atomic<uint64_t>	  Duration;
+    	std::atomic<int64_t>	  Inode;
+    	std::atomic<int64_t>	  Block;
+    	std::atomic<int64_t>	  Count;
+    };
+
+    // One thread's events; only that thread advances Head
+    struct Ring {
+    	Event		      Events[RING_EVENTS];
+    	std::atomic<uint64_t> Head;	// Events ever recorded
+    	std::atomic<uint64_t> Base;	// Value of Head when tracing started
+    	size_t		      Thread;	// Trace thread id
+    };
+
+    static std::atomic<bool>	 Enabled;
+    static std::atomic<uint64_t> Origin;	// Time tracing started
+    static std::mutex		 RingsLock;	// Guards Rings
+    static std::vector<Ring *>	 Rings;		// Every thread's ring, kept after it exits
+    static thread_local Ring *	 LocalRing;	// Calling thread's ring
+
+    // Return monotonic time in nanoseconds
+    static uint64_t now();
+
+    // Append span to the calling thread's ring
+    static void record(const char *category, const char *name, uint64_t start, uint64_t duration,
+    	int64_t inode, int64_t block, int64_t count);
+};
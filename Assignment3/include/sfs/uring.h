@@ -0,0 +1,86 @@
+// uring.h: Minimal io_uring submission and completion rings
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+class Uring {
+private:
+    int		    RingDescriptor; // io_uring file descriptor (-1 if not set up)
+    unsigned	    Entries;	    // Number of submission queue entries
+    unsigned	    Pending;	    // Entries prepared but not yet submitted
+
+    void *	    SqRing;	    // Mapped submission ring
+    size_t	    SqSize;
+    void *	    CqRing;	    // Mapped completion ring (may alias SqRing)
+    size_t	    CqSize;
+    io_uring_sqe *  Sqes;	    // Mapped submission queue entries
+    size_t	    SqesSize;
+
+    unsigned *	    SqHead;
+    unsigned *	    SqTail;
+    unsigned *	    SqMask;
+    unsigned *	    SqArray;
+    unsigned *	    CqHead;
+    unsigned *	    CqTail;
+    unsigned *	    CqMask;
+    io_uring_cqe *  Cqes;
+
+public:
+    // Default constructor
+    Uring() : RingDescriptor(-1), Entries(0), Pending(0), SqRing(NULL),
+    	SqSize(0), CqRing(NULL), CqSize(0), Sqes(NULL), SqesSize(0) {}
+
+    // Destructor
+    ~Uring() { teardown(); }
+
+    // Create rings with room for entries requests
+    // @param	entries	    Submission queue depth
+    // Returns false if the kernel does not provide io_uring.
+    bool setup(unsigned entries);
+
+    // Unmap rings and close the io_uring descriptor
+    void teardown();
+
+    // Return whether or not rings are set up
+    bool ready() const { return RingDescriptor >= 0; }
+
+    // Return submission queue depth
+    unsigned entries() const { return Entries; }
+
+    // Queue a vectored read or write
+    // @param	write	    Whether to write (true) or read (false)
+    // @param	fd	    File to operate on
+    // @param	iov	    Buffers (must stay valid until completion)
+    // @param	count	    Number of buffers
+    // @param	offset	    File offset
+    // @param	user_data   Value returned with the completion
+    // Returns false if the submission queue is full.
+    bool prepare(bool write, int fd, const struct iovec *iov, unsigned count, off_t offset, uint64_t user_data);
+
+    // Submit prepared requests
+    // Returns number of requests submitted or -errno.
+    int submit();
+
+    // Drop prepared requests the kernel has not taken, so they are never
+    // submitted (their buffers may go away)
+    // Returns number of requests dropped.
+    unsigned discard();
+
+    // Wait until at least one completion is available; unlike the other
+    // calls this may run concurrently with prepare and submit
+    // Returns 0 or -errno.
+    int wait();
+
+    // Pop one completion
+    // @param	user_data   Value given to prepare
+    // @param	result	    Bytes transferred or -errno
+    // Returns false if no completion is available.
+    bool reap(uint64_t *user_data, int *result);
+};
@@ -0,0 +1,93 @@
+// workload.h: Recorded sequences of file system calls
+
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+// Workload recording: while started, every FileSystem call is appended to a
+// binary trace with its arguments, the time it started and the thread that
+// made it, so the same sequence can be replayed against a fresh image.
+// File data is not recorded, only how much was moved.
+class Workload {
+public:
+    const static uint32_t MAGIC_NUMBER = 0x57534653;	// "SFSW"
+    const static uint32_t VERSION = 1;
+
+    // Recorded calls
+    enum Operation {
+    	CREATE,
+    	REMOVE,
+    	STAT,
+    	READ,
+    	WRITE,
+    	SYNC,
+    	OPERATIONS,	// Number of operations
+    };
+
+    // Inode of a create that failed
+    const static uint32_t NO_INODE = UINT32_MAX;
+
+    // Start of a trace file
+    struct Header {
+    	uint32_t MagicNumber;	// MAGIC_NUMBER
+    	uint32_t Version;	// VERSION
+    };
+
+    // One call, 32 bytes on disk
+    struct Record {
+    	uint64_t Time;		// Nanoseconds from start of recording to the call (to its return for create)
+    	uint64_t Offset;	// Byte offset (read and write)
+    	uint32_t Length;	// Bytes requested (read and write)
+    	uint32_t Inode;		// Inode operated on, or created (NO_INODE if create failed)
+    	uint32_t Thread;	// Recording thread id
+    	uint32_t Operation;	// Operation
+    };
+
+    // Return whether or not recording is started
+    static bool recording() { return Recording.load(std::memory_order_relaxed); }
+
+    // Start recording to a new trace
+    // @param	path	    File to write the trace to
+    // Returns whether or not recording started.
+    static bool start(const char *path);
+
+    // Stop recording and close the trace
+    // Returns number of calls recorded or -1 on error.
+    static ssize_t stop();
+
+    // Append a call made now (does nothing unless recording)
+    static void record(Operation operation, size_t inode = NO_INODE, size_t length = 0, size_t offset = 0) {
+    	if (recording()) {
+    	    append(operation, inode, length, offset);
+	}
+    }
+
+    // Read every call of a trace
+    // @param	path	    File to read the trace from
+    // @param	records	    Calls, in the order they were recorded
+    // Returns whether or not the trace was read.
+    static bool load(const char *path, std::vector<Record> &records);
+
+    // Return name of operation
+    static const char *name(Operation operation);
+
+private:
+    static std::atomic<bool> Recording;
+    static std::mutex	     Lock;	// Guards Stream and Records
+    static FILE *	     Stream;
+    static size_t	     Records;	// Calls recorded so far
+    static uint64_t	     Origin;	// Time recording started
+    static std::atomic<uint32_t> Threads;	// Thread ids handed out
+    static thread_local uint32_t Thread;	// Calling thread's id (0 until it records)
+
+    // Return monotonic time in nanoseconds
+    static uint64_t now();
+
+    static void append(Operation operation, size_t inode, size_t length, size_t offset);
+};
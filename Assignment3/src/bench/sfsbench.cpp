@@ -0,0 +1,565 @@
+// sfsbench.cpp: File system microbenchmarks
+
+#include "sfs/directory.h"
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+#include "sfs/stats.h"
+
+#include <chrono>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Largest file the throughput benchmarks write, in bytes
+#define MAX_STREAM_SIZE	(16*1024*1024)
+
+// Number of files the create and small file benchmarks make
+#define FILES		2000
+
+// Number of requests the random I/O benchmarks issue
+#define RANDOM_OPS	2000
+
+// Number of remounts the mount benchmark times
+#define MOUNTS		20
+
+// Sizes the directory benchmark grows its directory through, and the
+// lookups it times at each
+#define DIRECTORY_MIN	1024
+#define DIRECTORY_MAX	(256*1024)
+#define LOOKUPS		10000
+
+typedef std::chrono::steady_clock Clock;
+
+// Outcome of one benchmark
+struct Result {
+    std::string Name;
+    double	OpsPerSecond;
+    double	MBPerSecond;
+    uint64_t	P50;	    // Latency percentiles, in nanoseconds
+    uint64_t	P99;
+    uint64_t	P999;
+};
+
+// Settings shared by every benchmark
+struct Options {
+    size_t	     Blocks;	    // Blocks in each fresh image
+    size_t	     CacheCapacity; // Blocks in block cache
+    size_t	     Runs;	    // Runs of each benchmark (the best one is kept)
+    const char *     Filter;	    // Only benchmarks whose name contains this
+};
+
+// Times operations, one at a time, into a histogram
+class Recorder {
+public:
+    Recorder() : Bytes(0), Start(Clock::now()) {}
+
+    // Time one operation moving bytes
+    template <typename Operation>
+    bool time(size_t bytes, Operation operation) {
+    	Clock::time_point start = Clock::now();
+    	bool ok = operation();
+    	Latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count(), bytes);
+    	Bytes += bytes;
+    	return ok;
+    }
+
+    // Summarize operations timed so far
+    Result result(const std::string &name) const {
+    	double seconds = std::chrono::duration<double>(Clock::now() - Start).count();
+    	Result result = {name, Latency.count() / seconds, Bytes / seconds / (1024*1024),
+	    Latency.percentile(0.5), Latency.percentile(0.99), Latency.percentile(0.999)};
+	return result;
+    }
+
+private:
+    Histogram	      Latency;
+    size_t	      Bytes;
+    Clock::time_point Start;
+};
+
+// Fill buffer with bytes that differ from block to block
+void fill_pattern(std::vector<char> &buffer, unsigned int seed) {
+    for (size_t i = 0; i < buffer.size(); i++) {
+    	buffer[i] = (char)((seed * 131 + i * 7 + i / Disk::BLOCK_SIZE) & 0xff);
+    }
+}
+
+// Write size bytes to inumber in chunks of io_size
+bool write_file(FileSystem &fs, size_t inumber, size_t size, size_t io_size, Recorder *recorder) {
+    std::vector<char> buffer(io_size);
+    fill_pattern(buffer, inumber);
+
+    for (size_t offset = 0; offset < size; offset += io_size) {
+    	size_t length = std::min(io_size, size - offset);
+    	bool ok;
+    	if (recorder) {
+    	    ok = recorder->time(length, [&]() { return fs.write(inumber, buffer.data(), length, offset) == (ssize_t)length; });
+	} else {
+	    ok = fs.write(inumber, buffer.data(), length, offset) == (ssize_t)length;
+	}
+	if (!ok) {
+	    fprintf(stderr, "write of inode %lu failed at %lu\n", inumber, offset);
+	    return false;
+	}
+    }
+    return true;
+}
+
+// Benchmarks ------------------------------------------------------------------
+
+// Each benchmark runs against a freshly formatted and mounted file system
+// and appends its results
+typedef bool (*Benchmark)(Disk &disk, FileSystem &fs, const Options &options, std::vector<Result> &results);
+
+bool bench_create_remove(Disk &disk, FileSystem &fs, const Options &options, std::vector<Result> &results) {
+    std::vector<ssize_t> inumbers;
+    size_t files = std::min((size_t)FILES, fs.inodes());
+
+    Recorder creates;
+    for (size_t i = 0; i < files; i++) {
+    	ssize_t inumber = -1;
+    	if (!creates.time(0, [&]() { return (inumber = fs.create()) >= 0; })) {
+    	    return false;
+	}
+	inumbers.push_back(inumber);
+    }
+    results.push_back(creates.result("create"));
+
+    Recorder removes;
+    for (size_t i = 0; i < inumbers.size(); i++) {
+    	if (!removes.time(0, [&]() { return fs.remove(inumbers[i]); })) {
+    	    return false;
+	}
+    }
+    results.push_back(removes.result("remove"));
+    return true;
+}
+
+// Format the I/O size of a benchmark's name
+void io_suffix(char *suffix, size_t size, size_t io_size) {
+    if (io_size >= 1024*1024) {
+    	snprintf(suffix, size, "_%lum", io_size / (1024*1024));
+    } else {
+    	snprintf(suffix, size, "_%luk", io_size / 1024);
+    }
+}
+
+// Size of the streaming benchmarks' file on this image
+size_t stream_size(FileSystem &fs) {
+    return std::min((size_t)MAX_STREAM_SIZE, fs.free_blocks() / 4 * Disk::BLOCK_SIZE);
+}
+
+bool bench_sequential(Disk &disk, FileSystem &fs, size_t io_size, std::vector<Result> &results) {
+    char   suffix[32];
+    size_t size    = stream_size(fs);
+    ssize_t inumber = fs.create();
+    if (inumber < 0) {
+    	return false;
+    }
+    io_suffix(suffix, sizeof(suffix), io_size);
+
+    Recorder writes;
+    if (!write_file(fs, inumber, size, io_size, &writes)) {
+    	return false;
+    }
+    results.push_back(writes.result(std::string("seq_write") + suffix));
+
+    std::vector<char> buffer(io_size);
+    Recorder reads;
+    for (size_t offset = 0; offset < size; offset += io_size) {
+    	size_t length = std::min(io_size, size - offset);
+    	if (!reads.time(length, [&]() { return fs.read(inumber, buffer.data(), length, offset) == (ssize_t)length; })) {
+    	    return false;
+	}
+    }
+    results.push_back(reads.result(std::string("seq_read") + suffix));
+    return true;
+}
+
+bool bench_sequential_4k(Disk &disk, FileSystem &fs, const Options &options, std::vector<Result> &results) {
+    return bench_sequential(disk, fs, 4*1024, results);
+}
+
+bool bench_sequential_64k(Disk &disk, FileSystem &fs, const Options &options, std::vector<Result> &results) {
+    return bench_sequential(disk, fs, 64*1024, results);
+}
+
+bool bench_sequential_1m(Disk &disk, FileSystem &fs, const Options &options, std::vector<Result> &results) {
+    return bench_sequential(disk, fs, 1024*1024, results);
+}
+
+bool bench_random(Disk &disk, FileSystem &fs, size_t io_size, std::vector<Result> &results) {
+    char   suffix[32];
+    size_t size    = stream_size(fs);
+    size_t slots   = size / io_size;
+    ssize_t inumber = fs.create();
+    if (inumber < 0 || slots == 0 || !write_file(fs, inumber, size, 1024*1024, NULL)) {
+    	return false;
+    }
+    io_suffix(suffix, sizeof(suffix), io_size);
+
+    std::vector<char> buffer(io_size);
+    fill_pattern(buffer, inumber);
+
+    unsigned int seed = 1;
+    Recorder writes;
+    for (size_t i = 0; i < RANDOM_OPS; i++) {
+    	size_t offset = (rand_r(&seed) % slots) * io_size;
+    	if (!writes.time(io_size, [&]() { return fs.write(inumber, buffer.data(), io_size, offset) == (ssize_t)io_size; })) {
+    	    return false;
+	}
+    }
+    results.push_back(writes.result(std::string("rand_write") + suffix));
+
+    Recorder reads;
+    for (size_t i = 0; i < RANDOM_OPS; i++) {
+    	size_t offset = (rand_r(&seed) % slots) * io_size;
+    	if (!reads.time(io_size, [&]() { return fs.read(inumber, buffer.data(), io_size, offset) == (ssize_t)io_size; })) {
+    	    return false;
+	}
+    }
+    results.push_back(reads.result(std::string("rand_read") + suffix));
+    return true;
+}
+
+bool bench_random_4k(Disk &disk, FileSystem &fs, const Options &options, std::vector<Result> &results) {
+    return bench_random(disk, fs, 4*1024, results);
+}
+
+bool bench_random_64k(Disk &disk, FileSystem &fs, const Options &options, std::vector<Result> &results) {
+    return bench_random(disk, fs, 64*1024, results);
+}
+
+bool bench_mount(Disk &disk, FileSystem &fs, const Options &options, std::vector<Result> &results) {
+    // Give mount some inodes and bitmaps worth loading
+    for (size_t i = 0; i < 64; i++) {
+    	ssize_t inumber = fs.create();
+    	if (inumber < 0 || !write_file(fs, inumber, 8*Disk::BLOCK_SIZE, 8*Disk::BLOCK_SIZE, NULL)) {
+    	    return false;
+	}
+    }
+
+    Recorder mounts;
+    for (size_t i = 0; i < MOUNTS; i++) {
+    	fs.unmount();
+    	if (!mounts.time(0, [&]() { return fs.mount(&disk); })) {
+    	    return false;
+	}
+    }
+    results.push_back(mounts.result("mount"));
+    return true;
+}
+
+bool bench_small_files(Disk &disk, FileSystem &fs, const Options &options, std::vector<Result> &results) {
+    std::vector<char> buffer(Disk::BLOCK_SIZE);
+    size_t files = std::min((size_t)FILES, std::min(fs.inodes(), (size_t)fs.free_blocks() / 2));
+
+    // One operation creates, writes, reads back and removes a one block file
+    Recorder recorder;
+    for (size_t i = 0; i < files; i++) {
+    	bool ok = recorder.time(2*buffer.size(), [&]() {
+    	    ssize_t inumber = fs.create();
+    	    return inumber >= 0
+    	    	&& fs.write(inumber, buffer.data(), buffer.size(), 0) == (ssize_t)buffer.size()
+    	    	&& fs.read(inumber, buffer.data(), buffer.size(), 0) == (ssize_t)buffer.size()
+    	    	&& fs.remove(inumber);
+	});
+	if (!ok) {
+	    return false;
+	}
+    }
+    results.push_back(recorder.result("small_file"));
+    return true;
+}
+
+bool bench_large_file(Disk &disk, FileSystem &fs, const Options &options, std::vector<Result> &results) {
+    // The largest file the image holds, leaving room for its mapping blocks
+    size_t  size    = fs.free_blocks() / 10 * 9 * Disk::BLOCK_SIZE;
+    ssize_t inumber = fs.create();
+    if (inumber < 0) {
+    	return false;
+    }
+
+    Recorder writes;
+    if (!write_file(fs, inumber, size, 1024*1024, &writes)) {
+    	return false;
+    }
+    results.push_back(writes.result("large_file_write"));
+
+    std::vector<char> buffer(1024*1024);
+    Recorder reads;
+    for (size_t offset = 0; offset < size; offset += buffer.size()) {
+    	size_t length = std::min(buffer.size(), size - offset);
+    	if (!reads.time(length, [&]() { return fs.read(inumber, buffer.data(), length, offset) == (ssize_t)length; })) {
+    	    return false;
+	}
+    }
+    results.push_back(reads.result("large_file_read"));
+
+    Recorder removes;
+    if (!removes.time(0, [&]() { return fs.remove(inumber); })) {
+    	return false;
+    }
+    results.push_back(removes.result("large_file_remove"));
+    return true;
+}
+
+bool bench_directory(Disk &disk, FileSystem &fs, const Options &options, std::vector<Result> &results) {
+    ssize_t   inumber = Directory::create(&fs);
+    Directory directory;
+    if (inumber < 0 || !directory.open(&fs, inumber)) {
+    	return false;
+    }
+
+    // Grow the directory by factors of four for as long as the image holds
+    // it with every leaf half full, timing lookups of random names at each
+    // size; the rate should hold steady as it grows.  The link rate is that
+    // of the last step, which makes three quarters of the entries.
+    size_t limit = std::min((size_t)DIRECTORY_MAX, (size_t)fs.free_blocks() * Directory::ENTRIES_PER_LEAF / 2);
+    char   name[64];
+    size_t entries = 0;
+    unsigned int seed = 1;
+    Result linked;
+    for (size_t size = DIRECTORY_MIN; size <= limit; size *= 4) {
+    	Recorder links;
+    	for (; entries < size; entries++) {
+    	    snprintf(name, sizeof(name), "entry-%lu", entries);
+    	    if (!links.time(0, [&]() { return directory.link(name, entries % fs.inodes()); })) {
+    	    	return false;
+	    }
+	}
+	linked = links.result("dir_link");
+
+	Recorder lookups;
+	for (size_t i = 0; i < LOOKUPS; i++) {
+	    size_t entry = rand_r(&seed) % entries;
+	    snprintf(name, sizeof(name), "entry-%lu", entry);
+	    if (!lookups.time(0, [&]() { return directory.lookup(name) == (ssize_t)(entry % fs.inodes()); })) {
+	    	return false;
+	    }
+	}
+	results.push_back(lookups.result("dir_lookup_" + std::to_string(size / 1024) + "k"));
+    }
+    if (entries == 0) {
+    	return false;
+    }
+    results.push_back(linked);
+
+    Recorder unlinks;
+    for (size_t i = 0; i < std::min((size_t)LOOKUPS, entries); i++) {
+    	snprintf(name, sizeof(name), "entry-%lu", i);
+    	if (!unlinks.time(0, [&]() { return directory.unlink(name); })) {
+    	    return false;
+	}
+    }
+    results.push_back(unlinks.result("dir_unlink"));
+    return true;
+}
+
+struct {
+    const char *Name;
+    Benchmark	Run;
+} Benchmarks[] = {
+    {"create_remove",	bench_create_remove},
+    {"seq_4k",		bench_sequential_4k},
+    {"seq_64k",		bench_sequential_64k},
+    {"seq_1m",		bench_sequential_1m},
+    {"rand_4k",		bench_random_4k},
+    {"rand_64k",	bench_random_64k},
+    {"mount",		bench_mount},
+    {"small_file",	bench_small_files},
+    {"large_file",	bench_large_file},
+    {"directory",	bench_directory},
+};
+
+// Baselines -------------------------------------------------------------------
+
+// Load operations per second of each benchmark from a baseline file
+bool load_baseline(const char *path, std::map<std::string, double> &baseline) {
+    FILE *stream = fopen(path, "r");
+    if (stream == NULL) {
+    	fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+    	return false;
+    }
+
+    char   line[BUFSIZ];
+    char   name[BUFSIZ];
+    double ops;
+    while (fgets(line, BUFSIZ, stream)) {
+    	if (line[0] != '#' && sscanf(line, "%s %lf", name, &ops) == 2) {
+    	    baseline[name] = ops;
+	}
+    }
+    fclose(stream);
+    return true;
+}
+
+bool save_baseline(const char *path, const std::vector<Result> &results) {
+    FILE *stream = fopen(path, "w");
+    if (stream == NULL) {
+    	fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+    	return false;
+    }
+
+    fprintf(stream, "# benchmark ops/s\n");
+    for (size_t i = 0; i < results.size(); i++) {
+    	fprintf(stream, "%s %.0f\n", results[i].Name.c_str(), results[i].OpsPerSecond);
+    }
+    fclose(stream);
+    return true;
+}
+
+// Main execution --------------------------------------------------------------
+
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [options] <diskfile> <nblocks>\n", program);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -b <backend>    Disk I/O backend: sync, uring or mmap (default: sync)\n");
+    fprintf(stderr, "    -c <blocks>     Number of blocks in block cache (default: %lu, 0 disables)\n", BlockCache::DEFAULT_CAPACITY);
+    fprintf(stderr, "    -r <runs>       Runs of each benchmark, the best is reported (default: 3)\n");
+    fprintf(stderr, "    -f <filter>     Only run benchmarks whose name contains filter\n");
+    fprintf(stderr, "    -s <mode>       Durability: none, flush, always or a sync interval in ms (default: flush)\n");
+    fprintf(stderr, "    -w <file>       Save results as a baseline\n");
+    fprintf(stderr, "    -C <file>       Compare results to a baseline and fail on regressions\n");
+    fprintf(stderr, "    -T <percent>    Slowdown against the baseline counted as a regression, 0 to 100 (default: 50)\n");
+}
+
+int main(int argc, char *argv[]) {
+    Options	  options	= {0, BlockCache::DEFAULT_CAPACITY, 3, ""};
+    Disk::Backend backend	= Disk::SYNC;
+    Disk::Durability durability = Disk::SYNC_ON_FLUSH;
+    size_t	  sync_interval = Disk::DEFAULT_SYNC_INTERVAL;
+    const char *  save_path	= NULL;
+    const char *  compare_path	= NULL;
+    double	  tolerance	= 50;
+    char *	  end;
+    int		  option;
+
+    while ((option = getopt(argc, argv, "b:c:r:f:s:w:C:T:h")) != -1) {
+    	switch (option) {
+    	    case 'b':
+    	    	if (!Disk::parse(optarg, &backend)) {
+    	    	    usage(argv[0]);
+    	    	    return EXIT_FAILURE;
+		}
+    	    	break;
+    	    case 'c':
+    	    	options.CacheCapacity = strtoul(optarg, NULL, 10);
+    	    	break;
+    	    case 'r':
+    	    	options.Runs = strtoul(optarg, NULL, 10);
+    	    	break;
+    	    case 'f':
+    	    	options.Filter = optarg;
+    	    	break;
+    	    case 's':
+    	    	if (!Disk::parse(optarg, &durability, &sync_interval)) {
+    	    	    usage(argv[0]);
+    	    	    return EXIT_FAILURE;
+		}
+    	    	break;
+    	    case 'w':
+    	    	save_path = optarg;
+    	    	break;
+    	    case 'C':
+    	    	compare_path = optarg;
+    	    	break;
+    	    case 'T':
+    	    	tolerance = strtod(optarg, &end);
+    	    	if (end == optarg || *end != 0 || !(tolerance >= 0 && tolerance <= 100)) {
+    	    	    usage(argv[0]);
+    	    	    return EXIT_FAILURE;
+		}
+    	    	break;
+    	    default:
+    	    	usage(argv[0]);
+    	    	return EXIT_FAILURE;
+	}
+    }
+
+    if (argc - optind != 2 || options.Runs == 0) {
+    	usage(argv[0]);
+    	return EXIT_FAILURE;
+    }
+    options.Blocks = strtoul(argv[optind + 1], NULL, 10);
+
+    std::map<std::string, double> baseline;
+    if (compare_path && !load_baseline(compare_path, baseline)) {
+    	return EXIT_FAILURE;
+    }
+
+    Disk       disk;
+    FileSystem fs(options.CacheCapacity);
+    try {
+    	disk.open(argv[optind], options.Blocks);
+    } catch (std::runtime_error &e) {
+    	fprintf(stderr, "Unable to open disk %s: %s\n", argv[optind], e.what());
+    	return EXIT_FAILURE;
+    }
+
+    if (!disk.set_backend(backend)) {
+    	fprintf(stderr, "%s is unavailable, using synchronous I/O\n", backend == Disk::MMAP ? "mmap" : "io_uring");
+    }
+    disk.set_durability(durability, sync_interval);
+
+    printf("%-20s %12s %10s %10s %10s %10s\n", "benchmark", "ops/s", "MB/s", "p50 us", "p99 us", "p999 us");
+
+    std::vector<Result> best;
+    size_t failures = 0;
+    for (size_t b = 0; b < sizeof(Benchmarks) / sizeof(Benchmarks[0]); b++) {
+    	if (strstr(Benchmarks[b].Name, options.Filter) == NULL) {
+    	    continue;
+	}
+
+	// Every run starts from a freshly formatted image and a cold cache,
+	// which mount empties
+	std::vector<Result> kept;
+	for (size_t run = 0; run < options.Runs; run++) {
+	    std::vector<Result> results;
+	    if (!fs.format(&disk) || !fs.mount(&disk) || !Benchmarks[b].Run(disk, fs, options, results)) {
+	    	fprintf(stderr, "%s failed\n", Benchmarks[b].Name);
+	    	fs.unmount();
+	    	failures++;
+	    	kept.clear();
+	    	break;
+	    }
+	    fs.unmount();
+
+	    for (size_t i = 0; i < results.size(); i++) {
+	    	if (i >= kept.size()) {
+	    	    kept.push_back(results[i]);
+		} else if (results[i].OpsPerSecond > kept[i].OpsPerSecond) {
+		    kept[i] = results[i];
+		}
+	    }
+	}
+
+	for (size_t i = 0; i < kept.size(); i++) {
+	    const Result &result = kept[i];
+	    printf("%-20s %12.0f %10.1f %10.1f %10.1f %10.1f", result.Name.c_str(), result.OpsPerSecond, result.MBPerSecond,
+	    	result.P50 / 1000.0, result.P99 / 1000.0, result.P999 / 1000.0);
+
+	    std::map<std::string, double>::iterator expected = baseline.find(result.Name);
+	    if (expected != baseline.end() && result.OpsPerSecond < expected->second * (1 - tolerance / 100)) {
+	    	printf("  REGRESSION (baseline %.0f ops/s)", expected->second);
+	    	failures++;
+	    }
+	    printf("\n");
+	    best.push_back(result);
+	}
+    }
+
+    if (save_path && !save_baseline(save_path, best)) {
+    	return EXIT_FAILURE;
+    }
+
+    printf("%lu benchmarks, %lu failures or regressions\n", best.size(), failures);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
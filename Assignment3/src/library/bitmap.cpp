@@ -0,0 +1,204 @@
+// bitmap.cpp: Packed bitset with summary levels
+
+#include "sfs/bitmap.h"
+
+#include <algorithm>
+
+void Bitmap::assign(size_t nbits, bool value) {
+    Bits  = nbits;
+    Count = value ? nbits : 0;
+
+    // Build levels until a single word summarizes everything
+    Levels.clear();
+    size_t elements = nbits;
+    size_t words;
+    do {
+    	words = (elements + WORD_BITS - 1) / WORD_BITS;
+    	Levels.push_back(std::vector<uint64_t>(words, 0));
+    	elements = words;
+    } while (words > 1);
+
+    if (!value) {
+    	return;
+    }
+
+    // Set every element, masking off the unused tail of each level
+    elements = nbits;
+    for (size_t level = 0; level < Levels.size(); level++) {
+    	std::vector<uint64_t> &level_words = Levels[level];
+    	for (size_t w = 0; w < level_words.size(); w++) {
+    	    level_words[w] = ~0ULL;
+	}
+	if (elements % WORD_BITS) {
+	    level_words.back() = (1ULL << (elements % WORD_BITS)) - 1;
+	}
+	elements = level_words.size();
+    }
+}
+
+void Bitmap::clear() {
+    Levels.clear();
+    Bits  = 0;
+    Count = 0;
+}
+
+void Bitmap::refresh() {
+    std::vector<uint64_t> &bits = Levels[0];
+
+    if (Bits % WORD_BITS) {
+    	bits.back() &= (1ULL << (Bits % WORD_BITS)) - 1;
+    }
+
+    Count = 0;
+    for (size_t w = 0; w < bits.size(); w++) {
+    	Count += __builtin_popcountll(bits[w]);
+    }
+
+    for (size_t level = 1; level < Levels.size(); level++) {
+    	std::vector<uint64_t> &below = Levels[level - 1];
+    	std::vector<uint64_t> &above = Levels[level];
+
+    	std::fill(above.begin(), above.end(), 0);
+    	for (size_t w = 0; w < below.size(); w++) {
+    	    if (below[w]) {
+    	    	above[w / WORD_BITS] |= 1ULL << (w % WORD_BITS);
+	    }
+	}
+    }
+}
+
+void Bitmap::set(size_t bit) {
+    if (test(bit)) {
+    	return;
+    }
+    Count++;
+
+    // Propagate upwards while a word goes from empty to non-empty
+    for (size_t level = 0; level < Levels.size(); level++) {
+    	uint64_t &word	    = Levels[level][bit / WORD_BITS];
+    	bool	  was_empty = word == 0;
+
+    	word |= 1ULL << (bit % WORD_BITS);
+    	if (!was_empty) {
+    	    break;
+	}
+	bit /= WORD_BITS;
+    }
+}
+
+void Bitmap::reset(size_t bit) {
+    if (!test(bit)) {
+    	return;
+    }
+    Count--;
+
+    // Propagate upwards while a word goes from non-empty to empty
+    for (size_t level = 0; level < Levels.size(); level++) {
+    	uint64_t &word = Levels[level][bit / WORD_BITS];
+
+    	word &= ~(1ULL << (bit % WORD_BITS));
+    	if (word != 0) {
+    	    break;
+	}
+	bit /= WORD_BITS;
+    }
+}
+
+ssize_t Bitmap::find_level(size_t level, size_t position) const {
+    const std::vector<uint64_t> &words = Levels[level];
+    size_t w = position / WORD_BITS;
+
+    if (w >= words.size()) {
+    	return -1;
+    }
+
+    uint64_t word = words[w] & (~0ULL << (position % WORD_BITS));
+    if (word) {
+    	return w * WORD_BITS + __builtin_ctzll(word);
+    }
+
+    // Ask the summary level for the next non-empty word
+    if (level + 1 < Levels.size()) {
+    	ssize_t next = find_level(level + 1, w + 1);
+    	if (next < 0) {
+    	    return -1;
+	}
+	return next * WORD_BITS + __builtin_ctzll(words[next]);
+    }
+
+    for (w++; w < words.size(); w++) {
+    	if (words[w]) {
+    	    return w * WORD_BITS + __builtin_ctzll(words[w]);
+	}
+    }
+
+    return -1;
+}
+
+ssize_t Bitmap::find_next(size_t start) const {
+    if (Count == 0) {
+    	return -1;
+    }
+
+    if (start >= Bits) {
+    	start = 0;
+    }
+
+    ssize_t bit = find_level(0, start);
+    if (bit < 0 && start > 0) {
+    	bit = find_level(0, 0);
+    }
+    return bit;
+}
+
+size_t Bitmap::run_length(size_t start, size_t max) const {
+    size_t length = 0;
+    size_t bit	  = start;
+
+    // Count trailing ones a word at a time; bits past the end are never set
+    while (length < max && bit < Bits) {
+    	size_t	 shift = bit % WORD_BITS;
+    	size_t	 avail = WORD_BITS - shift;
+    	uint64_t zeros = ~(Levels[0][bit / WORD_BITS] >> shift);
+    	size_t	 ones  = zeros ? __builtin_ctzll(zeros) : WORD_BITS;
+
+    	if (ones > avail) {
+    	    ones = avail;
+	}
+	length += ones;
+	if (ones < avail) {
+	    break;
+	}
+	bit += ones;
+    }
+
+    return length < max ? length : max;
+}
+
+ssize_t Bitmap::find_run(size_t start, size_t length, size_t *found) const {
+    const size_t MAX_CANDIDATES = 64;
+
+    ssize_t best	= -1;
+    size_t  best_length = 0;
+    size_t  position	= start;
+
+    for (size_t candidate = 0; candidate < MAX_CANDIDATES; candidate++) {
+    	ssize_t bit = find_next(position);
+    	if (bit < 0) {
+    	    break;
+	}
+
+	size_t run = run_length(bit, length);
+	if (run > best_length) {
+	    best	= bit;
+	    best_length = run;
+	}
+	if (run >= length) {
+	    break;
+	}
+	position = bit + run;
+    }
+
+    *found = best_length;
+    return best;
+}
@@ -0,0 +1,486 @@
+// cache.cpp: Write-back block cache
+
+#include "sfs/cache.h"
+
+#include <algorithm>
+
+#include <stdio.h>
+#include <string.h>
+
+BlockCache::~BlockCache() {
+    if (disk != NULL) {
+    	detach();
+    }
+
+    if (Reporting) {
+    	printf("%lu block cache hits\n", Hits);
+    	printf("%lu block cache misses\n", Misses);
+    }
+}
+
+void BlockCache::attach(Disk *disk, size_t capacity, Policy policy) {
+    if (this->disk != NULL) {
+    	detach();
+    }
+
+    std::lock_guard<std::mutex> guard(Lock);
+
+    this->disk	   = disk;
+    this->Capacity = capacity;
+    this->policy   = policy;
+    Reporting	   = true;
+
+    entries.assign(capacity, Entry());
+    for (size_t slot = 0; slot < capacity; slot++) {
+    	entries[slot].BlockNumber = -1;
+    	entries[slot].Dirty	  = false;
+    	entries[slot].Referenced  = false;
+    	entries[slot].Pins	  = 0;
+    	entries[slot].Prev	  = NONE;
+    	entries[slot].Next	  = NONE;
+    }
+    buffer.assign(capacity * Disk::BLOCK_SIZE, 0);
+    index.clear();
+    index.reserve(capacity);
+
+    Used   = 0;
+    Head   = Tail = NONE;
+    Hand   = 0;
+    Pinned = 0;
+}
+
+void BlockCache::detach() {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    if (disk == NULL) {
+    	return;
+    }
+
+    flush_blocks();
+
+    entries.clear();
+    buffer.clear();
+    index.clear();
+    Capacity = 0;
+    Used     = 0;
+    Head     = Tail = NONE;
+    Pinned   = 0;
+    disk     = NULL;
+}
+
+void BlockCache::read(int blocknum, char *data) {
+    std::lock_guard<std::mutex> guard(Lock);
+    read_block(blocknum, data);
+}
+
+void BlockCache::write(int blocknum, char *data) {
+    std::lock_guard<std::mutex> guard(Lock);
+    write_block(blocknum, data);
+}
+
+void BlockCache::read_block(int blocknum, char *data) {
+    if (Capacity == 0) {
+    	Misses++;
+    	disk->read(blocknum, data);
+    	return;
+    }
+
+    size_t slot = lookup(blocknum);
+    if (slot != NONE) {
+    	Hits++;
+    	memcpy(data, slot_data(slot), Disk::BLOCK_SIZE);
+    	return;
+    }
+
+    Misses++;
+    slot = install(blocknum);
+    if (slot == NONE) {
+    	disk->read(blocknum, data);
+    	return;
+    }
+
+    disk->read(blocknum, slot_data(slot));
+    memcpy(data, slot_data(slot), Disk::BLOCK_SIZE);
+}
+
+void BlockCache::write_block(int blocknum, char *data) {
+    if (Capacity == 0) {
+    	disk->write(blocknum, data);
+    	Generation++;
+    	return;
+    }
+
+    // Whole blocks are written, so a miss never has to fetch the old contents
+    size_t slot = lookup(blocknum);
+    if (slot == NONE) {
+    	slot = install(blocknum);
+    }
+
+    // With every slot pinned, write through
+    if (slot == NONE) {
+    	disk->write(blocknum, data);
+    	Generation++;
+    	return;
+    }
+
+    memcpy(slot_data(slot), data, Disk::BLOCK_SIZE);
+    entries[slot].Dirty = true;
+}
+
+void BlockCache::read(const std::vector<int> &blocks, const std::vector<char *> &data) {
+    std::lock_guard<std::mutex> guard(Lock);
+    std::vector<int>	misses;
+    std::vector<char *> buffers;
+
+    for (size_t i = 0; i < blocks.size(); i++) {
+    	size_t slot = lookup(blocks[i]);
+    	if (slot != NONE) {
+    	    Hits++;
+    	    memcpy(data[i], slot_data(slot), Disk::BLOCK_SIZE);
+    	    continue;
+	}
+
+	Misses++;
+	misses.push_back(blocks[i]);
+	buffers.push_back(data[i]);
+    }
+
+    if (misses.empty()) {
+    	return;
+    }
+
+    disk->read(misses, buffers);
+
+    // Large requests stream past the cache instead of flushing it out
+    if (streaming(misses.size())) {
+    	return;
+    }
+
+    for (size_t i = 0; i < misses.size(); i++) {
+    	size_t slot = install(misses[i]);
+    	if (slot == NONE) {
+    	    break;
+	}
+    	memcpy(slot_data(slot), buffers[i], Disk::BLOCK_SIZE);
+    }
+}
+
+void BlockCache::write(const std::vector<int> &blocks, const std::vector<char *> &data) {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    if (!streaming(blocks.size())) {
+    	for (size_t i = 0; i < blocks.size(); i++) {
+    	    write_block(blocks[i], data[i]);
+	}
+	return;
+    }
+
+    // Keep cached copies coherent; they are clean once the write completes
+    for (size_t i = 0; i < blocks.size(); i++) {
+    	size_t slot = lookup(blocks[i]);
+    	if (slot != NONE) {
+    	    memcpy(slot_data(slot), data[i], Disk::BLOCK_SIZE);
+    	    entries[slot].Dirty = false;
+	}
+    }
+
+    disk->write(blocks, data);
+    Generation++;
+}
+
+void BlockCache::flush() {
+    std::lock_guard<std::mutex> guard(Lock);
+    flush_blocks();
+}
+
+void BlockCache::flush_blocks() {
+    if (disk == NULL) {
+    	return;
+    }
+
+    std::vector<std::pair<int, size_t> > dirty;
+    for (size_t slot = 0; slot < Capacity; slot++) {
+    	if (entries[slot].BlockNumber >= 0 && entries[slot].Dirty) {
+    	    dirty.push_back(std::make_pair(entries[slot].BlockNumber, slot));
+	}
+    }
+
+    // Write back in block order so adjacent blocks merge into one request
+    std::sort(dirty.begin(), dirty.end());
+
+    std::vector<int>	blocks;
+    std::vector<char *> buffers;
+    for (size_t i = 0; i < dirty.size(); i++) {
+    	blocks.push_back(dirty[i].first);
+    	buffers.push_back(slot_data(dirty[i].second));
+    	entries[dirty[i].second].Dirty = false;
+    }
+
+    disk->write(blocks, buffers);
+    Writebacks += dirty.size();
+    Generation++;
+}
+
+void BlockCache::update(const std::vector<int> &blocks, const std::vector<char *> &data) {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    for (size_t i = 0; i < blocks.size(); i++) {
+    	std::unordered_map<int, size_t>::iterator it = index.find(blocks[i]);
+    	if (it != index.end()) {
+    	    memcpy(slot_data(it->second), data[i], Disk::BLOCK_SIZE);
+    	    entries[it->second].Dirty = false;
+	}
+    }
+
+    // A prefetch that read the old contents must not install them
+    Generation++;
+}
+
+void BlockCache::prefetch(const std::vector<int> &blocks) {
+    std::vector<int> wanted;
+    size_t	     generation;
+    Disk *	     target;
+
+    {
+    	std::lock_guard<std::mutex> guard(Lock);
+    	if (disk == NULL || Capacity == 0) {
+    	    return;
+	}
+
+	// Never read ahead more than half the cache
+	for (size_t i = 0; i < blocks.size() && !streaming(wanted.size() + 1); i++) {
+	    if (index.find(blocks[i]) == index.end()) {
+	    	wanted.push_back(blocks[i]);
+	    }
+	}
+	generation = Generation;
+	target	   = disk;
+    }
+
+    if (wanted.empty()) {
+    	return;
+    }
+
+    std::vector<char>	storage(wanted.size() * Disk::BLOCK_SIZE);
+    std::vector<char *> buffers(wanted.size());
+    for (size_t i = 0; i < wanted.size(); i++) {
+    	buffers[i] = &storage[i * Disk::BLOCK_SIZE];
+    }
+    target->read(wanted, buffers);
+
+    std::lock_guard<std::mutex> guard(Lock);
+    if (disk != target) {
+    	return;
+    }
+
+    // Stop at the first write, including a writeback caused by installing
+    for (size_t i = 0; i < wanted.size() && Generation == generation; i++) {
+    	if (index.find(wanted[i]) != index.end()) {
+    	    continue;
+	}
+
+	size_t slot = install(wanted[i]);
+	if (slot == NONE) {
+	    break;
+	}
+	memcpy(slot_data(slot), buffers[i], Disk::BLOCK_SIZE);
+	Prefetches++;
+    }
+}
+
+void BlockCache::pin(const std::vector<int> &blocks, bool install, std::vector<const char *> &data) {
+    std::vector<int>	wanted;
+    std::vector<size_t> positions;	// Index in blocks of each wanted block
+    size_t		generation;
+    Disk *		target;
+
+    data.assign(blocks.size(), NULL);
+    {
+    	std::lock_guard<std::mutex> guard(Lock);
+    	if (disk == NULL || Capacity == 0) {
+    	    return;
+	}
+
+	size_t budget = Capacity / 2 - std::min(Pinned, Capacity / 2);
+	for (size_t i = 0; i < blocks.size(); i++) {
+	    size_t slot = lookup(blocks[i]);
+	    if (slot != NONE) {
+	    	if (take_pin(slot)) {
+	    	    Hits++;
+	    	    data[i] = slot_data(slot);
+		}
+		continue;
+	    }
+
+	    if (install && wanted.size() < budget) {
+	    	wanted.push_back(blocks[i]);
+	    	positions.push_back(i);
+	    }
+	}
+	generation = Generation;
+	target	   = disk;
+    }
+
+    if (wanted.empty()) {
+    	return;
+    }
+
+    std::vector<char>	storage(wanted.size() * Disk::BLOCK_SIZE);
+    std::vector<char *> buffers(wanted.size());
+    for (size_t i = 0; i < wanted.size(); i++) {
+    	buffers[i] = &storage[i * Disk::BLOCK_SIZE];
+    }
+    target->read(wanted, buffers);
+
+    std::lock_guard<std::mutex> guard(Lock);
+    if (disk != target) {
+    	return;
+    }
+
+    // A block cached meanwhile is at least as new as the one read; past the
+    // first write (including a writeback caused by installing) the ones
+    // read may be stale
+    for (size_t i = 0; i < wanted.size(); i++) {
+    	size_t slot = lookup(wanted[i]);
+    	if (slot == NONE) {
+    	    if (Generation != generation || (slot = this->install(wanted[i])) == NONE) {
+    	    	continue;
+	    }
+	    memcpy(slot_data(slot), buffers[i], Disk::BLOCK_SIZE);
+	}
+
+	if (take_pin(slot)) {
+	    Misses++;
+	    data[positions[i]] = slot_data(slot);
+	}
+    }
+}
+
+bool BlockCache::take_pin(size_t slot) {
+    if (entries[slot].Pins == 0) {
+    	if (Pinned >= Capacity / 2) {
+    	    return false;
+	}
+	Pinned++;
+    }
+    entries[slot].Pins++;
+    return true;
+}
+
+void BlockCache::unpin(int blocknum) {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    std::unordered_map<int, size_t>::iterator it = index.find(blocknum);
+    if (it != index.end() && entries[it->second].Pins > 0 && --entries[it->second].Pins == 0) {
+    	Pinned--;
+    }
+}
+
+size_t BlockCache::lookup(int blocknum) {
+    std::unordered_map<int, size_t>::iterator it = index.find(blocknum);
+    if (it == index.end()) {
+    	return NONE;
+    }
+
+    size_t slot = it->second;
+    if (policy == LRU) {
+    	unlink(slot);
+    	push_front(slot);
+    } else {
+    	entries[slot].Referenced = true;
+    }
+    return slot;
+}
+
+size_t BlockCache::install(int blocknum) {
+    size_t slot;
+
+    if (Used < Capacity) {
+    	slot = Used++;
+    } else {
+    	slot = victim();
+    	if (slot == NONE) {
+    	    return NONE;
+	}
+
+    	Entry &old = entries[slot];
+    	if (old.Dirty) {
+    	    disk->write(old.BlockNumber, slot_data(slot));
+    	    Writebacks++;
+    	    Generation++;
+	}
+	index.erase(old.BlockNumber);
+	if (policy == LRU) {
+	    unlink(slot);
+	}
+    }
+
+    entries[slot].BlockNumber = blocknum;
+    entries[slot].Dirty	      = false;
+    entries[slot].Referenced  = true;
+    entries[slot].Pins	      = 0;
+    index[blocknum] = slot;
+
+    if (policy == LRU) {
+    	push_front(slot);
+    }
+    return slot;
+}
+
+size_t BlockCache::victim() {
+    if (policy == LRU) {
+    	size_t slot = Tail;
+    	while (slot != NONE && entries[slot].Pins > 0) {
+    	    slot = entries[slot].Prev;
+	}
+	return slot;
+    }
+
+    // Sweep the clock, clearing reference bits until an unreferenced,
+    // unpinned slot; two full turns without one means all are pinned
+    for (size_t step = 0; step < 2*Capacity; step++) {
+    	size_t slot = Hand;
+    	Hand = (Hand + 1) % Capacity;
+
+    	if (entries[slot].Pins > 0) {
+    	    continue;
+	}
+	if (!entries[slot].Referenced) {
+	    return slot;
+	}
+	entries[slot].Referenced = false;
+    }
+    return NONE;
+}
+
+void BlockCache::unlink(size_t slot) {
+    Entry &e = entries[slot];
+
+    if (e.Prev != NONE) {
+    	entries[e.Prev].Next = e.Next;
+    } else {
+    	Head = e.Next;
+    }
+
+    if (e.Next != NONE) {
+    	entries[e.Next].Prev = e.Prev;
+    } else {
+    	Tail = e.Prev;
+    }
+
+    e.Prev = e.Next = NONE;
+}
+
+void BlockCache::push_front(size_t slot) {
+    Entry &e = entries[slot];
+
+    e.Prev = NONE;
+    e.Next = Head;
+    if (Head != NONE) {
+    	entries[Head].Prev = slot;
+    }
+    Head = slot;
+    if (Tail == NONE) {
+    	Tail = slot;
+    }
+}
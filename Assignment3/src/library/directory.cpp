@@ -0,0 +1,371 @@
+// directory.cpp: Hashed directories
+
+#include "sfs/directory.h"
+#include "sfs/trace.h"
+
+#include <algorithm>
+
+#include <string.h>
+
+bool Directory::format(FileSystem *fs, size_t inumber) {
+    if (fs->stat(inumber) != 0) {
+    	return false;
+    }
+
+    // The root starts with a single index entry covering every hash, and
+    // goes out with the empty leaf it points to in one write
+    Block blocks[2];
+    memset(blocks, 0, sizeof(blocks));
+    Block &root = blocks[0];
+    root.Root.Head.MagicNumber = MAGIC_NUMBER;
+    root.Root.Head.Blocks      = 2;
+    root.Root.Head.Indexes     = 1;
+    root.Root.Indexes[0].Hash  = 0;
+    root.Root.Indexes[0].Block = 1;
+    return fs->write(inumber, root.Data, sizeof(blocks), 0) == (ssize_t)sizeof(blocks) &&
+	fs->set_directory(inumber, true);
+}
+
+ssize_t Directory::create(FileSystem *fs) {
+    ssize_t inumber = fs->create();
+    if (inumber < 0) {
+    	return -1;
+    }
+
+    if (!format(fs, inumber)) {
+    	fs->remove(inumber);
+    	return -1;
+    }
+    return inumber;
+}
+
+bool Directory::is_directory(FileSystem *fs, size_t inumber) {
+    return fs->is_directory(inumber);
+}
+
+bool Directory::open(FileSystem *fs, size_t inumber) {
+    if (!is_directory(fs, inumber)) {
+    	return false;
+    }
+
+    FS	    = fs;
+    Inumber = inumber;
+    return true;
+}
+
+bool Directory::load(size_t block, Block &data) {
+    return FS != NULL && FS->read(Inumber, data.Data, Disk::BLOCK_SIZE, block * Disk::BLOCK_SIZE) == (ssize_t)Disk::BLOCK_SIZE;
+}
+
+bool Directory::save(size_t block, Block &data) {
+    return FS != NULL && FS->write(Inumber, data.Data, Disk::BLOCK_SIZE, block * Disk::BLOCK_SIZE) == (ssize_t)Disk::BLOCK_SIZE;
+}
+
+size_t Directory::search(const Index *indexes, size_t count, uint32_t hash) {
+    // Last entry whose hash is at or below hash; the first entry covers
+    // everything below the second whatever its own hash
+    size_t low = 1, high = count;
+    while (low < high) {
+    	size_t middle = low + (high - low) / 2;
+    	if (indexes[middle].Hash <= hash) {
+    	    low = middle + 1;
+	} else {
+	    high = middle;
+	}
+    }
+    return low - 1;
+}
+
+void Directory::insert(Index *indexes, size_t count, size_t slot, uint32_t hash, uint32_t block) {
+    memmove(&indexes[slot + 2], &indexes[slot + 1], (count - slot - 1) * sizeof(Index));
+    indexes[slot + 1].Hash  = hash;
+    indexes[slot + 1].Block = block;
+}
+
+bool Directory::walk(Block &root, uint32_t hash, Path &path, Block &node) {
+    const Header &head = root.Root.Head;
+    if (head.MagicNumber != MAGIC_NUMBER || head.Indexes == 0 || head.Indexes > INDEXES_PER_ROOT) {
+    	return false;
+    }
+
+    path.RootSlot  = search(root.Root.Indexes, head.Indexes, hash);
+    path.NodeBlock = 0;
+    path.NodeSlot  = 0;
+    size_t block   = root.Root.Indexes[path.RootSlot].Block;
+
+    if (head.Levels > 0) {
+    	path.NodeBlock = block;
+    	if (block == 0 || block >= head.Blocks || !load(block, node) ||
+    	    node.Node.Count == 0 || node.Node.Count > INDEXES_PER_NODE) {
+    	    return false;
+	}
+	path.NodeSlot = search(node.Node.Indexes, node.Node.Count, hash);
+	block	      = node.Node.Indexes[path.NodeSlot].Block;
+    }
+
+    path.LeafBlock = block;
+    return block != 0 && block < head.Blocks;
+}
+
+ssize_t Directory::find(const Block &leaf, const char *name, size_t length, uint32_t hash) {
+    for (size_t i = 0; i < leaf.Leaf.Count && i < ENTRIES_PER_LEAF; i++) {
+    	const Record &record = leaf.Leaf.Records[i];
+    	if (record.Hash == hash && record.Length == length && memcmp(record.Name, name, length) == 0) {
+    	    return i;
+	}
+    }
+    return -1;
+}
+
+bool Directory::add_index(Block &root, Path &path, Block &node, uint32_t hash, uint32_t block) {
+    Header &head = root.Root.Head;
+
+    if (head.Levels == 0) {
+    	if (head.Indexes < INDEXES_PER_ROOT) {
+    	    insert(root.Root.Indexes, head.Indexes, path.RootSlot, hash, block);
+    	    head.Indexes++;
+    	    return true;
+	}
+
+	// Full root: its entries move down into a new index block, which
+	// becomes the root's only entry
+	Block child;
+	memset(child.Data, 0, Disk::BLOCK_SIZE);
+	memcpy(child.Node.Indexes, root.Root.Indexes, head.Indexes * sizeof(Index));
+	insert(child.Node.Indexes, head.Indexes, path.RootSlot, hash, block);
+	child.Node.Count = head.Indexes + 1;
+	if (!save(head.Blocks, child)) {
+	    return false;
+	}
+
+	root.Root.Indexes[0].Hash  = 0;
+	root.Root.Indexes[0].Block = head.Blocks++;
+	head.Indexes = 1;
+	head.Levels  = 1;
+	return true;
+    }
+
+    if (node.Node.Count < INDEXES_PER_NODE) {
+    	insert(node.Node.Indexes, node.Node.Count, path.NodeSlot, hash, block);
+    	node.Node.Count++;
+    	return save(path.NodeBlock, node);
+    }
+
+    // Full index block: its upper half moves to a new index block, unless
+    // the root has no room left to point to it
+    if (head.Indexes >= INDEXES_PER_ROOT) {
+    	return false;
+    }
+
+    std::vector<Index> indexes(node.Node.Indexes, node.Node.Indexes + node.Node.Count);
+    Index added = {hash, block};
+    indexes.insert(indexes.begin() + path.NodeSlot + 1, added);
+    size_t half = indexes.size() / 2;
+
+    Block upper;
+    memset(upper.Data, 0, Disk::BLOCK_SIZE);
+    std::copy(indexes.begin() + half, indexes.end(), upper.Node.Indexes);
+    upper.Node.Count = indexes.size() - half;
+    if (!save(head.Blocks, upper)) {
+    	return false;
+    }
+
+    std::copy(indexes.begin(), indexes.begin() + half, node.Node.Indexes);
+    node.Node.Count = half;
+    if (!save(path.NodeBlock, node)) {
+    	return false;
+    }
+
+    insert(root.Root.Indexes, head.Indexes, path.RootSlot, indexes[half].Hash, head.Blocks++);
+    head.Indexes++;
+    return true;
+}
+
+ssize_t Directory::lookup(const char *name) {
+    std::lock_guard<std::mutex> guard(Lock);
+    Trace::Span span("dir", "lookup", Inumber);
+
+    size_t length = strlen(name);
+    if (length == 0 || length > NAME_LENGTH) {
+    	return -1;
+    }
+
+    uint32_t hash = Directory::hash(name, length);
+    Block    root, node, leaf;
+    Path     path;
+    if (!load(0, root) || !walk(root, hash, path, node) || !load(path.LeafBlock, leaf)) {
+    	return -1;
+    }
+
+    ssize_t slot = find(leaf, name, length, hash);
+    return slot < 0 ? -1 : (ssize_t)leaf.Leaf.Records[slot].Inode;
+}
+
+bool Directory::link(const char *name, size_t inumber) {
+    std::lock_guard<std::mutex> guard(Lock);
+    Trace::Span span("dir", "link", Inumber);
+
+    size_t length = strlen(name);
+    if (length == 0 || length > NAME_LENGTH || strchr(name, '/') != NULL || inumber > UINT32_MAX) {
+    	return false;
+    }
+
+    uint32_t hash = Directory::hash(name, length);
+    Block    root, node, leaf;
+    Path     path;
+    if (!load(0, root) || !walk(root, hash, path, node) || !load(path.LeafBlock, leaf) ||
+    	find(leaf, name, length, hash) >= 0) {
+    	return false;
+    }
+
+    Record record;
+    memset(&record, 0, sizeof(record));
+    record.Inode  = inumber;
+    record.Hash   = hash;
+    record.Length = length;
+    memcpy(record.Name, name, length);
+
+    if (leaf.Leaf.Count < ENTRIES_PER_LEAF) {
+    	leaf.Leaf.Records[leaf.Leaf.Count++] = record;
+    } else {
+    	// Full leaf: split it at the median hash, moving the split point
+    	// until it falls between two different hashes
+    	std::vector<Record> records(leaf.Leaf.Records, leaf.Leaf.Records + leaf.Leaf.Count);
+    	records.push_back(record);
+    	std::stable_sort(records.begin(), records.end(), [](const Record &a, const Record &b) { return a.Hash < b.Hash; });
+
+    	size_t split = records.size() / 2;
+    	while (split < records.size() && records[split].Hash == records[split - 1].Hash) {
+    	    split++;
+	}
+	if (split == records.size()) {
+	    split = records.size() / 2;
+	    while (split > 0 && records[split].Hash == records[split - 1].Hash) {
+	    	split--;
+	    }
+	}
+	if (split == 0) {
+	    return false;
+	}
+
+	// The new leaf goes at the end of the file, before anything points to it
+	Block sibling;
+	memset(sibling.Data, 0, Disk::BLOCK_SIZE);
+	std::copy(records.begin() + split, records.end(), sibling.Leaf.Records);
+	sibling.Leaf.Count = records.size() - split;
+	uint32_t block = root.Root.Head.Blocks;
+	if (!save(block, sibling)) {
+	    return false;
+	}
+	root.Root.Head.Blocks++;
+
+	if (!add_index(root, path, node, records[split].Hash, block)) {
+	    return false;
+	}
+
+	memset(leaf.Leaf.Records, 0, sizeof(leaf.Leaf.Records));
+	std::copy(records.begin(), records.begin() + split, leaf.Leaf.Records);
+	leaf.Leaf.Count = split;
+    }
+
+    if (!save(path.LeafBlock, leaf)) {
+    	return false;
+    }
+
+    root.Root.Head.Entries++;
+    return save(0, root);
+}
+
+bool Directory::unlink(const char *name) {
+    std::lock_guard<std::mutex> guard(Lock);
+    Trace::Span span("dir", "unlink", Inumber);
+
+    size_t length = strlen(name);
+    if (length == 0 || length > NAME_LENGTH) {
+    	return false;
+    }
+
+    uint32_t hash = Directory::hash(name, length);
+    Block    root, node, leaf;
+    Path     path;
+    if (!load(0, root) || !walk(root, hash, path, node) || !load(path.LeafBlock, leaf)) {
+    	return false;
+    }
+
+    ssize_t slot = find(leaf, name, length, hash);
+    if (slot < 0) {
+    	return false;
+    }
+
+    // The last entry fills the hole
+    leaf.Leaf.Records[slot] = leaf.Leaf.Records[--leaf.Leaf.Count];
+    memset(&leaf.Leaf.Records[leaf.Leaf.Count], 0, sizeof(Record));
+    if (!save(path.LeafBlock, leaf)) {
+    	return false;
+    }
+
+    root.Root.Head.Entries--;
+    return save(0, root);
+}
+
+ssize_t Directory::readdir(std::vector<Entry> &entries) {
+    std::lock_guard<std::mutex> guard(Lock);
+    Trace::Span span("dir", "readdir", Inumber);
+
+    entries.clear();
+    Block root;
+    if (!load(0, root) || root.Root.Head.MagicNumber != MAGIC_NUMBER) {
+    	return -1;
+    }
+
+    // Leaves in index order, which is hash order between leaves
+    std::vector<uint32_t> leaves;
+    for (size_t r = 0; r < root.Root.Head.Indexes && r < INDEXES_PER_ROOT; r++) {
+    	if (root.Root.Head.Levels == 0) {
+    	    leaves.push_back(root.Root.Indexes[r].Block);
+    	    continue;
+	}
+
+	Block node;
+	if (!load(root.Root.Indexes[r].Block, node)) {
+	    return -1;
+	}
+	for (size_t n = 0; n < node.Node.Count && n < INDEXES_PER_NODE; n++) {
+	    leaves.push_back(node.Node.Indexes[n].Block);
+	}
+    }
+
+    entries.reserve(root.Root.Head.Entries);
+    for (size_t l = 0; l < leaves.size(); l++) {
+    	Block leaf;
+    	if (!load(leaves[l], leaf)) {
+    	    return -1;
+	}
+	for (size_t i = 0; i < leaf.Leaf.Count && i < ENTRIES_PER_LEAF; i++) {
+	    const Record &record = leaf.Leaf.Records[i];
+	    Entry entry = {std::string(record.Name, std::min((size_t)record.Length, (size_t)NAME_LENGTH)), record.Inode};
+	    entries.push_back(entry);
+	}
+    }
+    return entries.size();
+}
+
+ssize_t Directory::size() {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    Block root;
+    if (!load(0, root) || root.Root.Head.MagicNumber != MAGIC_NUMBER) {
+    	return -1;
+    }
+    return root.Root.Head.Entries;
+}
+
+uint32_t Directory::hash(const char *name, size_t length) {
+    // 32-bit FNV-1a
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+    	hash ^= (uint8_t)name[i];
+    	hash *= 16777619u;
+    }
+    return hash;
+}
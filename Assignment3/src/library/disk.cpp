@@ -2,11 +2,16 @@
 
 #include "sfs/disk.h"
 
+#include <chrono>
+#include <set>
 #include <stdexcept>
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 void Disk::open(const char *path, size_t nblocks) {
@@ -26,17 +31,34 @@ void Disk::open(const char *path, size_t nblocks) {
     Blocks = nblocks;
     Reads  = 0;
     Writes = 0;
+    Syncs  = 0;
+    LogicalBytes = 0;
 }
 
 Disk::~Disk() {
+    if (Map != NULL) {
+    	munmap(Map, Blocks*BLOCK_SIZE);
+    	Map = NULL;
+    }
+
     if (FileDescriptor > 0) {
-    	printf("%lu disk block reads\n", Reads);
-    	printf("%lu disk block writes\n", Writes);
+    	printf("%lu disk block reads\n", Reads.load());
+    	printf("%lu disk block writes\n", Writes.load());
+    	if (LogicalBytes > 0) {
+    	    printf("%.2f write amplification\n", write_amplification());
+	}
     	close(FileDescriptor);
     	FileDescriptor = 0;
     }
 }
 
+double Disk::write_amplification() const {
+    if (LogicalBytes == 0) {
+    	return 0;
+    }
+    return (double)(Writes * BLOCK_SIZE) / LogicalBytes;
+}
+
 void Disk::sanity_check(int blocknum, char *data) {
     char what[BUFSIZ];
 
@@ -58,14 +80,26 @@ void Disk::sanity_check(int blocknum, char *data) {
 
 void Disk::read(int blocknum, char *data) {
     sanity_check(blocknum, data);
+    if (Queue.policy() != Scheduler::NONE) {
+    	transfer(std::vector<int>(1, blocknum), std::vector<char *>(1, data), false);
+    	return;
+    }
 
-    if (lseek(FileDescriptor, blocknum*BLOCK_SIZE, SEEK_SET) < 0) {
-    	char what[BUFSIZ];
-    	snprintf(what, BUFSIZ, "Unable to lseek %d: %s", blocknum, strerror(errno));
-    	throw std::runtime_error(what);
+    Stats::Timer timer(Statistics[Stats::DISK_READ]);
+    Trace::Span  span("disk", "disk_read", -1, blocknum);
+    timer.bytes(BLOCK_SIZE);
+
+    if (Modeled) {
+    	Model.serve(blocknum, 1, BLOCK_SIZE);
+    }
+
+    if (Map != NULL) {
+    	memcpy(data, Map + (size_t)blocknum*BLOCK_SIZE, BLOCK_SIZE);
+    	Reads++;
+    	return;
     }
 
-    if (::read(FileDescriptor, data, BLOCK_SIZE) != BLOCK_SIZE) {
+    if (pread(FileDescriptor, data, BLOCK_SIZE, (off_t)blocknum*BLOCK_SIZE) != BLOCK_SIZE) {
     	char what[BUFSIZ];
     	snprintf(what, BUFSIZ, "Unable to read %d: %s", blocknum, strerror(errno));
     	throw std::runtime_error(what);
@@ -76,14 +110,26 @@ void Disk::read(int blocknum, char *data) {
 
 void Disk::write(int blocknum, char *data) {
     sanity_check(blocknum, data);
+    if (Queue.policy() != Scheduler::NONE) {
+    	transfer(std::vector<int>(1, blocknum), std::vector<char *>(1, data), true);
+    	return;
+    }
 
-    if (lseek(FileDescriptor, blocknum*BLOCK_SIZE, SEEK_SET) < 0) {
-    	char what[BUFSIZ];
-    	snprintf(what, BUFSIZ, "Unable to lseek %d: %s", blocknum, strerror(errno));
-    	throw std::runtime_error(what);
+    Stats::Timer timer(Statistics[Stats::DISK_WRITE]);
+    Trace::Span  span("disk", "disk_write", -1, blocknum);
+    timer.bytes(BLOCK_SIZE);
+
+    if (Modeled) {
+    	Model.serve(blocknum, 1, BLOCK_SIZE);
     }
 
-    if (::write(FileDescriptor, data, BLOCK_SIZE) != BLOCK_SIZE) {
+    if (Map != NULL) {
+    	memcpy(Map + (size_t)blocknum*BLOCK_SIZE, data, BLOCK_SIZE);
+    	Writes++;
+    	return;
+    }
+
+    if (pwrite(FileDescriptor, data, BLOCK_SIZE, (off_t)blocknum*BLOCK_SIZE) != BLOCK_SIZE) {
     	char what[BUFSIZ];
     	snprintf(what, BUFSIZ, "Unable to write %d: %s", blocknum, strerror(errno));
     	throw std::runtime_error(what);
@@ -91,3 +137,415 @@ void Disk::write(int blocknum, char *data) {
 
     Writes++;
 }
+
+void Disk::read(const std::vector<int> &blocks, const std::vector<char *> &data) {
+    transfer(blocks, data, false);
+}
+
+void Disk::write(const std::vector<int> &blocks, const std::vector<char *> &data) {
+    transfer(blocks, data, true);
+}
+
+void Disk::transfer(const std::vector<int> &blocks, const std::vector<char *> &data, bool write) {
+    Stats::Timer timer(Statistics[write ? Stats::DISK_WRITE : Stats::DISK_READ]);
+    Trace::Span  span("disk", write ? "disk_write" : "disk_read", -1, blocks.empty() ? -1 : blocks[0], blocks.size());
+    timer.bytes(blocks.size()*BLOCK_SIZE);
+
+    for (size_t i = 0; i < blocks.size(); i++) {
+    	sanity_check(blocks[i], data[i]);
+    }
+
+    if (Queue.policy() != Scheduler::NONE && !blocks.empty()) {
+    	enqueue(blocks, data, write);
+    } else {
+    	issue(blocks, data, write);
+    }
+}
+
+void Disk::issue(const std::vector<int> &blocks, const std::vector<char *> &data, bool write) {
+    std::vector<struct iovec> iov(blocks.size());
+    std::vector<Run>	      runs;
+
+    // Gather runs of adjacent blocks, each moved by a single request
+    for (size_t i = 0; i < blocks.size(); i++) {
+    	iov[i].iov_base = data[i];
+    	iov[i].iov_len	= BLOCK_SIZE;
+
+    	if (i > 0 && blocks[i] == blocks[i - 1] + 1 && runs.back().Count < IOV_MAX) {
+    	    runs.back().Count++;
+	} else {
+	    Run run = {(off_t)(blocks[i]*BLOCK_SIZE), i, 1};
+	    runs.push_back(run);
+	}
+    }
+
+    if (Modeled) {
+    	for (size_t r = 0; r < runs.size(); r++) {
+    	    Model.serve(runs[r].Offset / BLOCK_SIZE, runs[r].Count, BLOCK_SIZE);
+	}
+    }
+
+    if (Mode == MMAP) {
+    	for (size_t r = 0; r < runs.size(); r++) {
+    	    char *mapped = Map + runs[r].Offset;
+    	    for (size_t i = runs[r].First; i < runs[r].First + runs[r].Count; i++, mapped += BLOCK_SIZE) {
+    	    	if (write) {
+    	    	    memcpy(mapped, iov[i].iov_base, BLOCK_SIZE);
+		} else {
+		    memcpy(iov[i].iov_base, mapped, BLOCK_SIZE);
+		}
+	    }
+	}
+    } else if (Mode == URING) {
+    	transfer_uring(runs, iov, write);
+    } else {
+	for (size_t r = 0; r < runs.size(); r++) {
+	    ssize_t length = runs[r].Count*BLOCK_SIZE;
+	    ssize_t result = write ? pwritev(FileDescriptor, &iov[runs[r].First], runs[r].Count, runs[r].Offset)
+				   : preadv(FileDescriptor, &iov[runs[r].First], runs[r].Count, runs[r].Offset);
+	    if (result != length) {
+		char what[BUFSIZ];
+		snprintf(what, BUFSIZ, "Unable to %s %ld: %s", write ? "write" : "read", (long)(runs[r].Offset / BLOCK_SIZE), strerror(errno));
+		throw std::runtime_error(what);
+	    }
+	}
+    }
+
+    if (write) {
+    	Writes += blocks.size();
+    } else {
+    	Reads  += blocks.size();
+    }
+}
+
+void Disk::enqueue(const std::vector<int> &blocks, const std::vector<char *> &data, bool write) {
+    Scheduler::Completion	    done(blocks.size());
+    std::vector<Scheduler::Request> batch;
+    uint64_t			    arrival = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    	std::chrono::steady_clock::now().time_since_epoch()).count();
+
+    std::unique_lock<std::mutex> lock(QueueLock);
+    for (size_t i = 0; i < blocks.size(); i++) {
+    	Scheduler::Request request = {blocks[i], data[i], write, arrival, &done};
+    	Queue.add(request);
+    }
+
+    while (done.Remaining > 0) {
+    	if (Dispatching) {
+    	    QueueDone.wait(lock);
+    	    continue;
+	}
+
+	Dispatching = true;
+	Queue.next(DISPATCH_BATCH, std::chrono::duration_cast<std::chrono::nanoseconds>(
+	    std::chrono::steady_clock::now().time_since_epoch()).count(), batch);
+	lock.unlock();
+	dispatch(batch);
+	lock.lock();
+
+	for (size_t i = 0; i < batch.size(); i++) {
+	    batch[i].Done->Remaining--;
+	}
+	Dispatching = false;
+	QueueDone.notify_all();
+    }
+    lock.unlock();
+
+    if (!done.Error.empty()) {
+    	throw std::runtime_error(done.Error);
+    }
+}
+
+void Disk::dispatch(const std::vector<Scheduler::Request> &batch) {
+    // Consecutive requests in the same direction go out together, so
+    // adjacent ones merge into runs; a block seen twice starts a new
+    // transfer, keeping its requests in order
+    size_t first = 0;
+    while (first < batch.size()) {
+    	std::vector<int>    blocks;
+    	std::vector<char *> data;
+    	std::set<int>	    seen;
+    	size_t		    last = first;
+    	for (; last < batch.size() && batch[last].Write == batch[first].Write && seen.insert(batch[last].Block).second; last++) {
+    	    blocks.push_back(batch[last].Block);
+    	    data.push_back(batch[last].Data);
+	}
+
+	try {
+	    issue(blocks, data, batch[first].Write);
+	} catch (std::runtime_error &e) {
+	    for (size_t i = first; i < last; i++) {
+	    	if (batch[i].Done->Error.empty()) {
+	    	    batch[i].Done->Error = e.what();
+		}
+	    }
+	}
+	first = last;
+    }
+}
+
+void Disk::transfer_uring(const std::vector<Run> &runs, const std::vector<struct iovec> &iov, bool write) {
+    // Completion state of one run; its address is the request's user data
+    struct Completion {
+    	size_t *Remaining;  // Runs of the transfer not yet completed
+    	int    *Error;	    // First error of the transfer
+    	ssize_t Expected;   // Bytes the run must transfer
+    };
+
+    std::vector<Completion> completions(runs.size());
+    size_t		    remaining = runs.size();
+    int			    error     = 0;
+    size_t		    next      = 0;
+    char		    failure[BUFSIZ] = "";   // First failure to queue, submit or wait
+
+    // Runs already submitted point at completions, so even after a failure
+    // every one of them is reaped before returning
+    std::unique_lock<std::mutex> lock(RingLock);
+    while (remaining > 0) {
+    	// Queue as many runs as the ring has room for
+    	size_t queued = 0;
+    	while (failure[0] == 0 && next < runs.size() && InFlight < Ring.entries()) {
+    	    Completion &completion = completions[next];
+    	    completion.Remaining = &remaining;
+    	    completion.Error	 = &error;
+    	    completion.Expected	 = runs[next].Count*BLOCK_SIZE;
+
+    	    if (!Ring.prepare(write, FileDescriptor, &iov[runs[next].First], runs[next].Count, runs[next].Offset, (uint64_t)(uintptr_t)&completion)) {
+    	    	snprintf(failure, BUFSIZ, "Unable to queue %s: submission queue full", write ? "write" : "read");
+    	    	break;
+	    }
+    	    InFlight++;
+    	    next++;
+    	    queued++;
+	}
+
+	if (queued > 0) {
+	    int	     result = Ring.submit();
+	    unsigned unsent = Ring.discard();
+	    InFlight  -= unsent;
+	    remaining -= unsent;
+	    if ((result < 0 || unsent > 0) && failure[0] == 0) {
+	    	snprintf(failure, BUFSIZ, "Unable to submit %s: %s", write ? "write" : "read", strerror(result < 0 ? -result : EBUSY));
+	    }
+	}
+
+	// Runs never queued will not complete
+	if (failure[0] != 0) {
+	    remaining -= runs.size() - next;
+	    next       = runs.size();
+	    if (remaining == 0) {
+	    	break;
+	    }
+	}
+
+	// One thread at a time waits on the ring and hands out completions
+	if (Reaping) {
+	    RingReady.wait(lock);
+	    continue;
+	}
+
+	Reaping = true;
+	lock.unlock();
+	int result = Ring.wait();
+	lock.lock();
+	Reaping = false;
+
+	uint64_t user_data;
+	int	 bytes;
+	while (Ring.reap(&user_data, &bytes)) {
+	    Completion *completion = (Completion *)(uintptr_t)user_data;
+	    if (bytes != completion->Expected && *completion->Error == 0) {
+	    	*completion->Error = bytes < 0 ? -bytes : EIO;
+	    }
+	    (*completion->Remaining)--;
+	    InFlight--;
+	}
+	RingReady.notify_all();
+
+	if (result < 0 && failure[0] == 0) {
+	    snprintf(failure, BUFSIZ, "Unable to wait for %s: %s", write ? "write" : "read", strerror(-result));
+	}
+    }
+    lock.unlock();
+
+    if (failure[0] != 0) {
+    	throw std::runtime_error(failure);
+    }
+
+    if (error != 0) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "Unable to %s: %s", write ? "write" : "read", strerror(error));
+    	throw std::runtime_error(what);
+    }
+}
+
+bool Disk::set_backend(Backend backend, size_t queue_depth) {
+    std::lock_guard<std::mutex> guard(RingLock);
+
+    QueueDepth = queue_depth > 0 ? queue_depth : 1;
+    Ring.teardown();
+    if (Map != NULL) {
+    	msync(Map, Blocks*BLOCK_SIZE, MS_SYNC);
+    	munmap(Map, Blocks*BLOCK_SIZE);
+    	Map = NULL;
+    }
+    Mode = SYNC;
+
+    if (backend == URING && !Ring.setup(QueueDepth)) {
+    	return false;
+    }
+
+    if (backend == MMAP) {
+    	if (FileDescriptor <= 0 || Blocks == 0) {
+    	    return false;
+	}
+
+	void *map = mmap(NULL, Blocks*BLOCK_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, FileDescriptor, 0);
+	if (map == MAP_FAILED) {
+	    return false;
+	}
+	Map = (char *)map;
+    }
+
+    Mode = backend;
+    return true;
+}
+
+bool Disk::parse(const char *name, Backend *backend) {
+    if (strcmp(name, "sync") == 0) {
+    	*backend = SYNC;
+    } else if (strcmp(name, "uring") == 0) {
+    	*backend = URING;
+    } else if (strcmp(name, "mmap") == 0) {
+    	*backend = MMAP;
+    } else {
+    	return false;
+    }
+    return true;
+}
+
+bool Disk::parse(const char *spec, Durability *durability, size_t *interval) {
+    if (strcmp(spec, "none") == 0) {
+    	*durability = NO_SYNC;
+    } else if (strcmp(spec, "flush") == 0) {
+    	*durability = SYNC_ON_FLUSH;
+    } else if (strcmp(spec, "always") == 0) {
+    	*durability = SYNC_ALWAYS;
+    } else {
+    	char *end;
+    	size_t milliseconds = strtoul(spec, &end, 10);
+    	if (spec[0] < '0' || spec[0] > '9' || *end != 0 || milliseconds == 0) {
+    	    return false;
+	}
+	*durability = SYNC_PERIODIC;
+	*interval   = milliseconds;
+    }
+    return true;
+}
+
+void Disk::advise(Access access) {
+    advise(0, Blocks, access);
+}
+
+void Disk::advise(int blocknum, size_t count, Access access) {
+    if (blocknum < 0 || (size_t)blocknum >= Blocks || count == 0) {
+    	return;
+    }
+    if (count > Blocks - blocknum) {
+    	count = Blocks - blocknum;
+    }
+
+    // Mapped images take madvise hints, others advise the page cache
+    if (Map != NULL) {
+    	static const int advice[] = {MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM, MADV_WILLNEED};
+    	madvise(Map + (size_t)blocknum*BLOCK_SIZE, count*BLOCK_SIZE, advice[access]);
+    } else if (FileDescriptor > 0) {
+    	static const int advice[] = {POSIX_FADV_NORMAL, POSIX_FADV_SEQUENTIAL, POSIX_FADV_RANDOM, POSIX_FADV_WILLNEED};
+    	posix_fadvise(FileDescriptor, (off_t)blocknum*BLOCK_SIZE, count*BLOCK_SIZE, advice[access]);
+    }
+}
+
+bool Disk::discard(int blocknum, size_t count) {
+    if (blocknum < 0 || (size_t)blocknum >= Blocks || count == 0) {
+    	return false;
+    }
+    if (count > Blocks - blocknum) {
+    	count = Blocks - blocknum;
+    }
+
+    off_t offset = (off_t)blocknum*BLOCK_SIZE;
+    off_t length = (off_t)count*BLOCK_SIZE;
+
+    // A shared mapping sees the zeroed pages of either
+    if (fallocate(FileDescriptor, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, offset, length) == 0) {
+    	return true;
+    }
+    return fallocate(FileDescriptor, FALLOC_FL_ZERO_RANGE|FALLOC_FL_KEEP_SIZE, offset, length) == 0;
+}
+
+char *Disk::map(int blocknum) {
+    if (Map == NULL || blocknum < 0 || (size_t)blocknum >= Blocks) {
+    	return NULL;
+    }
+    return Map + (size_t)blocknum*BLOCK_SIZE;
+}
+
+void Disk::flush() {
+    if (Map != NULL && msync(Map, Blocks*BLOCK_SIZE, MS_SYNC) < 0) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "Unable to msync: %s", strerror(errno));
+    	throw std::runtime_error(what);
+    }
+}
+
+void Disk::sync() {
+    if (Policy == NO_SYNC) {
+    	return;
+    }
+
+    std::unique_lock<std::mutex> guard(SyncLock);
+
+    // A sync already running may have started before the caller's writes
+    // completed, so the caller needs the one after it.  Whoever finds no
+    // sync running performs the next one for everyone waiting.
+    size_t target = Completed + (Syncing ? 2 : 1);
+    while (Completed < target) {
+    	if (Syncing) {
+    	    SyncDone.wait(guard);
+    	    continue;
+	}
+
+	size_t writes = Writes;
+	if (writes == Synced) {
+	    return;
+	}
+
+	Syncing = true;
+	guard.unlock();
+
+	int result = 0;
+	try {
+	    Stats::Timer timer(Statistics[Stats::DISK_SYNC]);
+	    Trace::Span  span("disk", "disk_sync");
+	    flush();
+	    result = fdatasync(FileDescriptor);
+	} catch (std::runtime_error &) {
+	    result = -1;
+	}
+	int error = errno;
+
+	guard.lock();
+	Syncing = false;
+	Completed++;
+	SyncDone.notify_all();
+
+	if (result < 0) {
+	    char what[BUFSIZ];
+	    snprintf(what, BUFSIZ, "Unable to sync: %s", strerror(error));
+	    throw std::runtime_error(what);
+	}
+
+	Synced = writes;
+	Syncs++;
+    }
+}
@@ -3,7 +3,9 @@
 #include "sfs/fs.h"
 
 #include <algorithm>
+#include <chrono>
 #include <assert.h>
+#include <set>
 #include <stdio.h>
 #include <string>
 #include <cstring>
@@ -11,6 +13,53 @@
 
 using namespace std;
 
+// Scoped hold on a reader/writer lock -----------------------------------------
+class RwlockGuard
+{
+public:
+    RwlockGuard(pthread_rwlock_t *lock, bool exclusive) : lock(lock)
+    {
+        if (exclusive)
+            pthread_rwlock_wrlock(lock);
+        else
+            pthread_rwlock_rdlock(lock);
+    }
+
+    ~RwlockGuard()
+    {
+        pthread_rwlock_unlock(lock);
+    }
+
+private:
+    pthread_rwlock_t *lock;
+};
+
+// Constructor -----------------------------------------------------------------
+FileSystem::FileSystem(size_t cache_capacity, BlockCache::Policy cache_policy)
+    : disk(nullptr), num_blocks(0), num_inode_blocks(0), num_inodes(0),
+      alloc_cursor(0), inode_cursor(0), bitmap_start(0), inode_bitmap_start(0),
+      journal_start(0), journal_blocks(0), data_start(0),
+      cache_capacity(cache_capacity), cache_policy(cache_policy), async_stop(false),
+      readahead_max(DEFAULT_READAHEAD), journal_size(0), journal_queued(false),
+      journal_sequence(0), super_dirty(false), committing(false), commits(0), durability(Disk::SYNC_ON_FLUSH),
+      sync_stop(false)
+{
+    // Prefer the commit over new operations, or a busy file system would
+    // never let it in
+    pthread_rwlockattr_t attributes;
+    pthread_rwlockattr_init(&attributes);
+    pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&journal_barrier, &attributes);
+    pthread_rwlockattr_destroy(&attributes);
+}
+
+// Destructor ------------------------------------------------------------------
+FileSystem::~FileSystem()
+{
+    unmount();
+    pthread_rwlock_destroy(&journal_barrier);
+}
+
 // Debug file system -----------------------------------------------------------
 void FileSystem::debug(Disk *disk)
 {
@@ -19,6 +68,10 @@ void FileSystem::debug(Disk *disk)
     unsigned int inode_block_counter = 0;
     string direct_blocks, indirect_blocks;
 
+    // Write back cached state so the image reflects the mounted file system
+    if (disk == this->disk)
+        sync_all();
+
     // Read Superblock
     disk->read(0, block.Data);
 
@@ -27,9 +80,24 @@ void FileSystem::debug(Disk *disk)
     printf("    %u blocks\n", block.Super.Blocks);
     printf("    %u inode blocks\n", block.Super.InodeBlocks);
     printf("    %u inodes\n", block.Super.Inodes);
-
-    // Read Inode blocks
+    if (block.Super.Version >= VERSION_BITMAPS)
+    {
+        printf("    version %u\n", block.Super.Version);
+        printf("    %u bitmap blocks\n", block.Super.BitmapBlocks);
+        printf("    %u inode bitmap blocks\n", block.Super.InodeBitmapBlocks);
+        printf("    state is %s\n", block.Super.State == STATE_CLEAN ? "clean" : block.Super.State == STATE_JOURNALED ? "journaled" : "dirty");
+    }
+    if (block.Super.Version >= VERSION_LAZY_INODES)
+        printf("    %u initialized inode blocks\n", block.Super.InodeHighWater);
+    if (block.Super.Version >= VERSION_JOURNAL)
+        printf("    %u journal blocks\n", block.Super.JournalBlocks);
+    if (block.Super.Version >= VERSION_DIRECTORIES && block.Super.RootDirectory != 0)
+        printf("    root directory is inode %u\n", block.Super.RootDirectory - 1);
+
+    // Read Inode blocks (only initialized ones hold inodes)
     inode_block_counter = block.Super.InodeBlocks;
+    if (block.Super.Version >= VERSION_LAZY_INODES)
+        inode_block_counter = block.Super.InodeHighWater;
 
     for (unsigned int i = 0; i < inode_block_counter; i++)
     {
@@ -39,7 +107,76 @@ void FileSystem::debug(Disk *disk)
             direct_blocks = "";
             indirect_blocks = "";
 
-            if (block.Inodes[j].Valid)
+            if (layout(block.Inodes[j]) == LAYOUT_EXTENTS)
+            {
+                Inode &inode = block.Inodes[j];
+                string extents;
+
+                for (unsigned int k = 0; k < inode.ExtentCount; k++)
+                {
+                    Extent extent;
+                    if (k < EXTENTS_PER_INODE)
+                    {
+                        extent = inode.Extents[k];
+                    }
+                    else
+                    {
+                        if (k == EXTENTS_PER_INODE)
+                            disk->read(inode.ExtentBlock, block_indirect.Data);
+                        extent = block_indirect.Extents[k - EXTENTS_PER_INODE];
+                    }
+
+                    if (extent.Start == 0)
+                        extents += " hole:" + to_string(extent.Length);
+                    else
+                        extents += " " + to_string(extent.Start);
+                    if (extent.Start != 0 && extent.Length > 1)
+                        extents += "-" + to_string(extent.Start + extent.Length - 1);
+                }
+
+                printf("Inode %u:\n", j);
+                printf("    size: %u bytes\n", inode.Size);
+                printf("    extents:%s\n", extents.c_str());
+                if (inode.ExtentBlock != 0)
+                    printf("    extent block: %u\n", inode.ExtentBlock);
+            }
+            else if (layout(block.Inodes[j]) == LAYOUT_TREE)
+            {
+                static const char *names[TREE_LEVELS] = {"indirect", "double indirect", "triple indirect"};
+                Inode &inode = block.Inodes[j];
+
+                for (unsigned int k = 0; k < TREE_POINTERS_PER_INODE; k++)
+                {
+                    if (inode.TreeDirect[k] != 0)
+                        direct_blocks += " " + to_string(inode.TreeDirect[k]);
+                }
+
+                printf("Inode %u:\n", j);
+                if (inode.Valid & TYPE_DIRECTORY)
+                    printf("    type: directory\n");
+                printf("    size: %lu bytes\n", file_size(inode));
+                printf("    direct blocks:%s\n", direct_blocks.c_str());
+
+                for (unsigned int level = 1; level <= TREE_LEVELS; level++)
+                {
+                    vector<int> pointers, data;
+                    tree_blocks(disk, nullptr, inode.TreeIndirect[level - 1], level, pointers, data);
+                    if (pointers.empty())
+                        continue;
+
+                    string pointer_blocks, data_blocks;
+                    for (size_t k = 1; k < pointers.size(); k++)
+                        pointer_blocks += " " + to_string(pointers[k]);
+                    for (size_t k = 0; k < data.size(); k++)
+                        data_blocks += " " + to_string(data[k]);
+
+                    printf("    %s block: %d\n", names[level - 1], pointers[0]);
+                    if (level > 1)
+                        printf("    %s pointer blocks:%s\n", names[level - 1], pointer_blocks.c_str());
+                    printf("    %s data blocks:%s\n", names[level - 1], data_blocks.c_str());
+                }
+            }
+            else if (block.Inodes[j].Valid)
             {
                 for (unsigned int k = 0; k < POINTERS_PER_INODE; k++)
                 {
@@ -83,14 +220,50 @@ bool FileSystem::format(Disk *disk)
     block.Super.Blocks = disk->size();
     block.Super.InodeBlocks = ceil(block.Super.Blocks * 0.1);
     block.Super.Inodes = INODES_PER_BLOCK * block.Super.InodeBlocks;
+    block.Super.Version = VERSION;
+    block.Super.State = STATE_CLEAN;
+    block.Super.BitmapBlocks = (block.Super.Blocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    block.Super.InodeBitmapBlocks = (block.Super.Inodes + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    block.Super.InodeHighWater = 0;
+
+    // A sixteenth of the disk goes to the journal, unless that is too small
+    // to hold a transaction worth logging
+    block.Super.JournalBlocks = min(block.Super.Blocks / 16, (uint32_t)JOURNAL_MAX_BLOCKS);
+    if (block.Super.JournalBlocks < JOURNAL_MIN_BLOCKS)
+        block.Super.JournalBlocks = 0;
+
+    unsigned int bitmap_start = 1 + block.Super.InodeBlocks;
+    unsigned int journal_start = bitmap_start + block.Super.BitmapBlocks + block.Super.InodeBitmapBlocks;
+    unsigned int data_start = journal_start + block.Super.JournalBlocks;
+    if (data_start > block.Super.Blocks)
+        return false;
 
     disk->write(0, block.Data);
 
-    // Clear all other blocks
-    char clear[BUFSIZ] = {0};
+    // Nothing else needs clearing: inode blocks are initialized on first use
+    // and data blocks are always written before they are read.  Releasing
+    // the rest of the image just keeps old contents from taking up space.
+    disk->discard(1, block.Super.Blocks - 1);
+
+    // Except the journal, where a transaction left by an earlier file system
+    // must not be replayed (discard may have been unable to zero it)
+    if (block.Super.JournalBlocks > 0)
+    {
+        Block descriptor;
+        memset(descriptor.Data, 0, Disk::BLOCK_SIZE);
+        disk->write(journal_start, descriptor.Data);
+    }
+
+    // Write bitmaps: every data block and every inode is free
+    Bitmap free_blocks(block.Super.Blocks, false);
+    for (unsigned int i = data_start; i < block.Super.Blocks; i++)
+        free_blocks.set(i);
+    vector<bool> dirty(block.Super.BitmapBlocks, true);
+    save_bitmap(disk, free_blocks, bitmap_start, dirty);
 
-    for (unsigned int i = 1; i < block.Super.Blocks; i++)
-        disk->write(i, clear);
+    Bitmap free_inodes(block.Super.Inodes, true);
+    dirty.assign(block.Super.InodeBitmapBlocks, true);
+    save_bitmap(disk, free_inodes, bitmap_start + block.Super.BitmapBlocks, dirty);
 
     return true;
 }
@@ -98,6 +271,7 @@ bool FileSystem::format(Disk *disk)
 // Mount file system -----------------------------------------------------------
 bool FileSystem::mount(Disk *disk)
 {
+    Trace::Span span("fs", "mount");
     if (disk->mounted())
         return false;
 
@@ -111,27 +285,116 @@ bool FileSystem::mount(Disk *disk)
         block.Super.InodeBlocks != ceil(.1 * block.Super.Blocks))
         return false;
 
+    if (block.Super.Version > VERSION)
+        return false;
+
+    if (block.Super.Version >= VERSION_BITMAPS &&
+        (block.Super.BitmapBlocks != (block.Super.Blocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK ||
+         block.Super.InodeBitmapBlocks != (block.Super.Inodes + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK ||
+         1 + block.Super.InodeBlocks + block.Super.BitmapBlocks + block.Super.InodeBitmapBlocks > block.Super.Blocks))
+        return false;
+
+    if (block.Super.Version >= VERSION_LAZY_INODES && block.Super.InodeHighWater > block.Super.InodeBlocks)
+        return false;
+
+    unsigned int journal = block.Super.Version >= VERSION_JOURNAL ? block.Super.JournalBlocks : 0;
+    if (journal != 0 &&
+        (journal < JOURNAL_MIN_BLOCKS || journal > JOURNAL_MAX_BLOCKS ||
+         1 + block.Super.InodeBlocks + block.Super.BitmapBlocks + block.Super.InodeBitmapBlocks + journal > block.Super.Blocks))
+        return false;
+
     // Set device and mount
     disk->mount();
 
     // Copy metadata
+    this->super = block.Super;
     this->num_blocks = block.Super.Blocks;
     this->num_inode_blocks = block.Super.InodeBlocks;
     this->num_inodes = block.Super.Inodes;
+    this->bitmap_start = 1 + num_inode_blocks;
+    this->inode_bitmap_start = bitmap_start + block.Super.BitmapBlocks;
+    this->journal_start = inode_bitmap_start + block.Super.InodeBitmapBlocks;
+    this->journal_blocks = journal;
+    this->data_start = journal_start + journal_blocks;
     this->disk = disk;
 
+    // Finish the last committed transaction, which brings the superblock
+    // and bitmaps up to date as well; only the journal is read to do so
+    if (journal_blocks > 0)
+    {
+        replay_journal();
+        disk->read(0, block.Data);
+        this->super = block.Super;
+    }
+
+    cache.attach(disk, cache_capacity, cache_policy);
+
+    // Allocate inode table
+    inode_table = vector<Block *>(num_inode_blocks, nullptr);
+    inode_dirty = vector<bool>(num_inode_blocks, false);
+    inode_high_water = super.Version >= VERSION_LAZY_INODES ? super.InodeHighWater : num_inode_blocks;
+
+    inode_locks = vector<pthread_rwlock_t>(num_inodes);
+    for (size_t i = 0; i < inode_locks.size(); i++)
+        pthread_rwlock_init(&inode_locks[i], nullptr);
+
+    streams.clear();
+    super_dirty = false;
+
+    // Allocate bitmaps
+    bitmap_dirty = vector<bool>(super.BitmapBlocks, false);
+    inode_bitmap_dirty = vector<bool>(super.InodeBitmapBlocks, false);
+    alloc_cursor = data_start;
+    inode_cursor = 0;
+
+    if (super.Version >= VERSION_BITMAPS && (super.State == STATE_CLEAN || super.State == STATE_JOURNALED))
+    {
+        // Clean unmount or replayed journal: the on-disk bitmaps are current
+        free_bitmap.assign(num_blocks, false);
+        load_bitmap(disk, free_bitmap, bitmap_start);
+        inode_bitmap.assign(num_inodes, false);
+        load_bitmap(disk, inode_bitmap, inode_bitmap_start);
+    }
+    else
+    {
+        // Original format or unclean shutdown: rebuild from the inode table
+        rebuild_bitmaps();
+        bitmap_dirty.assign(bitmap_dirty.size(), true);
+        inode_bitmap_dirty.assign(inode_bitmap_dirty.size(), true);
+    }
+
+    // Mark file system in use so a crash forces a replay (or without a
+    // journal, a rebuild) on the next mount
+    if (journal_blocks > 0)
+        write_state(STATE_JOURNALED);
+    else if (super.Version >= VERSION_BITMAPS)
+        write_state(STATE_DIRTY);
+
+    durability = disk->durability();
+    if (durability == Disk::SYNC_PERIODIC)
+    {
+        sync_stop = false;
+        sync_thread = thread(&FileSystem::periodic_sync, this);
+    }
+
+    return true;
+}
+
+// Rebuild bitmaps -------------------------------------------------------------
+void FileSystem::rebuild_bitmaps()
+{
     // Allocate free block bitmap
-    free_bitmap = vector<int>(num_blocks, 1);
+    free_bitmap.assign(num_blocks, true);
 
-    free_bitmap[0] = 0;
+    for (unsigned int i = 0; i < data_start; i++)
+        free_bitmap.reset(i);
 
-    for (unsigned int i = 0; i < num_inode_blocks; i++)
-        free_bitmap[1 + i] = 0;
+    // Allocate free inode index; inodes past the high-water mark are free
+    inode_bitmap.assign(num_inodes, true);
 
-    for (unsigned int inode_block = 0; inode_block < num_inode_blocks; inode_block++)
+    for (unsigned int inode_block = 0; inode_block < inode_high_water; inode_block++)
     {
-        Block b;
-        disk->read(1 + inode_block, b.Data);
+        Block &b = *(Block *)this->inode_block(inode_block);
 
         // reads each inode
         for (unsigned int inode = 0; inode < INODES_PER_BLOCK; inode++)
@@ -139,327 +402,1410 @@ bool FileSystem::mount(Disk *disk)
             if (!b.Inodes[inode].Valid)
                 continue;
 
-            unsigned int n_blocks = (unsigned int)ceil(b.Inodes[inode].Size / (double)disk->BLOCK_SIZE);
+            inode_bitmap.reset(inode_block * INODES_PER_BLOCK + inode);
 
-            for (unsigned int pointer = 0; pointer < POINTERS_PER_INODE && pointer < n_blocks; pointer++)
-                free_bitmap[b.Inodes[inode].Direct[pointer]] = 0;
+            vector<int> blocks;
+            owned_blocks(b.Inodes[inode], blocks);
 
-            if (n_blocks > POINTERS_PER_INODE)
-            {
-                Block indirect;
-                disk->read(b.Inodes[inode].Indirect, indirect.Data);
-                free_bitmap[b.Inodes[inode].Indirect] = 0;
-                for (unsigned int pointer = 0; pointer < n_blocks - POINTERS_PER_INODE; pointer++)
-                    free_bitmap[indirect.Pointers[pointer]] = 0;
-            }
+            for (size_t i = 0; i < blocks.size(); i++)
+                free_bitmap.reset(blocks[i]);
         }
     }
+}
 
-    return true;
+// Free blocks -----------------------------------------------------------------
+ssize_t FileSystem::free_blocks()
+{
+    if (disk == nullptr)
+        return -1;
+
+    lock_guard<mutex> guard(alloc_lock);
+    return free_bitmap.count();
+}
+
+// Free inodes -----------------------------------------------------------------
+ssize_t FileSystem::free_inodes()
+{
+    if (disk == nullptr)
+        return -1;
+
+    lock_guard<mutex> guard(alloc_lock);
+    return inode_bitmap.count();
+}
+
+// Unmount file system ---------------------------------------------------------
+void FileSystem::unmount()
+{
+    Trace::Span span("fs", "unmount");
+    if (disk == nullptr)
+        return;
+
+    // Finish queued requests, write back dirty inodes, bitmaps and blocks
+    // before releasing the disk, then record the clean unmount
+    if (sync_thread.joinable())
+    {
+        {
+            lock_guard<mutex> guard(sync_lock);
+            sync_stop = true;
+        }
+        sync_wake.notify_all();
+        sync_thread.join();
+    }
+    stop_async();
+    if (journal_blocks > 0)
+    {
+        commit();
+    }
+    else
+    {
+        sync_inodes();
+        sync_bitmaps();
+    }
+    cache.detach();
+
+    if (super.Version >= VERSION_BITMAPS)
+        write_state(STATE_CLEAN);
+
+    disk->sync();
+
+    for (size_t i = 0; i < inode_table.size(); i++)
+        delete inode_table[i];
+    inode_table.clear();
+    inode_dirty.clear();
+
+    for (size_t i = 0; i < inode_locks.size(); i++)
+        pthread_rwlock_destroy(&inode_locks[i]);
+    inode_locks.clear();
+    streams.clear();
+    journal_running.clear();
+    journal_size = 0;
+
+    disk->unmount();
+    disk = nullptr;
+    journal_blocks = 0;
+    num_blocks = num_inode_blocks = num_inodes = 0;
+    free_bitmap.clear();
+    inode_bitmap.clear();
+    bitmap_dirty.clear();
+    inode_bitmap_dirty.clear();
+}
+
+// Sync file system ------------------------------------------------------------
+void FileSystem::sync()
+{
+    Workload::record(Workload::SYNC);
+    sync_all();
+}
+
+void FileSystem::sync_all()
+{
+    Trace::Span span("fs", "sync");
+    if (disk == nullptr)
+        return;
+
+    if (journal_blocks > 0)
+    {
+        commit();
+        return;
+    }
+
+    sync_inodes();
+    sync_bitmaps();
+    cache.flush();
+    disk->sync();
+}
+
+// Periodic sync ---------------------------------------------------------------
+void FileSystem::periodic_sync()
+{
+    unique_lock<mutex> guard(sync_lock);
+
+    while (!sync_wake.wait_for(guard, chrono::milliseconds(disk->sync_interval()), [this]() { return sync_stop; }))
+    {
+        guard.unlock();
+        sync_all();
+        guard.lock();
+    }
 }
 
 // Create inode ----------------------------------------------------------------
 ssize_t FileSystem::create()
 {
-    ssize_t inode_num = -1;
+    Stats::Timer timer(statistics[Stats::CREATE]);
+    Trace::Span span("fs", "create");
+    ssize_t inumber = create_inode();
+    span.inode(inumber);
+    Workload::record(Workload::CREATE, inumber >= 0 ? inumber : Workload::NO_INODE);
+    if (inumber >= 0 && durability == Disk::SYNC_ALWAYS)
+        sync_all();
+
+    return inumber;
+}
+
+ssize_t FileSystem::create_inode()
+{
+    RwlockGuard update(&journal_barrier, false);
 
-    // Locate free inode in inode table
-    for (unsigned int i = 0; i < this->num_inode_blocks; i++)
+    ssize_t inode_num;
     {
-        Block temp;
-        disk->read(i + 1, temp.Data);
+        lock_guard<mutex> guard(alloc_lock);
 
-        for (unsigned int j = 0; j < INODES_PER_BLOCK; j++)
-        {
-            if (!temp.Inodes[j].Valid)
-            {
-                inode_num = i * INODES_PER_BLOCK + j;
-                break;
-            }
-        }
+        // Locate free inode in free inode index; the cursor never passes the
+        // lowest free inode, so this returns the lowest free inode number
+        inode_num = inode_bitmap.find_next(inode_cursor);
 
-        if (inode_num != -1)
-            break;
+        // Return inode if found
+        if (inode_num == -1)
+            return inode_num;
+
+        mark_free_inode(inode_num, false);
+        inode_cursor = inode_num + 1;
     }
 
-    // Return inode if found
-    if (inode_num == -1)
-        return inode_num;
+    RwlockGuard guard(inode_lock(inode_num), true);
 
     Inode temp;
-    temp.Valid = true;
-    temp.Size = 0;
-    for (unsigned int i = 0; i < POINTERS_PER_INODE; i++)
-        temp.Direct[i] = 0;
-    temp.Indirect = 0;
+    memset(&temp, 0, sizeof(temp));
+    if (super.Version >= VERSION_LARGE_FILES)
+        temp.Valid = LAYOUT_TREE;
+    else if (super.Version >= VERSION_EXTENTS)
+        temp.Valid = LAYOUT_EXTENTS;
+    else
+        temp.Valid = LAYOUT_POINTERS;
 
     save_inode(inode_num, &temp);
 
+    forget_stream(inode_num, false);
+
     return inode_num;
 }
 
 // Remove inode ----------------------------------------------------------------
 bool FileSystem::remove(size_t inumber)
+{
+    Stats::Timer timer(statistics[Stats::REMOVE]);
+    Trace::Span span("fs", "remove", inumber);
+    Workload::record(Workload::REMOVE, inumber);
+    bool removed = remove_inode(inumber);
+    if (removed && durability == Disk::SYNC_ALWAYS)
+        sync_all();
+
+    return removed;
+}
+
+bool FileSystem::remove_inode(size_t inumber)
 {
     Inode node;
 
-    // Load inode information
-    if (!load_inode(inumber, &node) || !node.Valid)
+    if (inumber >= num_inodes)
         return false;
 
-    // Free direct blocks
-    for (unsigned int i = 0; i < POINTERS_PER_INODE; i++)
-    {
-        if (node.Direct[i] != 0)
-        {
-            free_bitmap[node.Direct[i]] = 1;
-            node.Direct[i] = 0;
-        }
-    }
+    RwlockGuard update(&journal_barrier, false);
+    RwlockGuard guard(inode_lock(inumber), true);
 
-    // Free indirect blocks
-    if (node.Indirect != 0)
-    {
-        Block b;
-        disk->read(node.Indirect, b.Data);
+    // Load inode information
+    if (!load_inode(inumber, &node) || !node.Valid)
+        return false;
 
-        for (unsigned int i = 0; i < POINTERS_PER_BLOCK; i++)
-        {
-            if (b.Pointers[i] != 0)
-                free_bitmap[b.Pointers[i]] = 1;
-        }
+    // Free data and mapping blocks, none of which may still be on its way
+    // home from a commit once it can be reused
+    vector<int> blocks;
+    owned_blocks(node, blocks);
+    revoke(blocks);
 
-        free_bitmap[node.Indirect] = 1;
-    }
+    forget_stream(inumber, false);
 
     // Clear inode in inode table
-    node.Indirect = 0;
-    node.Valid = 0;
-    node.Size = 0;
+    memset(&node, 0, sizeof(node));
 
     if (!save_inode(inumber, &node))
         return false;
 
+    lock_guard<mutex> alloc_guard(alloc_lock);
+
+    for (size_t i = 0; i < blocks.size(); i++)
+        mark_free_block(blocks[i], true);
+
+    mark_free_inode(inumber, true);
+    inode_cursor = min(inode_cursor, inumber);
+
     return true;
 }
 
 // Inode stat ------------------------------------------------------------------
-ssize_t FileSystem::stat(size_t inumber)
+ssize_t FileSystem::stat(size_t inumber, size_t *blocks)
 {
+    Stats::Timer timer(statistics[Stats::STAT]);
+    Trace::Span span("fs", "stat", inumber);
+    Workload::record(Workload::STAT, inumber);
     Inode i;
 
+    if (inumber >= num_inodes)
+        return -1;
+
+    RwlockGuard guard(inode_lock(inumber), false);
+
     // Load inode information
     if (!load_inode(inumber, &i) || !i.Valid)
         return -1;
 
-    return i.Size;
+    if (blocks != nullptr)
+    {
+        vector<int> owned;
+        owned_blocks(i, owned);
+        *blocks = owned.size();
+    }
+
+    return file_size(i);
 }
 
 // Read from inode -------------------------------------------------------------
 ssize_t FileSystem::read(size_t inumber, char *data, size_t length, size_t offset)
 {
+    Stats::Timer timer(statistics[Stats::READ]);
+    Trace::Span span("fs", "read", inumber);
+    Workload::record(Workload::READ, inumber, length, offset);
+    if (inumber >= num_inodes)
+        return -1;
+
+    RwlockGuard guard(inode_lock(inumber), false);
+
     // Load inode information
     Inode inode;
-    if (!load_inode(inumber, &inode) || offset > inode.Size || !inode.Valid)
+    if (!load_inode(inumber, &inode) || !inode.Valid || offset > file_size(inode))
         return -1;
 
     // Adjust length
-    length = min(length, inode.Size - offset);
-
-    unsigned int start_block = offset / disk->BLOCK_SIZE;
-
-    // Read block and copy to data
-    Block indirect;
-    if ((offset + length) / disk->BLOCK_SIZE > POINTERS_PER_INODE)
-    {
-        if (inode.Indirect == 0)
-            return -1;
-
-        disk->read(inode.Indirect, indirect.Data);
-    }
-
-    size_t read = 0;
-    for (unsigned int block_num = start_block; read < length; block_num++)
+    length = min(length, file_size(inode) - offset);
+    if (length == 0)
+        return 0;
+
+    // Resolve every block in the range up front
+    size_t start_block = offset / Disk::BLOCK_SIZE;
+    size_t end_block = (offset + length - 1) / Disk::BLOCK_SIZE;
+    vector<int> blocks;
+    map_blocks(inumber, inode, start_block, end_block - start_block + 1, blocks);
+
+    // Read whole blocks straight into data and partial ones into bounce
+    // buffers, all with one batched request; holes read as zeros
+    Block head, tail;
+    vector<char *> buffers;
+    size_t skip = offset % Disk::BLOCK_SIZE;
+    split_buffers(data, length, skip, blocks.size(), head.Data, tail.Data, buffers);
+
+    vector<int> present;
+    vector<char *> present_buffers;
+    for (size_t i = 0; i < blocks.size(); i++)
     {
-        size_t block_to_read;
-        if (block_num < POINTERS_PER_INODE)
-            block_to_read = inode.Direct[block_num];
-
-        else
-            block_to_read = indirect.Pointers[block_num - POINTERS_PER_INODE];
-
-        if (block_to_read == 0)
-            return -1;
-
-        Block b;
-        disk->read(block_to_read, b.Data);
-        size_t read_offset;
-        size_t read_length;
-
-        if (read == 0)
-        {
-            read_offset = offset % disk->BLOCK_SIZE;
-            read_length = min(disk->BLOCK_SIZE - read_offset, length);
-        }
-
-        else
+        if (blocks[i] == 0)
         {
-            read_offset = 0;
-            read_length = min(disk->BLOCK_SIZE - 0, length - read);
+            memset(buffers[i], 0, Disk::BLOCK_SIZE);
+            continue;
         }
 
-        memcpy(data + read, b.Data + read_offset, read_length);
-        read += read_length;
+        present.push_back(blocks[i]);
+        present_buffers.push_back(buffers[i]);
     }
+    cache.read(present, present_buffers);
 
-    return read;
+    copy_partial(data, length, skip, buffers, head.Data, tail.Data, true);
+    readahead(inumber, offset, length, file_size(inode));
+    timer.bytes(length);
+    return length;
 }
 
 // Write to inode --------------------------------------------------------------
 ssize_t FileSystem::write(size_t inumber, char *data, size_t length, size_t offset)
 {
-    // Load inode
-    Inode inode;
-    if (!load_inode(inumber, &inode) || offset > inode.Size)
-        return -1;
-
-    size_t MAX_FILE_SIZE = disk->BLOCK_SIZE * (POINTERS_PER_INODE * POINTERS_PER_BLOCK);
+    Stats::Timer timer(statistics[Stats::WRITE]);
+    Trace::Span span("fs", "write", inumber);
+    Workload::record(Workload::WRITE, inumber, length, offset);
+    ssize_t written = write_inode(inumber, data, length, offset);
+    if (written > 0 && durability == Disk::SYNC_ALWAYS)
+        sync_all();
 
-    length = min(length, MAX_FILE_SIZE - offset);
+    if (written > 0)
+        timer.bytes(written);
 
-    unsigned int start_block = offset / disk->BLOCK_SIZE;
-    Block indirect;
-    bool read_indirect = false;
+    return written;
+}
 
-    bool modified_inode = false;
-    bool modified_indirect = false;
+ssize_t FileSystem::write_inode(size_t inumber, char *data, size_t length, size_t offset)
+{
+    if (inumber >= num_inodes)
+        return -1;
 
-    // Write block and copy data
-    size_t written = 0;
-    for (unsigned int block_num = start_block; written < length && block_num < POINTERS_PER_INODE + POINTERS_PER_BLOCK; block_num++)
-    {
-        size_t block_to_write;
-        if (block_num < POINTERS_PER_INODE)
-        {
-            if (inode.Direct[block_num] == 0)
-            {
-                ssize_t allocated_block = allocate_free_block();
-                if (allocated_block == -1)
-                    break;
+    RwlockGuard update(&journal_barrier, false);
+    RwlockGuard guard(inode_lock(inumber), true);
 
-                inode.Direct[block_num] = allocated_block;
-                modified_inode = true;
-            }
-            block_to_write = inode.Direct[block_num];
-        }
+    // Load inode; writing past the end of file leaves a hole before offset
+    Inode inode;
+    if (!load_inode(inumber, &inode) || !inode.Valid)
+        return -1;
 
-        else
+    size_t max_size = max_file_size(inode);
+    if (offset >= max_size)
+        return 0;
+
+    length = min(length, max_size - offset);
+    if (length == 0)
+        return 0;
+
+    // Partially written blocks that were holes (or past the end of file)
+    // hold nothing yet, since new blocks are not zeroed on allocation, so
+    // note which blocks exist before allocating
+    Inode original = inode;
+    size_t start_block = offset / Disk::BLOCK_SIZE;
+    size_t end_block = (offset + length - 1) / Disk::BLOCK_SIZE;
+    size_t skip = offset % Disk::BLOCK_SIZE;
+    vector<int> existing;
+    if (skip != 0 || (offset + length) % Disk::BLOCK_SIZE != 0)
+        map_blocks(inumber, inode, start_block, end_block - start_block + 1, existing);
+
+    // Map every block in the range up front, allocating missing ones
+    vector<int> blocks;
+    size_t mapped = allocate_blocks(inode, start_block, end_block - start_block + 1, blocks);
+    forget_stream(inumber, true);
+
+    // Only write as much as the allocated blocks hold
+    size_t written = mapped == 0 ? 0 : min(length, mapped * Disk::BLOCK_SIZE - skip);
+
+    if (written > 0)
+    {
+        // Partial blocks are read, modified and written back (or start as
+        // zeros if they are new); whole blocks are written straight from
+        // data, all with one batched request
+        Block head, tail;
+        vector<char *> buffers;
+        split_buffers(data, written, skip, mapped, head.Data, tail.Data, buffers);
+
+        vector<int> partial;
+        vector<char *> partial_buffers;
+        for (size_t i = 0; i < mapped; i++)
         {
-            if (inode.Indirect == 0)
-            {
-                ssize_t allocated_block = allocate_free_block();
-                if (allocated_block == -1)
-                    return written;
-
-                inode.Indirect = allocated_block;
-                modified_indirect = true;
-            }
-
-            if (!read_indirect)
-            {
-                disk->read(inode.Indirect, indirect.Data);
-                read_indirect = true;
-            }
+            if (buffers[i] != head.Data && buffers[i] != tail.Data)
+                continue;
 
-            if (indirect.Pointers[block_num - POINTERS_PER_INODE] == 0)
+            if (existing[i] == 0)
             {
-                ssize_t allocated_block = allocate_free_block();
-                if (allocated_block == -1)
-                    break;
-
-                indirect.Pointers[block_num - POINTERS_PER_INODE] = allocated_block;
-                modified_indirect = true;
+                memset(buffers[i], 0, Disk::BLOCK_SIZE);
+                continue;
             }
-            block_to_write = indirect.Pointers[block_num - POINTERS_PER_INODE];
-        }
 
-        size_t write_offset;
-        size_t write_length;
-
-        if (written == 0)
-        {
-            write_offset = offset % disk->BLOCK_SIZE;
-            write_length = min(disk->BLOCK_SIZE - write_offset, length);
+            partial.push_back(blocks[i]);
+            partial_buffers.push_back(buffers[i]);
         }
-        else
-        {
-            write_offset = 0;
-            write_length = min(disk->BLOCK_SIZE - 0, length - written);
-        }
-
-        char write_buffer[disk->BLOCK_SIZE];
+        cache.read(partial, partial_buffers);
 
-        if (write_length < disk->BLOCK_SIZE)
-            disk->read(block_to_write, (char *)write_buffer);
-
-        memcpy(write_buffer + write_offset, data + written, write_length);
-        disk->write(block_to_write, (char *)write_buffer);
-        written += write_length;
+        copy_partial(data, written, skip, buffers, head.Data, tail.Data, false);
+        cache.write(blocks, buffers);
     }
 
-    unsigned int new_size = max((size_t)inode.Size, written + offset);
-    if (new_size != inode.Size)
-    {
-        inode.Size = new_size;
-        modified_inode = true;
-    }
+    // A write that stored nothing leaves the size alone, even past the end
+    if (written > 0)
+        set_file_size(inode, max(file_size(inode), written + offset));
 
-    if (modified_inode)
+    if (memcmp(&inode, &original, sizeof(inode)) != 0)
         save_inode(inumber, &inode);
 
-    if (modified_indirect)
-        disk->write(inode.Indirect, indirect.Data);
-
+    disk->account(written);
     return written;
 }
 
-// Allocate free block --------------------------------------------------------------
-ssize_t FileSystem::allocate_free_block()
+// Split buffers -----------------------------------------------------------------
+void FileSystem::split_buffers(char *data, size_t length, size_t skip, size_t count, char *head, char *tail, vector<char *> &buffers)
 {
-    int block = -1;
-    for (unsigned int i = 0; i < num_blocks; i++)
+    // Block i covers data[i * BLOCK_SIZE - skip, (i + 1) * BLOCK_SIZE - skip)
+    buffers.resize(count);
+    for (size_t i = 0; i < count; i++)
     {
-        if (free_bitmap[i])
-        {
-            free_bitmap[i] = 0;
-            block = i;
-            break;
-        }
+        bool whole = (i > 0 || skip == 0) && (i + 1) * Disk::BLOCK_SIZE - skip <= length;
+
+        if (whole)
+            buffers[i] = data + i * Disk::BLOCK_SIZE - skip;
+        else
+            buffers[i] = (i == 0) ? head : tail;
     }
+}
 
-    if (block != -1)
+// Copy partial ------------------------------------------------------------------
+void FileSystem::copy_partial(char *data, size_t length, size_t skip, const vector<char *> &buffers, char *head, char *tail, bool to_data)
+{
+    if (buffers.front() == head)
     {
-        char data[disk->BLOCK_SIZE];
-        memset(data, 0, disk->BLOCK_SIZE);
-        disk->write(block, (char *)data);
+        size_t count = min(Disk::BLOCK_SIZE - skip, length);
+        if (to_data)
+            memcpy(data, head + skip, count);
+        else
+            memcpy(head + skip, data, count);
     }
 
-    return block;
+    if (buffers.size() > 1 && buffers.back() == tail)
+    {
+        size_t position = (buffers.size() - 1) * Disk::BLOCK_SIZE - skip;
+        if (to_data)
+            memcpy(data + position, tail, length - position);
+        else
+            memcpy(tail, data + position, length - position);
+    }
 }
 
-// Load inode --------------------------------------------------------------
-bool FileSystem::load_inode(size_t inumber, Inode *node)
+// Pin view ----------------------------------------------------------------------
+ssize_t FileSystem::pin(size_t inumber, size_t length, size_t offset, View &view)
 {
-    size_t block_number = inumber / INODES_PER_BLOCK;
-    size_t inode_offset = inumber % INODES_PER_BLOCK;
+    // A view is a read without the copy, so it counts as one
+    Stats::Timer timer(statistics[Stats::READ]);
+    Trace::Span span("fs", "pin", inumber);
+    Workload::record(Workload::READ, inumber, length, offset);
+    view.release();
 
     if (inumber >= num_inodes)
-        return false;
-
-    Block block;
-    disk->read(block_number + 1, block.Data);
+        return -1;
 
-    *node = block.Inodes[inode_offset];
+    RwlockGuard guard(inode_lock(inumber), false);
+
+    // Load inode information
+    Inode inode;
+    if (!load_inode(inumber, &inode) || !inode.Valid || offset > file_size(inode))
+        return -1;
+
+    // Adjust length
+    length = min(length, file_size(inode) - offset);
+    if (length == 0)
+        return 0;
+
+    size_t start_block = offset / Disk::BLOCK_SIZE;
+    size_t end_block = (offset + length - 1) / Disk::BLOCK_SIZE;
+    vector<int> blocks;
+    map_blocks(inumber, inode, start_block, end_block - start_block + 1, blocks);
+
+    // Holes are viewed through one shared block of zeros
+    static const char zeros[Disk::BLOCK_SIZE] = {0};
+
+    // Prefer cached copies (they may be newer than the image), then the
+    // mapped image, then reading blocks into the cache; whatever the cache
+    // will not pin is copied with one batched read, as read does
+    vector<int> present;
+    for (size_t i = 0; i < blocks.size(); i++)
+    {
+        if (blocks[i] != 0)
+            present.push_back(blocks[i]);
+    }
+
+    bool mapped = !present.empty() && disk->map(present[0]) != nullptr;
+    vector<const char *> pinned;
+    cache.pin(present, !mapped, pinned);
+
+    view.cache = &cache;
+    vector<int> copied;
+    vector<char *> copy_buffers;
+    for (size_t i = 0; i < present.size(); i++)
+    {
+        if (pinned[i] != nullptr)
+        {
+            view.pinned.push_back(present[i]);
+        }
+        else if (mapped)
+        {
+            pinned[i] = disk->map(present[i]);
+        }
+        else
+        {
+            view.copies.push_back(vector<char>(Disk::BLOCK_SIZE));
+            copied.push_back(present[i]);
+        }
+    }
+
+    // Buffers only once copies stops growing
+    for (size_t i = 0; i < view.copies.size(); i++)
+        copy_buffers.push_back(view.copies[i].data());
+    cache.read(copied, copy_buffers);
+
+    size_t skip = offset % Disk::BLOCK_SIZE;
+    size_t viewed = 0;
+    size_t next_present = 0, next_copy = 0;
+    for (size_t i = 0; i < blocks.size(); i++)
+    {
+        const char *data = zeros;
+        if (blocks[i] != 0)
+        {
+            data = pinned[next_present++];
+            if (data == nullptr)
+                data = copy_buffers[next_copy++];
+        }
+
+        size_t block_offset = (i == 0) ? skip : 0;
+        View::Span span = {data + block_offset, min(Disk::BLOCK_SIZE - block_offset, length - viewed)};
+        view.span_list.push_back(span);
+        viewed += span.Length;
+    }
+
+    readahead(inumber, offset, length, file_size(inode));
+    timer.bytes(viewed);
+    return viewed;
+}
+
+// View size ---------------------------------------------------------------------
+size_t FileSystem::View::size() const
+{
+    size_t total = 0;
+    for (size_t i = 0; i < span_list.size(); i++)
+        total += span_list[i].Length;
+
+    return total;
+}
+
+// Release view ------------------------------------------------------------------
+void FileSystem::View::release()
+{
+    for (size_t i = 0; i < pinned.size(); i++)
+        cache->unpin(pinned[i]);
+
+    pinned.clear();
+    copies.clear();
+    span_list.clear();
+    cache = nullptr;
+}
+
+// Track read stream -------------------------------------------------------------
+void FileSystem::readahead(size_t inumber, size_t offset, size_t length, size_t size)
+{
+    if (readahead_max == 0)
+        return;
+
+    size_t next_block = (offset + length + Disk::BLOCK_SIZE - 1) / Disk::BLOCK_SIZE;
+    size_t size_blocks = (size + Disk::BLOCK_SIZE - 1) / Disk::BLOCK_SIZE;
+    size_t first, end_block;
+    {
+        lock_guard<mutex> guard(stream_lock);
+        Stream &stream = streams[inumber];
+
+        bool sequential = offset == stream.Next;
+        stream.Next = offset + length;
+
+        if (!sequential)
+        {
+            stream.Window /= 2;
+            stream.Ahead = 0;
+            return;
+        }
+
+        stream.Window = min(max(stream.Window * 2, (size_t)READAHEAD_MIN), readahead_max);
+
+        // Top the window up once the stream has used half of it
+        first = max(next_block, stream.Ahead);
+        end_block = min(next_block + stream.Window, size_blocks);
+        if (first >= end_block || first - next_block > stream.Window / 2)
+            return;
+
+        stream.Ahead = end_block;
+    }
+
+    submit_async([=]() { prefetch(inumber, first, end_block - first); return (ssize_t)0; });
+}
+
+// Prefetch blocks ---------------------------------------------------------------
+void FileSystem::prefetch(size_t inumber, size_t first, size_t count)
+{
+    vector<int> blocks;
+    {
+        RwlockGuard guard(inode_lock(inumber), false);
+
+        // Mapping reads the indirect or extent block, so blocks named there
+        // are read ahead too
+        Inode inode;
+        if (!load_inode(inumber, &inode) || !inode.Valid)
+            return;
+
+        size_t size_blocks = (file_size(inode) + Disk::BLOCK_SIZE - 1) / Disk::BLOCK_SIZE;
+        if (first >= size_blocks)
+            return;
+
+        map_blocks(inumber, inode, first, min(count, size_blocks - first), blocks);
+    }
+
+    vector<int> present;
+    for (size_t i = 0; i < blocks.size(); i++)
+    {
+        if (blocks[i] != 0)
+            present.push_back(blocks[i]);
+    }
+
+    if (present.empty())
+        return;
+
+    // A mapped image only needs the kernel to start paging the runs in
+    if (disk->map(present[0]) != nullptr)
+    {
+        size_t start = 0;
+        for (size_t i = 1; i <= present.size(); i++)
+        {
+            if (i < present.size() && present[i] == present[i - 1] + 1)
+                continue;
+
+            disk->advise(present[start], i - start, Disk::WILLNEED);
+            start = i;
+        }
+        return;
+    }
+
+    cache.prefetch(present);
+}
+
+// Read asynchronously ----------------------------------------------------------
+future<ssize_t> FileSystem::read_async(size_t inumber, char *data, size_t length, size_t offset)
+{
+    return submit_async([=]() { return read(inumber, data, length, offset); });
+}
+
+// Write asynchronously ---------------------------------------------------------
+future<ssize_t> FileSystem::write_async(size_t inumber, char *data, size_t length, size_t offset)
+{
+    return submit_async([=]() { return write(inumber, data, length, offset); });
+}
+
+// Submit asynchronous request --------------------------------------------------
+future<ssize_t> FileSystem::submit_async(function<ssize_t()> request)
+{
+    if (disk == nullptr)
+    {
+        promise<ssize_t> failed;
+        failed.set_value(-1);
+        return failed.get_future();
+    }
+
+    shared_ptr<packaged_task<ssize_t()> > task = make_shared<packaged_task<ssize_t()> >(request);
+    future<ssize_t> result = task->get_future();
+
+    {
+        lock_guard<mutex> guard(async_lock);
+
+        if (async_workers.empty())
+        {
+            for (size_t i = 0; i < disk->queue_depth(); i++)
+                async_workers.push_back(thread(&FileSystem::async_worker, this));
+        }
+
+        async_queue.push_back([task]() { (*task)(); });
+    }
+    async_ready.notify_one();
+
+    return result;
+}
+
+// Asynchronous worker ----------------------------------------------------------
+void FileSystem::async_worker()
+{
+    while (true)
+    {
+        function<void()> request;
+        {
+            unique_lock<mutex> guard(async_lock);
+            async_ready.wait(guard, [this]() { return async_stop || !async_queue.empty(); });
+
+            // Drain the queue before honouring a stop
+            if (async_queue.empty())
+                return;
+
+            request = async_queue.front();
+            async_queue.pop_front();
+        }
+        request();
+    }
+}
+
+// Stop asynchronous workers ----------------------------------------------------
+void FileSystem::stop_async()
+{
+    {
+        lock_guard<mutex> guard(async_lock);
+        async_stop = true;
+    }
+    async_ready.notify_all();
+
+    for (size_t i = 0; i < async_workers.size(); i++)
+        async_workers[i].join();
+
+    async_workers.clear();
+    async_stop = false;
+}
+
+// Max file size -----------------------------------------------------------------
+size_t FileSystem::max_file_size(const Inode &inode)
+{
+    if (layout(inode) == LAYOUT_EXTENTS)
+        return UINT32_MAX;
+
+    if (layout(inode) == LAYOUT_TREE)
+    {
+        size_t blocks = TREE_POINTERS_PER_INODE;
+        size_t span = 1;
+        for (size_t level = 1; level <= TREE_LEVELS; level++)
+        {
+            span *= POINTERS_PER_BLOCK;
+            blocks += span;
+        }
+        return blocks * Disk::BLOCK_SIZE;
+    }
+
+    return (POINTERS_PER_INODE + POINTERS_PER_BLOCK) * Disk::BLOCK_SIZE;
+}
+
+// File size ---------------------------------------------------------------------
+size_t FileSystem::file_size(const Inode &inode)
+{
+    if (layout(inode) == LAYOUT_TREE)
+        return ((size_t)inode.SizeHigh << 32) | inode.Size;
+
+    return inode.Size;
+}
+
+// Set file size -----------------------------------------------------------------
+void FileSystem::set_file_size(Inode &inode, size_t size)
+{
+    inode.Size = (uint32_t)size;
+    if (layout(inode) == LAYOUT_TREE)
+        inode.SizeHigh = (uint32_t)(size >> 32);
+}
+
+// Map blocks --------------------------------------------------------------------
+void FileSystem::map_blocks(size_t inumber, Inode &inode, size_t first, size_t count, vector<int> &blocks)
+{
+    if (layout(inode) == LAYOUT_EXTENTS)
+    {
+        vector<Extent> extents;
+        load_extents(inode, extents);
+        extent_blocks(extents, first, count, blocks);
+        return;
+    }
+
+    bool tree = layout(inode) == LAYOUT_TREE;
+    size_t direct = tree ? TREE_POINTERS_PER_INODE : POINTERS_PER_INODE;
+    const uint32_t *direct_pointers = tree ? inode.TreeDirect : inode.Direct;
+    size_t max_blocks = max_file_size(inode) / Disk::BLOCK_SIZE;
+
+    // Start from the pointer block the stream resolved last
+    shared_ptr<Block> leaf;
+    size_t leaf_first = 0;
+    {
+        lock_guard<mutex> guard(stream_lock);
+        unordered_map<size_t, Stream>::iterator it = streams.find(inumber);
+        if (it != streams.end())
+        {
+            leaf = it->second.Leaf;
+            leaf_first = it->second.LeafFirst;
+        }
+    }
+
+    bool loaded = false;
+    blocks.assign(count, 0);
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t block_num = first + i;
+
+        if (block_num < direct)
+        {
+            blocks[i] = direct_pointers[block_num];
+            continue;
+        }
+
+        if (block_num >= max_blocks)
+            break;
+
+        if (!leaf || block_num < leaf_first || block_num >= leaf_first + POINTERS_PER_BLOCK)
+        {
+            leaf = load_leaf(inode, block_num, &leaf_first);
+            loaded = true;
+        }
+
+        blocks[i] = leaf->Pointers[block_num - leaf_first];
+    }
+
+    if (loaded)
+    {
+        lock_guard<mutex> guard(stream_lock);
+        Stream &stream = streams[inumber];
+        stream.Leaf = leaf;
+        stream.LeafFirst = leaf_first;
+    }
+}
+
+// Tree path ---------------------------------------------------------------------
+bool FileSystem::tree_path(size_t block, size_t *level, size_t *digits, size_t *leaf_first)
+{
+    if (block < TREE_POINTERS_PER_INODE)
+        return false;
+
+    // Find the subtree holding block, then its pointer index at each depth
+    size_t relative = block - TREE_POINTERS_PER_INODE;
+    size_t span = POINTERS_PER_BLOCK;
+    for (*level = 1; *level <= TREE_LEVELS; (*level)++)
+    {
+        if (relative < span)
+        {
+            size_t rest = relative;
+            for (size_t depth = *level; depth-- > 0;)
+            {
+                digits[depth] = rest % POINTERS_PER_BLOCK;
+                rest /= POINTERS_PER_BLOCK;
+            }
+
+            *leaf_first = block - relative % POINTERS_PER_BLOCK;
+            return true;
+        }
+
+        relative -= span;
+        span *= POINTERS_PER_BLOCK;
+    }
+
+    return false;
+}
+
+// Load leaf ---------------------------------------------------------------------
+shared_ptr<FileSystem::Block> FileSystem::load_leaf(Inode &inode, size_t block, size_t *leaf_first)
+{
+    shared_ptr<Block> leaf = make_shared<Block>();
+    uint32_t number;
+
+    if (layout(inode) == LAYOUT_TREE)
+    {
+        size_t level, digits[TREE_LEVELS];
+        tree_path(block, &level, digits, leaf_first);
+
+        // Walk down to the pointer block that points at data blocks
+        number = inode.TreeIndirect[level - 1];
+        for (size_t depth = 0; depth + 1 < level && number != 0; depth++)
+        {
+            read_metadata(number, leaf->Data);
+            number = leaf->Pointers[digits[depth]];
+        }
+    }
+    else
+    {
+        *leaf_first = POINTERS_PER_INODE;
+        number = inode.Indirect;
+    }
+
+    // A missing pointer block maps nothing
+    if (number == 0)
+        memset(leaf->Data, 0, Disk::BLOCK_SIZE);
+    else
+        read_metadata(number, leaf->Data);
+
+    return leaf;
+}
+
+// Forget stream -----------------------------------------------------------------
+void FileSystem::forget_stream(size_t inumber, bool leaf_only)
+{
+    lock_guard<mutex> guard(stream_lock);
+
+    unordered_map<size_t, Stream>::iterator it = streams.find(inumber);
+    if (it == streams.end())
+        return;
+
+    if (leaf_only)
+        it->second.Leaf.reset();
+    else
+        streams.erase(it);
+}
+
+// Allocate blocks ---------------------------------------------------------------
+size_t FileSystem::allocate_blocks(Inode &inode, size_t first, size_t count, vector<int> &blocks)
+{
+    if (layout(inode) == LAYOUT_EXTENTS)
+        return allocate_extents(inode, first, count, blocks);
+
+    if (layout(inode) == LAYOUT_TREE)
+        return allocate_tree(inode, first, count, blocks);
+
+    return allocate_pointers(inode, first, count, blocks);
+}
+
+// Allocate tree -----------------------------------------------------------------
+size_t FileSystem::allocate_tree(Inode &inode, size_t first, size_t count, vector<int> &blocks)
+{
+    // Pointer blocks touched so far, and the ones that must be written back
+    unordered_map<int, Block> nodes;
+    set<int> modified;
+
+    // Data blocks come from runs, so a file grows contiguously when it can
+    size_t run_start = 0;
+    size_t run_left = 0;
+    size_t goal = 0;
+
+    blocks.clear();
+    for (size_t block_num = first; block_num < first + count; block_num++)
+    {
+        uint32_t *pointer;
+        int container = 0;
+
+        if (block_num < TREE_POINTERS_PER_INODE)
+        {
+            pointer = &inode.TreeDirect[block_num];
+        }
+        else
+        {
+            size_t level, digits[TREE_LEVELS], leaf_first;
+            if (!tree_path(block_num, &level, digits, &leaf_first))
+                break;
+
+            // Walk down, adding empty pointer blocks where the path is missing
+            pointer = &inode.TreeIndirect[level - 1];
+            bool failed = false;
+            for (size_t depth = 0; depth < level; depth++)
+            {
+                if (*pointer == 0)
+                {
+                    ssize_t pointer_block = allocate_free_block();
+                    if (pointer_block == -1)
+                    {
+                        failed = true;
+                        break;
+                    }
+
+                    *pointer = pointer_block;
+                    memset(nodes[pointer_block].Data, 0, Disk::BLOCK_SIZE);
+                    modified.insert(pointer_block);
+                    if (container != 0)
+                        modified.insert(container);
+                }
+                else if (nodes.find(*pointer) == nodes.end())
+                {
+                    read_metadata(*pointer, nodes[*pointer].Data);
+                }
+
+                container = *pointer;
+                pointer = &nodes[container].Pointers[digits[depth]];
+            }
+
+            if (failed)
+                break;
+        }
+
+        if (*pointer == 0)
+        {
+            if (run_left == 0)
+            {
+                ssize_t start = allocate_run(goal, first + count - block_num, &run_left);
+                if (start == -1)
+                    break;
+                run_start = start;
+            }
+
+            *pointer = run_start++;
+            run_left--;
+            if (container != 0)
+                modified.insert(container);
+        }
+
+        blocks.push_back(*pointer);
+        goal = *pointer + 1;
+    }
+
+    if (run_left > 0)
+        release_run(run_start, run_left);
+
+    vector<int> numbers;
+    vector<char *> buffers;
+    for (set<int>::iterator it = modified.begin(); it != modified.end(); it++)
+    {
+        numbers.push_back(*it);
+        buffers.push_back(nodes[*it].Data);
+    }
+    write_metadata(numbers, buffers);
+
+    return blocks.size();
+}
+
+// Allocate pointers -------------------------------------------------------------
+size_t FileSystem::allocate_pointers(Inode &inode, size_t first, size_t count, vector<int> &blocks)
+{
+    Block indirect;
+    bool read_indirect = false;
+    bool modified_indirect = false;
+
+    blocks.clear();
+    for (size_t block_num = first; block_num < first + count; block_num++)
+    {
+        if (block_num < POINTERS_PER_INODE)
+        {
+            if (inode.Direct[block_num] == 0)
+            {
+                ssize_t allocated_block = allocate_free_block();
+                if (allocated_block == -1)
+                    break;
+
+                inode.Direct[block_num] = allocated_block;
+            }
+            blocks.push_back(inode.Direct[block_num]);
+            continue;
+        }
+
+        if (inode.Indirect == 0)
+        {
+            ssize_t allocated_block = allocate_free_block();
+            if (allocated_block == -1)
+                break;
+
+            // A new pointer block starts out empty rather than read back
+            inode.Indirect = allocated_block;
+            memset(indirect.Data, 0, Disk::BLOCK_SIZE);
+            read_indirect = true;
+            modified_indirect = true;
+        }
+
+        if (!read_indirect)
+        {
+            read_metadata(inode.Indirect, indirect.Data);
+            read_indirect = true;
+        }
+
+        uint32_t &pointer = indirect.Pointers[block_num - POINTERS_PER_INODE];
+        if (pointer == 0)
+        {
+            ssize_t allocated_block = allocate_free_block();
+            if (allocated_block == -1)
+                break;
+
+            pointer = allocated_block;
+            modified_indirect = true;
+        }
+        blocks.push_back(pointer);
+    }
+
+    if (modified_indirect)
+        write_metadata(vector<int>(1, inode.Indirect), vector<char *>(1, indirect.Data));
+
+    return blocks.size();
+}
+
+// Allocate extents --------------------------------------------------------------
+size_t FileSystem::allocate_extents(Inode &inode, size_t first, size_t count, vector<int> &blocks)
+{
+    vector<Extent> extents;
+    load_extents(inode, extents);
+
+    // Rebuild the extent list, allocating runs for the holes (and the part
+    // past the mapped end) that [first, end) covers.  An extent starting at
+    // block 0 is a hole.
+    size_t end = first + count;
+    vector<Extent> result;
+    vector<Extent> allocated;
+    bool full = false;
+
+    // Append an extent, merging it with the last one where possible
+    auto append = [&result](uint32_t start, size_t length)
+    {
+        if (length == 0)
+            return;
+
+        if (!result.empty())
+        {
+            Extent &last = result.back();
+            bool holes = start == 0 && last.Start == 0;
+            bool adjacent = start != 0 && last.Start != 0 && last.Start + last.Length == start;
+            if (holes || adjacent)
+            {
+                last.Length += length;
+                return;
+            }
+        }
+
+        Extent extent = {start, (uint32_t)length};
+        result.push_back(extent);
+    };
+
+    // Allocate runs for [low, high), preferring to extend the last extent in
+    // place; what cannot be allocated stays a hole
+    auto fill = [&](size_t low, size_t high)
+    {
+        while (low < high && !full)
+        {
+            size_t goal = (!result.empty() && result.back().Start != 0) ? result.back().Start + result.back().Length : 0;
+            size_t length = 0;
+            ssize_t start = allocate_run(goal, high - low, &length);
+            if (start == -1)
+            {
+                full = true;
+                break;
+            }
+
+            Extent run = {(uint32_t)start, (uint32_t)length};
+            allocated.push_back(run);
+            append(start, length);
+            low += length;
+        }
+        append(0, high - low);
+    };
+
+    size_t logical = 0;
+    for (size_t i = 0; i < extents.size(); i++)
+    {
+        size_t low = max(logical, first);
+        size_t high = min(logical + extents[i].Length, end);
+
+        if (extents[i].Start != 0 || low >= high)
+        {
+            append(extents[i].Start, extents[i].Length);
+        }
+        else
+        {
+            append(0, low - logical);
+            fill(low, high);
+            append(0, logical + extents[i].Length - high);
+        }
+        logical += extents[i].Length;
+    }
+
+    if (logical < end)
+    {
+        append(0, first > logical ? first - logical : 0);
+        fill(max(logical, first), end);
+    }
+
+    // The file never ends in a hole, so drop what could not be allocated
+    while (!result.empty() && result.back().Start == 0)
+        result.pop_back();
+
+    if (!allocated.empty())
+    {
+        // Spill to an extent block once the inline extents are full
+        bool fits = result.size() <= EXTENTS_PER_INODE + EXTENTS_PER_BLOCK;
+        if (fits && result.size() > EXTENTS_PER_INODE && inode.ExtentBlock == 0)
+        {
+            ssize_t extent_block = allocate_free_block();
+            if (extent_block == -1)
+                fits = false;
+            else
+                inode.ExtentBlock = extent_block;
+        }
+
+        if (fits)
+        {
+            save_extents(inode, result);
+        }
+        else
+        {
+            for (size_t i = 0; i < allocated.size(); i++)
+                release_run(allocated[i].Start, allocated[i].Length);
+            result = extents;
+        }
+    }
+
+    // Only the allocated prefix of the range is mapped
+    extent_blocks(result, first, count, blocks);
+
+    size_t mapped = 0;
+    while (mapped < blocks.size() && blocks[mapped] != 0)
+        mapped++;
+    blocks.resize(mapped);
+
+    return mapped;
+}
+
+// Extent blocks -----------------------------------------------------------------
+void FileSystem::extent_blocks(const vector<Extent> &extents, size_t first, size_t count, vector<int> &blocks)
+{
+    blocks.assign(count, 0);
+
+    size_t logical = 0;
+    for (size_t i = 0; i < extents.size() && logical < first + count; i++)
+    {
+        size_t low = max(logical, first);
+        size_t high = min(logical + extents[i].Length, first + count);
+
+        for (size_t block_num = low; block_num < high && extents[i].Start != 0; block_num++)
+            blocks[block_num - first] = extents[i].Start + (block_num - logical);
+
+        logical += extents[i].Length;
+    }
+}
+
+// Load extents ------------------------------------------------------------------
+void FileSystem::load_extents(Inode &inode, vector<Extent> &extents)
+{
+    extents.assign(inode.Extents, inode.Extents + min((size_t)inode.ExtentCount, (size_t)EXTENTS_PER_INODE));
+
+    if (inode.ExtentCount > EXTENTS_PER_INODE)
+    {
+        Block block;
+        read_metadata(inode.ExtentBlock, block.Data);
+        extents.insert(extents.end(), block.Extents, block.Extents + (inode.ExtentCount - EXTENTS_PER_INODE));
+    }
+}
+
+// Save extents ------------------------------------------------------------------
+void FileSystem::save_extents(Inode &inode, const vector<Extent> &extents)
+{
+    inode.ExtentCount = extents.size();
+
+    for (size_t i = 0; i < EXTENTS_PER_INODE && i < extents.size(); i++)
+        inode.Extents[i] = extents[i];
+
+    if (extents.size() > EXTENTS_PER_INODE)
+    {
+        Block block;
+        memset(block.Data, 0, Disk::BLOCK_SIZE);
+        copy(extents.begin() + EXTENTS_PER_INODE, extents.end(), block.Extents);
+        write_metadata(vector<int>(1, inode.ExtentBlock), vector<char *>(1, block.Data));
+    }
+}
+
+// Owned blocks ------------------------------------------------------------------
+void FileSystem::owned_blocks(Inode &inode, vector<int> &blocks)
+{
+    blocks.clear();
+
+    if (layout(inode) == LAYOUT_EXTENTS)
+    {
+        vector<Extent> extents;
+        load_extents(inode, extents);
+
+        for (size_t i = 0; i < extents.size(); i++)
+            for (size_t j = 0; j < extents[i].Length && extents[i].Start != 0; j++)
+                blocks.push_back(extents[i].Start + j);
+
+        if (inode.ExtentBlock != 0)
+            blocks.push_back(inode.ExtentBlock);
+        return;
+    }
+
+    if (layout(inode) == LAYOUT_TREE)
+    {
+        for (unsigned int i = 0; i < TREE_POINTERS_PER_INODE; i++)
+        {
+            if (inode.TreeDirect[i] != 0)
+                blocks.push_back(inode.TreeDirect[i]);
+        }
+
+        for (unsigned int level = 1; level <= TREE_LEVELS; level++)
+            tree_blocks(nullptr, this, inode.TreeIndirect[level - 1], level, blocks, blocks);
+        return;
+    }
+
+    for (unsigned int i = 0; i < POINTERS_PER_INODE; i++)
+    {
+        if (inode.Direct[i] != 0)
+            blocks.push_back(inode.Direct[i]);
+    }
+
+    if (inode.Indirect != 0)
+    {
+        Block indirect;
+        read_metadata(inode.Indirect, indirect.Data);
+
+        for (unsigned int i = 0; i < POINTERS_PER_BLOCK; i++)
+        {
+            if (indirect.Pointers[i] != 0)
+                blocks.push_back(indirect.Pointers[i]);
+        }
+
+        blocks.push_back(inode.Indirect);
+    }
+}
+
+// Tree blocks -------------------------------------------------------------------
+void FileSystem::tree_blocks(Disk *disk, FileSystem *fs, uint32_t root, size_t depth, vector<int> &pointers, vector<int> &data)
+{
+    if (root == 0)
+        return;
+
+    // Read through the file system when mounted, else straight from the disk
+    Block node;
+    if (fs != nullptr)
+        fs->read_metadata(root, node.Data);
+    else
+        disk->read(root, node.Data);
+
+    pointers.push_back(root);
+    for (unsigned int i = 0; i < POINTERS_PER_BLOCK; i++)
+    {
+        if (node.Pointers[i] == 0)
+            continue;
+
+        if (depth == 1)
+            data.push_back(node.Pointers[i]);
+        else
+            tree_blocks(disk, fs, node.Pointers[i], depth - 1, pointers, data);
+    }
+}
+
+// Allocate free block --------------------------------------------------------------
+ssize_t FileSystem::allocate_free_block()
+{
+    Stats::Timer timer(statistics[Stats::ALLOCATE_BLOCK]);
+    Trace::Span span("fs", "allocate_free_block");
+    lock_guard<mutex> guard(alloc_lock);
+
+    // Next-fit: resume the search where the previous allocation left off
+    ssize_t block = free_bitmap.find_next(alloc_cursor);
+
+    // The block is not zeroed: every caller writes all of it before it is
+    // read, so zeroing would only double the writes
+    if (block != -1)
+    {
+        mark_free_block(block, false);
+        alloc_cursor = block + 1;
+        span.block(block);
+    }
+
+    return block;
+}
+
+// Allocate run ------------------------------------------------------------------
+ssize_t FileSystem::allocate_run(size_t goal, size_t length, size_t *allocated)
+{
+    Trace::Span span("fs", "allocate_run");
+    lock_guard<mutex> guard(alloc_lock);
+
+    // Take the goal block and whatever follows it if it is free, otherwise
+    // the first free run long enough (or the longest run nearby)
+    ssize_t start;
+    if (goal >= data_start && goal < num_blocks && free_bitmap.test(goal))
+    {
+        start = goal;
+        *allocated = free_bitmap.run_length(goal, length);
+    }
+    else
+    {
+        start = free_bitmap.find_run(alloc_cursor, length, allocated);
+        if (start == -1)
+            return -1;
+    }
+
+    // Like allocate_free_block, the run is left for the caller to fill
+    for (size_t i = 0; i < *allocated; i++)
+        mark_free_block(start + i, false);
+
+    alloc_cursor = start + *allocated;
+    span.block(start);
+    span.count(*allocated);
+    return start;
+}
+
+// Release run -------------------------------------------------------------------
+void FileSystem::release_run(size_t start, size_t length)
+{
+    lock_guard<mutex> guard(alloc_lock);
+
+    for (size_t i = 0; i < length; i++)
+        mark_free_block(start + i, true);
+}
+
+// Load inode --------------------------------------------------------------
+bool FileSystem::load_inode(size_t inumber, Inode *node)
+{
+    Stats::Timer timer(statistics[Stats::LOAD_INODE]);
+    Trace::Span span("fs", "load_inode", inumber);
+    size_t block_number = inumber / INODES_PER_BLOCK;
+    size_t inode_offset = inumber % INODES_PER_BLOCK;
+
+    if (inumber >= num_inodes)
+        return false;
+
+    lock_guard<mutex> guard(table_lock);
+    *node = inode_block(block_number)[inode_offset];
 
     return true;
 }
@@ -467,17 +1813,646 @@ bool FileSystem::load_inode(size_t inumber, Inode *node)
 // Save inode --------------------------------------------------------------
 bool FileSystem::save_inode(size_t inumber, Inode *node)
 {
-
+    Trace::Span span("fs", "save_inode", inumber);
     size_t block_number = inumber / INODES_PER_BLOCK;
     size_t inode_offset = inumber % INODES_PER_BLOCK;
 
     if (inumber >= num_inodes)
         return false;
 
-    Block block;
-    disk->read(block_number + 1, block.Data);
-    block.Inodes[inode_offset] = *node;
-    disk->write(block_number + 1, block.Data);
+    // Update the in-memory copy; the whole block is written back on sync
+    lock_guard<mutex> guard(table_lock);
+    inode_block(block_number)[inode_offset] = *node;
+    if (!inode_dirty[block_number])
+    {
+        inode_dirty[block_number] = true;
+        journal_dirtied(1);
+    }
+
+    return true;
+}
+
+// Inode block --------------------------------------------------------------
+FileSystem::Inode *FileSystem::inode_block(size_t block_number)
+{
+    // The inode table owns the inode region, so it bypasses the block cache
+    if (inode_table[block_number] == nullptr)
+    {
+        inode_table[block_number] = new Block;
+        if (block_number < inode_high_water)
+            disk->read(block_number + 1, inode_table[block_number]->Data);
+        else
+            memset(inode_table[block_number]->Data, 0, Disk::BLOCK_SIZE);
+    }
+
+    return inode_table[block_number]->Inodes;
+}
+
+// Sync inodes --------------------------------------------------------------
+void FileSystem::sync_inodes()
+{
+    lock_guard<mutex> guard(table_lock);
+
+    // Raising the high-water mark initializes every block below it, so
+    // untouched blocks between the old mark and a dirty one go out as well
+    size_t high_water = inode_high_water;
+    for (size_t i = inode_high_water; i < inode_dirty.size(); i++)
+    {
+        if (inode_dirty[i])
+            high_water = i + 1;
+    }
+
+    // Every dirty inode in a block goes out with a single block write, and
+    // all dirty blocks go out with one batched request
+    vector<int> blocks;
+    vector<char *> buffers;
+    for (size_t i = 0; i < inode_dirty.size(); i++)
+    {
+        if (inode_dirty[i] || (i >= inode_high_water && i < high_water))
+        {
+            inode_block(i);
+            blocks.push_back(i + 1);
+            buffers.push_back(inode_table[i]->Data);
+            inode_dirty[i] = false;
+        }
+    }
+
+    disk->write(blocks, buffers);
+
+    // Record the new mark only once the blocks below it are written
+    if (high_water != inode_high_water)
+    {
+        inode_high_water = high_water;
+        super.InodeHighWater = high_water;
+        write_state(super.State);
+    }
+}
+
+// Load bitmap --------------------------------------------------------------
+void FileSystem::load_bitmap(Disk *disk, Bitmap &bitmap, size_t start)
+{
+    const size_t words_per_block = Disk::BLOCK_SIZE / sizeof(uint64_t);
+    uint64_t *words = bitmap.words();
+    size_t nwords = bitmap.nwords();
+
+    // Read the whole region as one batch, so it goes out as a single run
+    size_t nblocks = (nwords + words_per_block - 1) / words_per_block;
+    vector<Block> region(nblocks);
+    vector<int> blocks;
+    vector<char *> buffers;
+    for (size_t i = 0; i < nblocks; i++)
+    {
+        blocks.push_back(start + i);
+        buffers.push_back(region[i].Data);
+    }
+    disk->read(blocks, buffers);
+
+    for (size_t i = 0; i < nblocks; i++)
+    {
+        size_t count = min(words_per_block, nwords - i * words_per_block);
+        memcpy(words + i * words_per_block, region[i].Data, count * sizeof(uint64_t));
+    }
+
+    bitmap.refresh();
+}
+
+// Save bitmap --------------------------------------------------------------
+void FileSystem::save_bitmap(Disk *disk, Bitmap &bitmap, size_t start, vector<bool> &dirty)
+{
+    deque<Block> copies;
+    vector<int> blocks;
+    vector<char *> buffers;
+    for (size_t i = 0; i < dirty.size(); i++)
+    {
+        if (!dirty[i])
+            continue;
+
+        copies.emplace_back();
+        bitmap_block(bitmap, i, copies.back().Data);
+        blocks.push_back(start + i);
+        buffers.push_back(copies.back().Data);
+        dirty[i] = false;
+    }
+
+    if (!blocks.empty())
+        disk->write(blocks, buffers);
+}
+
+// Bitmap block -------------------------------------------------------------
+void FileSystem::bitmap_block(Bitmap &bitmap, size_t index, char *data)
+{
+    const size_t words_per_block = Disk::BLOCK_SIZE / sizeof(uint64_t);
+    size_t count = min(words_per_block, bitmap.nwords() - index * words_per_block);
+
+    memset(data, 0, Disk::BLOCK_SIZE);
+    memcpy(data, bitmap.words() + index * words_per_block, count * sizeof(uint64_t));
+}
+
+// Sync bitmaps -------------------------------------------------------------
+void FileSystem::sync_bitmaps()
+{
+    lock_guard<mutex> guard(alloc_lock);
+
+    save_bitmap(disk, free_bitmap, bitmap_start, bitmap_dirty);
+    save_bitmap(disk, inode_bitmap, inode_bitmap_start, inode_bitmap_dirty);
+}
+
+// Inode lock ---------------------------------------------------------------
+pthread_rwlock_t *FileSystem::inode_lock(size_t inumber)
+{
+    return &inode_locks[inumber];
+}
+
+// Mark free block (alloc_lock held) ----------------------------------------
+void FileSystem::mark_free_block(size_t block, bool free)
+{
+    if (free)
+        free_bitmap.set(block);
+    else
+        free_bitmap.reset(block);
+
+    if (!bitmap_dirty.empty() && !bitmap_dirty[block / BITS_PER_BLOCK])
+    {
+        bitmap_dirty[block / BITS_PER_BLOCK] = true;
+        journal_dirtied(1);
+    }
+}
+
+// Mark free inode (alloc_lock held) ----------------------------------------
+void FileSystem::mark_free_inode(size_t inumber, bool free)
+{
+    if (free)
+        inode_bitmap.set(inumber);
+    else
+        inode_bitmap.reset(inumber);
+
+    if (!inode_bitmap_dirty.empty() && !inode_bitmap_dirty[inumber / BITS_PER_BLOCK])
+    {
+        inode_bitmap_dirty[inumber / BITS_PER_BLOCK] = true;
+        journal_dirtied(1);
+    }
+}
+
+// Root directory ---------------------------------------------------------------
+ssize_t FileSystem::root()
+{
+    lock_guard<mutex> guard(table_lock);
+    if (disk == nullptr || super.Version < VERSION_DIRECTORIES || super.RootDirectory == 0)
+        return -1;
+
+    return super.RootDirectory - 1;
+}
+
+bool FileSystem::set_root(size_t inumber)
+{
+    if (disk == nullptr || super.Version < VERSION_DIRECTORIES || inumber >= num_inodes)
+        return false;
+
+    {
+        RwlockGuard update(&journal_barrier, false);
+        RwlockGuard inode_guard(inode_lock(inumber), false);
+
+        Inode node;
+        if (!load_inode(inumber, &node) || !node.Valid)
+            return false;
+
+        lock_guard<mutex> guard(table_lock);
+
+        // With a journal the superblock goes out with the next commit, or
+        // replaying an earlier transaction would bring the old one back
+        super.RootDirectory = inumber + 1;
+        if (journal_blocks > 0)
+        {
+            super_dirty = true;
+            journal_dirtied(1);
+        }
+        else
+        {
+            write_state(super.State);
+        }
+    }
+
+    if (durability == Disk::SYNC_ALWAYS)
+        sync_all();
+
+    return true;
+}
+
+// Directory type -------------------------------------------------------------
+bool FileSystem::is_directory(size_t inumber)
+{
+    if (disk == nullptr || inumber >= num_inodes)
+        return false;
+
+    RwlockGuard guard(inode_lock(inumber), false);
+
+    Inode node;
+    return load_inode(inumber, &node) && node.Valid && (node.Valid & TYPE_DIRECTORY);
+}
+
+bool FileSystem::set_directory(size_t inumber, bool directory)
+{
+    if (disk == nullptr || super.Version < VERSION_DIRECTORIES || inumber >= num_inodes)
+        return false;
+
+    {
+        RwlockGuard update(&journal_barrier, false);
+        RwlockGuard guard(inode_lock(inumber), true);
+
+        Inode node;
+        if (!load_inode(inumber, &node) || !node.Valid)
+            return false;
+
+        uint32_t valid = directory ? (node.Valid | TYPE_DIRECTORY) : (node.Valid & ~TYPE_DIRECTORY);
+        if (valid != node.Valid)
+        {
+            node.Valid = valid;
+            if (!save_inode(inumber, &node))
+                return false;
+        }
+    }
+
+    if (durability == Disk::SYNC_ALWAYS)
+        sync_all();
 
     return true;
-}
\ No newline at end of file
+}
+
+// Write state --------------------------------------------------------------
+void FileSystem::write_state(uint32_t state)
+{
+    Block block;
+    memset(block.Data, 0, Disk::BLOCK_SIZE);
+
+    super.State = state;
+    block.Super = super;
+    disk->write(0, block.Data);
+}
+
+// Read metadata ------------------------------------------------------------
+void FileSystem::read_metadata(int block, char *data)
+{
+    // The running transaction is newest, then the one being committed;
+    // the cache and disk only catch up once a commit has written it home
+    if (journal_blocks > 0)
+    {
+        lock_guard<mutex> guard(journal_lock);
+
+        unordered_map<int, Block>::iterator it = journal_running.find(block);
+        if (it == journal_running.end())
+        {
+            it = journal_committing.find(block);
+            if (it == journal_committing.end())
+                it = journal_running.end();
+        }
+
+        if (it != journal_running.end())
+        {
+            memcpy(data, it->second.Data, Disk::BLOCK_SIZE);
+            return;
+        }
+    }
+
+    cache.read(block, data);
+}
+
+// Write metadata -----------------------------------------------------------
+void FileSystem::write_metadata(const vector<int> &blocks, const vector<char *> &data)
+{
+    if (journal_blocks == 0)
+    {
+        cache.write(blocks, data);
+        return;
+    }
+
+    size_t added = 0;
+    {
+        lock_guard<mutex> guard(journal_lock);
+        for (size_t i = 0; i < blocks.size(); i++)
+        {
+            added += journal_running.count(blocks[i]) == 0;
+            memcpy(journal_running[blocks[i]].Data, data[i], Disk::BLOCK_SIZE);
+        }
+    }
+
+    journal_dirtied(added);
+}
+
+// Journal dirtied ----------------------------------------------------------
+void FileSystem::journal_dirtied(size_t blocks)
+{
+    if (journal_blocks == 0 || blocks == 0)
+        return;
+
+    // Commit in the background once the running transaction fills half the
+    // journal, leaving room for what arrives before the commit takes over
+    if ((journal_size += blocks) < journal_capacity() / 2 || journal_queued.exchange(true))
+        return;
+
+    submit_async([this]() {
+        commit();
+        return (ssize_t)0;
+    });
+}
+
+// Journal capacity ---------------------------------------------------------
+size_t FileSystem::journal_capacity() const
+{
+    // A descriptor and a commit block frame the logged blocks
+    return min((size_t)journal_blocks - 2, (size_t)BLOCKS_PER_DESCRIPTOR);
+}
+
+// Revoke -------------------------------------------------------------------
+void FileSystem::revoke(const vector<int> &blocks)
+{
+    if (journal_blocks == 0)
+        return;
+
+    unique_lock<mutex> guard(journal_lock);
+
+    // Freed blocks no longer belong in the running transaction, and a block
+    // the current commit is writing home must get there before anything
+    // else can be written to it
+    for (size_t i = 0; i < blocks.size(); i++)
+    {
+        journal_running.erase(blocks[i]);
+        while (journal_committing.count(blocks[i]))
+            journal_idle.wait(guard);
+    }
+}
+
+// Commit -------------------------------------------------------------------
+void FileSystem::commit()
+{
+    unique_lock<mutex> guard(commit_lock);
+
+    // Group commit: a commit already under way may have taken its
+    // transaction before the caller's updates, so the caller needs the one
+    // after it.  Whoever finds no commit running runs the next one on
+    // behalf of everyone waiting.
+    size_t target = commits + (committing ? 2 : 1);
+    while (commits < target)
+    {
+        if (committing)
+        {
+            commit_done.wait(guard);
+            continue;
+        }
+
+        committing = true;
+        guard.unlock();
+        try
+        {
+            commit_transaction();
+        }
+        catch (...)
+        {
+            guard.lock();
+            committing = false;
+            commit_done.notify_all();
+            throw;
+        }
+        guard.lock();
+        committing = false;
+        commits++;
+        commit_done.notify_all();
+    }
+}
+
+// Commit transaction -------------------------------------------------------
+void FileSystem::commit_transaction()
+{
+    Trace::Span span("fs", "commit");
+    deque<Block> copies;
+    vector<int> homes;
+    vector<char *> buffers;
+    vector<int> gap;
+
+    // Take the transaction over while no operation is half way through
+    {
+        RwlockGuard barrier(&journal_barrier, true);
+        journal_queued = false;
+        journal_size = 0;
+
+        {
+            lock_guard<mutex> guard(table_lock);
+
+            // Inode blocks between the high-water mark and a dirty block
+            // were never written, so they are empty and only need zeroing
+            // on disk before the new mark is
+            size_t high_water = inode_high_water;
+            for (size_t i = inode_high_water; i < inode_dirty.size(); i++)
+            {
+                if (inode_dirty[i])
+                    high_water = i + 1;
+            }
+
+            for (size_t i = 0; i < inode_dirty.size(); i++)
+            {
+                if (inode_dirty[i])
+                {
+                    copies.push_back(*(Block *)inode_block(i));
+                    homes.push_back(i + 1);
+                    inode_dirty[i] = false;
+                }
+                else if (i >= inode_high_water && i < high_water)
+                {
+                    inode_block(i);
+                    gap.push_back(i + 1);
+                }
+            }
+
+            if (high_water != inode_high_water || super_dirty)
+            {
+                inode_high_water = high_water;
+                super.InodeHighWater = high_water;
+                super_dirty = false;
+
+                copies.push_back(Block());
+                memset(copies.back().Data, 0, Disk::BLOCK_SIZE);
+                copies.back().Super = super;
+                homes.push_back(0);
+            }
+        }
+
+        {
+            lock_guard<mutex> guard(alloc_lock);
+
+            for (size_t i = 0; i < bitmap_dirty.size(); i++)
+            {
+                if (!bitmap_dirty[i])
+                    continue;
+
+                copies.push_back(Block());
+                bitmap_block(free_bitmap, i, copies.back().Data);
+                homes.push_back(bitmap_start + i);
+                bitmap_dirty[i] = false;
+            }
+
+            for (size_t i = 0; i < inode_bitmap_dirty.size(); i++)
+            {
+                if (!inode_bitmap_dirty[i])
+                    continue;
+
+                copies.push_back(Block());
+                bitmap_block(inode_bitmap, i, copies.back().Data);
+                homes.push_back(inode_bitmap_start + i);
+                inode_bitmap_dirty[i] = false;
+            }
+        }
+
+        lock_guard<mutex> guard(journal_lock);
+        journal_committing.swap(journal_running);
+    }
+
+    // Only this commit changes journal_committing, so it can be walked
+    // without the lock
+    for (size_t i = 0; i < copies.size(); i++)
+        buffers.push_back(copies[i].Data);
+    for (unordered_map<int, Block>::iterator it = journal_committing.begin(); it != journal_committing.end(); it++)
+    {
+        homes.push_back(it->first);
+        buffers.push_back(it->second.Data);
+    }
+
+    // Data goes out before the metadata pointing at it, so recovered files
+    // never show what their blocks held before
+    cache.flush();
+
+    Block zeros;
+    memset(zeros.Data, 0, Disk::BLOCK_SIZE);
+    disk->write(gap, vector<char *>(gap.size(), zeros.Data));
+
+    if (homes.empty())
+    {
+        disk->sync();
+        return;
+    }
+
+    bool logged = homes.size() <= journal_capacity();
+    Block descriptor;
+    memset(descriptor.Data, 0, Disk::BLOCK_SIZE);
+
+    if (logged)
+    {
+        Block record;
+        memset(record.Data, 0, Disk::BLOCK_SIZE);
+
+        descriptor.Descriptor.Magic = JOURNAL_MAGIC;
+        descriptor.Descriptor.Count = homes.size();
+        descriptor.Descriptor.Sequence = journal_sequence++;
+        copy(homes.begin(), homes.end(), descriptor.Descriptor.Homes);
+
+        uint64_t hash = checksum(descriptor.Data, Disk::BLOCK_SIZE, 0);
+        for (size_t i = 0; i < buffers.size(); i++)
+            hash = checksum(buffers[i], Disk::BLOCK_SIZE, hash);
+
+        record.Commit.Magic = JOURNAL_COMMIT_MAGIC;
+        record.Commit.Count = descriptor.Descriptor.Count;
+        record.Commit.Sequence = descriptor.Descriptor.Sequence;
+        record.Commit.Checksum = hash;
+
+        // The whole transaction is one run of the journal, written at once
+        vector<int> log(1, journal_start);
+        vector<char *> log_buffers(1, descriptor.Data);
+        for (size_t i = 0; i < buffers.size(); i++)
+        {
+            log.push_back(journal_start + 1 + i);
+            log_buffers.push_back(buffers[i]);
+        }
+        log.push_back(journal_start + 1 + buffers.size());
+        log_buffers.push_back(record.Data);
+
+        disk->write(log, log_buffers);
+    }
+    else
+    {
+        // Too large to log: write it in place with the superblock saying
+        // dirty, so a crash part way rebuilds the bitmaps instead, and clear
+        // the journal, whose transaction would now undo part of this one
+        for (size_t i = 0; i < homes.size(); i++)
+        {
+            if (homes[i] == 0)
+                ((Block *)buffers[i])->Super.State = STATE_DIRTY;
+        }
+        write_state(STATE_DIRTY);
+        disk->write(journal_start, descriptor.Data);
+    }
+    disk->sync();
+
+    disk->write(homes, buffers);
+    disk->sync();
+
+    if (!logged)
+        write_state(STATE_JOURNALED);
+
+    // Cached copies are now stale, and once the blocks leave the committing
+    // transaction they are read from the cache again
+    cache.update(homes, buffers);
+    {
+        lock_guard<mutex> guard(journal_lock);
+        journal_committing.clear();
+    }
+    journal_idle.notify_all();
+}
+
+// Replay journal -----------------------------------------------------------
+void FileSystem::replay_journal()
+{
+    Block descriptor;
+    disk->read(journal_start, descriptor.Data);
+
+    journal_sequence = 1;
+    if (descriptor.Descriptor.Magic != JOURNAL_MAGIC)
+        return;
+
+    journal_sequence = descriptor.Descriptor.Sequence + 1;
+
+    // A clean unmount left the transaction home already
+    size_t count = descriptor.Descriptor.Count;
+    if (super.State == STATE_CLEAN || count == 0 || count > journal_capacity())
+        return;
+
+    // Read the logged blocks and commit block; the transaction only
+    // committed if the commit block matches all of it
+    vector<Block> logged(count + 1);
+    vector<int> log;
+    vector<char *> buffers;
+    for (size_t i = 0; i <= count; i++)
+    {
+        log.push_back(journal_start + 1 + i);
+        buffers.push_back(logged[i].Data);
+    }
+    disk->read(log, buffers);
+
+    uint64_t hash = checksum(descriptor.Data, Disk::BLOCK_SIZE, 0);
+    for (size_t i = 0; i < count; i++)
+        hash = checksum(logged[i].Data, Disk::BLOCK_SIZE, hash);
+
+    JournalCommit &record = logged[count].Commit;
+    if (record.Magic != JOURNAL_COMMIT_MAGIC || record.Count != count ||
+        record.Sequence != descriptor.Descriptor.Sequence || record.Checksum != hash)
+        return;
+
+    // Rewriting a transaction that already made it home changes nothing
+    vector<int> homes(descriptor.Descriptor.Homes, descriptor.Descriptor.Homes + count);
+    buffers.pop_back();
+    disk->write(homes, buffers);
+    disk->sync();
+}
+
+// Checksum -----------------------------------------------------------------
+uint64_t FileSystem::checksum(const char *data, size_t length, uint64_t hash)
+{
+    // 64-bit FNV-1a, continuing from hash (0 starts a new checksum)
+    if (hash == 0)
+        hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char)data[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
@@ -0,0 +1,186 @@
+// model.cpp: Mechanical disk timing model
+
+#include "sfs/model.h"
+
+#include <algorithm>
+
+#include <stdlib.h>
+#include <string.h>
+
+bool DiskModel::setup(const Geometry &geometry, size_t blocks) {
+    if (geometry.Zones.empty() || geometry.RPM == 0) {
+    	return false;
+    }
+    for (size_t z = 0; z < geometry.Zones.size(); z++) {
+    	if (geometry.Zones[z] == 0) {
+    	    return false;
+	}
+    }
+
+    // Fit the disk by adding tracks (keeping the zones in proportion) until
+    // it holds every block
+    size_t zoned = 0;
+    for (size_t z = 0; z < geometry.Zones.size(); z++) {
+    	zoned += geometry.Zones[z];
+    }
+
+    Layout = geometry;
+    size_t tracks = geometry.Tracks > 0 ? geometry.Tracks : std::max(geometry.Zones.size(), blocks * geometry.Zones.size() / zoned);
+    while (true) {
+    	TrackStart.assign(1, 0);
+    	for (size_t t = 0; t < tracks; t++) {
+    	    TrackStart.push_back(TrackStart.back() + Layout.Zones[t * Layout.Zones.size() / tracks]);
+	}
+	if (TrackStart.back() >= blocks) {
+	    break;
+	}
+	if (geometry.Tracks > 0) {
+	    return false;
+	}
+	tracks++;
+    }
+
+    Layout.Tracks = tracks;
+    Period = 60ULL * 1000 * 1000 * 1000 / Layout.RPM;
+    reset();
+    return true;
+}
+
+size_t DiskModel::track_of(size_t block) const {
+    return std::upper_bound(TrackStart.begin(), TrackStart.end(), block) - TrackStart.begin() - 1;
+}
+
+size_t DiskModel::slot_of(size_t block, size_t track) const {
+    return (block - TrackStart[track] + Layout.Skew * track) % (TrackStart[track + 1] - TrackStart[track]);
+}
+
+uint64_t DiskModel::serve(size_t block, size_t count, size_t block_size) {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    uint64_t start    = Clock;
+    uint64_t distance = 0;
+    uint64_t rotation = 0;
+    for (size_t b = block; b < block + count && b < TrackStart.back(); b++) {
+    	size_t track = track_of(b);
+    	if (track != Track) {
+    	    size_t crossed = track > Track ? track - Track : Track - track;
+    	    uint64_t seek  = Layout.Settle + crossed * Layout.SeekPerTrack;
+    	    Clock    += seek;
+    	    SeekTime += seek;
+    	    distance += crossed;
+    	    Track     = track;
+	}
+
+	// Wait for the block to come round; the next block of a track is
+	// already there
+	size_t	 per_track = TrackStart[track + 1] - TrackStart[track];
+	size_t	 slot	   = slot_of(b, track);
+	uint64_t angle	   = slot * Period / per_track;
+	uint64_t wait	   = (angle + Period - Clock % Period) % Period;
+	Clock	   += wait;
+	RotateTime += wait;
+	rotation   += wait;
+
+	uint64_t transfer = (slot + 1) * Period / per_track - angle;
+	Clock	     += transfer;
+	TransferTime += transfer;
+    }
+
+    Distance += distance;
+    Service.record(Clock - start, count * block_size);
+    Seeks.record(distance, 0);
+    Rotations.record(rotation, 0);
+    return Clock - start;
+}
+
+void DiskModel::reset() {
+    std::lock_guard<std::mutex> guard(Lock);
+    Track	 = 0;
+    Clock	 = 0;
+    SeekTime	 = 0;
+    RotateTime	 = 0;
+    TransferTime = 0;
+    Distance	 = 0;
+    Service.reset();
+    Seeks.reset();
+    Rotations.reset();
+}
+
+uint64_t DiskModel::elapsed() {
+    std::lock_guard<std::mutex> guard(Lock);
+    return Clock;
+}
+
+void DiskModel::print(FILE *stream) {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    uint64_t requests = Service.count();
+    double   total    = Clock > 0 ? Clock : 1;
+    fprintf(stream, "modeled disk: %lu tracks, %lu rpm, %lu blocks\n", Layout.Tracks, Layout.RPM, TrackStart.back());
+    fprintf(stream, "%lu requests in %.3f ms (seek %.1f%%, rotation %.1f%%, transfer %.1f%%)\n", requests, Clock / 1e6,
+    	100 * SeekTime / total, 100 * RotateTime / total, 100 * TransferTime / total);
+    if (requests == 0) {
+    	return;
+    }
+
+    fprintf(stream, "%-17s %10s %10s %10s %10s\n", "per request", "mean", "p50", "p99", "max");
+    fprintf(stream, "%-17s %10.3f %10.3f %10.3f %10.3f\n", "service ms", Clock / 1e6 / requests,
+    	Service.percentile(0.5) / 1e6, Service.percentile(0.99) / 1e6, Service.max() / 1e6);
+    fprintf(stream, "%-17s %10.1f %10lu %10lu %10lu\n", "seek tracks", (double)Distance / requests,
+    	Seeks.percentile(0.5), Seeks.percentile(0.99), Seeks.max());
+    fprintf(stream, "%-17s %10.3f %10.3f %10.3f %10.3f\n", "rotation ms", RotateTime / 1e6 / requests,
+    	Rotations.percentile(0.5) / 1e6, Rotations.percentile(0.99) / 1e6, Rotations.max() / 1e6);
+}
+
+bool DiskModel::parse(const char *spec, Geometry *geometry) {
+    *geometry = Geometry();
+    if (strcmp(spec, "hdd") == 0) {
+    	return true;
+    }
+
+    std::vector<char> copy(spec, spec + strlen(spec) + 1);
+    char *saved = NULL;
+    for (char *pair = strtok_r(copy.data(), ",", &saved); pair != NULL; pair = strtok_r(NULL, ",", &saved)) {
+    	char *value = strchr(pair, '=');
+    	if (value == NULL) {
+    	    return false;
+	}
+	*value++ = 0;
+
+	char *end = NULL;
+	if (strcmp(pair, "zones") == 0) {
+	    geometry->Zones.clear();
+	    while (true) {
+	    	geometry->Zones.push_back(strtoul(value, &end, 10));
+	    	if (end == value || (*end != ':' && *end != 0)) {
+	    	    return false;
+		}
+		if (*end == 0) {
+		    break;
+		}
+		value = end + 1;
+	    }
+	    continue;
+	}
+
+	unsigned long number = strtoul(value, &end, 10);
+	if (end == value || *end != 0) {
+	    return false;
+	}
+
+	if (strcmp(pair, "tracks") == 0) {
+	    geometry->Tracks = number;
+	} else if (strcmp(pair, "rpm") == 0) {
+	    geometry->RPM = number;
+	} else if (strcmp(pair, "settle") == 0) {
+	    geometry->Settle = number * 1000;
+	} else if (strcmp(pair, "seek") == 0) {
+	    geometry->SeekPerTrack = number;
+	} else if (strcmp(pair, "skew") == 0) {
+	    geometry->Skew = number;
+	} else {
+	    return false;
+	}
+    }
+    return true;
+}
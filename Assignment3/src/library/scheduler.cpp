@@ -0,0 +1,108 @@
+// scheduler.cpp: Disk request scheduling policies
+
+#include "sfs/scheduler.h"
+
+#include <string.h>
+
+void Scheduler::add(const Request &request) {
+    uint64_t sequence = Sequence++;
+    Arrivals[sequence] = request;
+    Positions.insert(Position(request.Block, sequence));
+}
+
+std::set<Scheduler::Position>::iterator Scheduler::above(int block) {
+    return Positions.lower_bound(Position(block, 0));
+}
+
+std::set<Scheduler::Position>::iterator Scheduler::below(int block) {
+    std::set<Position>::iterator it = Positions.lower_bound(Position(block, 0));
+    if (it == Positions.begin()) {
+    	return Positions.end();
+    }
+
+    // Requests for the same block go out in arrival order whichever way
+    // the head is moving
+    --it;
+    return Positions.lower_bound(Position(it->first, 0));
+}
+
+std::set<Scheduler::Position>::iterator Scheduler::pick(uint64_t now) {
+    std::set<Position>::iterator it;
+
+    switch (Selected) {
+    	case NONE:
+    	case FIFO:
+    	    return Positions.find(Position(Arrivals.begin()->second.Block, Arrivals.begin()->first));
+
+	case SSTF: {
+	    std::set<Position>::iterator up   = above(Head);
+	    std::set<Position>::iterator down = below(Head);
+	    if (up == Positions.end()) {
+	    	return down;
+	    }
+	    if (down == Positions.end() || up->first - Head <= Head - down->first) {
+	    	return up;
+	    }
+	    return down;
+	}
+
+	case SCAN:
+	    if (Ascending) {
+	    	it = above(Head);
+	    	if (it == Positions.end()) {
+	    	    Ascending = false;
+	    	    it = below(Head);
+		}
+	    } else {
+	    	it = below(Head + 1);
+	    	if (it == Positions.end()) {
+	    	    Ascending = true;
+	    	    it = above(Head);
+		}
+	    }
+	    return it;
+
+	case DEADLINE: {
+	    // Jump to the oldest request if it expired, and sweep on from there
+	    const Request &oldest = Arrivals.begin()->second;
+	    if (now >= oldest.Arrival && now - oldest.Arrival >= Deadlines[oldest.Write ? 1 : 0]) {
+	    	return Positions.find(Position(oldest.Block, Arrivals.begin()->first));
+	    }
+	}
+	// Fall through
+
+	case CSCAN:
+	    it = above(Head);
+	    return it == Positions.end() ? Positions.begin() : it;
+    }
+
+    return Positions.begin();
+}
+
+void Scheduler::next(size_t limit, uint64_t now, std::vector<Request> &batch) {
+    batch.clear();
+    while (batch.size() < limit && !Arrivals.empty()) {
+    	std::set<Position>::iterator it = pick(now);
+    	std::map<uint64_t, Request>::iterator request = Arrivals.find(it->second);
+
+	batch.push_back(request->second);
+	Head = it->first;
+	Arrivals.erase(request);
+	Positions.erase(it);
+    }
+}
+
+const char *Scheduler::name(Policy policy) {
+    static const char *Names[] = {"none", "fifo", "sstf", "scan", "cscan", "deadline"};
+    return Names[policy];
+}
+
+bool Scheduler::parse(const char *name, Policy *policy) {
+    for (int p = NONE; p <= DEADLINE; p++) {
+    	if (strcmp(name, Scheduler::name((Policy)p)) == 0) {
+    	    *policy = (Policy)p;
+    	    return true;
+	}
+    }
+    return false;
+}
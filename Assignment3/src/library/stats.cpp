@@ -0,0 +1,123 @@
+// stats.cpp: Operation counters and latency histograms
+
+#include "sfs/stats.h"
+
+size_t Histogram::bucket(uint64_t nanoseconds) {
+    if (nanoseconds < SUB_BUCKETS) {
+    	return nanoseconds;
+    }
+
+    // The top bit picks the power of two and the two below it the bucket
+    size_t top = 63 - __builtin_clzll(nanoseconds);
+    return (top - 1) * SUB_BUCKETS + ((nanoseconds >> (top - 2)) & (SUB_BUCKETS - 1));
+}
+
+uint64_t Histogram::bucket_limit(size_t bucket) {
+    if (bucket < SUB_BUCKETS) {
+    	return bucket;
+    }
+
+    size_t   top  = bucket / SUB_BUCKETS + 1;
+    uint64_t next = SUB_BUCKETS + bucket % SUB_BUCKETS + 1;
+    if (top - 2 >= 62) {
+    	return UINT64_MAX;
+    }
+    return (next << (top - 2)) - 1;
+}
+
+void Histogram::record(uint64_t nanoseconds, uint64_t bytes) {
+    Buckets[bucket(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+    Count.fetch_add(1, std::memory_order_relaxed);
+    Bytes.fetch_add(bytes, std::memory_order_relaxed);
+    Total.fetch_add(nanoseconds, std::memory_order_relaxed);
+
+    uint64_t max = Max.load(std::memory_order_relaxed);
+    while (nanoseconds > max && !Max.compare_exchange_weak(max, nanoseconds, std::memory_order_relaxed)) {
+    }
+}
+
+void Histogram::add(const Histogram &other) {
+    for (size_t i = 0; i < BUCKETS; i++) {
+    	Buckets[i].fetch_add(other.Buckets[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+    Count.fetch_add(other.count(), std::memory_order_relaxed);
+    Bytes.fetch_add(other.bytes(), std::memory_order_relaxed);
+    Total.fetch_add(other.total(), std::memory_order_relaxed);
+    if (other.max() > max()) {
+    	Max.store(other.max(), std::memory_order_relaxed);
+    }
+}
+
+void Histogram::reset() {
+    for (size_t i = 0; i < BUCKETS; i++) {
+    	Buckets[i].store(0, std::memory_order_relaxed);
+    }
+    Count.store(0, std::memory_order_relaxed);
+    Bytes.store(0, std::memory_order_relaxed);
+    Total.store(0, std::memory_order_relaxed);
+    Max.store(0, std::memory_order_relaxed);
+}
+
+uint64_t Histogram::percentile(double fraction) const {
+    // Operations recorded meanwhile may leave the buckets a little ahead
+    // of the count, which only moves the answer up a bucket
+    uint64_t wanted = (uint64_t)(fraction * count() + 0.999999);
+    if (wanted == 0) {
+    	return 0;
+    }
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; i++) {
+    	seen += Buckets[i].load(std::memory_order_relaxed);
+    	if (seen >= wanted) {
+    	    uint64_t limit = bucket_limit(i);
+    	    return limit < max() ? limit : max();
+	}
+    }
+    return max();
+}
+
+void Stats::reset() {
+    for (size_t i = 0; i < OPERATIONS; i++) {
+    	Histograms[i].reset();
+    }
+}
+
+const char *Stats::name(Operation operation) {
+    static const char *names[OPERATIONS] = {
+    	"create", "remove", "stat", "read", "write", "load_inode",
+    	"allocate_block", "disk_read", "disk_write", "disk_sync",
+    };
+    return names[operation];
+}
+
+void Stats::print(FILE *stream, const std::vector<const Stats *> &sources, bool json) {
+    if (json) {
+    	fprintf(stream, "{");
+    } else {
+    	fprintf(stream, "%-16s %10s %14s %10s %10s %10s %10s\n", "operation", "count", "bytes", "p50 us", "p99 us", "p999 us", "max us");
+    }
+
+    for (size_t i = 0; i < OPERATIONS; i++) {
+    	Histogram histogram;
+    	for (size_t s = 0; s < sources.size(); s++) {
+    	    histogram.add((*sources[s])[(Operation)i]);
+	}
+
+	if (json) {
+	    fprintf(stream, "%s\"%s\": {\"count\": %lu, \"bytes\": %lu, \"total_ns\": %lu, "
+	    	"\"p50_ns\": %lu, \"p99_ns\": %lu, \"p999_ns\": %lu, \"max_ns\": %lu}",
+	    	i > 0 ? ", " : "", name((Operation)i), histogram.count(), histogram.bytes(), histogram.total(),
+	    	histogram.percentile(0.5), histogram.percentile(0.99), histogram.percentile(0.999), histogram.max());
+	} else {
+	    fprintf(stream, "%-16s %10lu %14lu %10.1f %10.1f %10.1f %10.1f\n",
+	    	name((Operation)i), histogram.count(), histogram.bytes(),
+	    	histogram.percentile(0.5) / 1000.0, histogram.percentile(0.99) / 1000.0,
+	    	histogram.percentile(0.999) / 1000.0, histogram.max() / 1000.0);
+	}
+    }
+
+    if (json) {
+    	fprintf(stream, "}\n");
+    }
+}
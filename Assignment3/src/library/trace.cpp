@@ -0,0 +1,117 @@
+// trace.cpp: Timeline of file system and disk operations
+
+#include "sfs/trace.h"
+
+#include <chrono>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+std::atomic<bool>	    Trace::Enabled(false);
+std::atomic<uint64_t>	    Trace::Origin(0);
+std::mutex		    Trace::RingsLock;
+std::vector<Trace::Ring *>  Trace::Rings;
+thread_local Trace::Ring *  Trace::LocalRing = NULL;
+
+uint64_t Trace::now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Trace::record(const char *category, const char *name, uint64_t start, uint64_t duration,
+    int64_t inode, int64_t block, int64_t count) {
+    if (LocalRing == NULL) {
+    	Ring *ring = new Ring();
+    	std::lock_guard<std::mutex> guard(RingsLock);
+    	ring->Thread = Rings.size() + 1;
+    	Rings.push_back(ring);
+    	LocalRing = ring;
+    }
+
+    Ring    *ring  = LocalRing;
+    uint64_t head  = ring->Head.load(std::memory_order_relaxed);
+    Event   &event = ring->Events[head % RING_EVENTS];
+    event.Category.store(category, std::memory_order_relaxed);
+    event.Name.store(name, std::memory_order_relaxed);
+    event.Start.store(start, std::memory_order_relaxed);
+    event.Duration.store(duration, std::memory_order_relaxed);
+    event.Inode.store(inode, std::memory_order_relaxed);
+    event.Block.store(block, std::memory_order_relaxed);
+    event.Count.store(count, std::memory_order_relaxed);
+    ring->Head.store(head + 1, std::memory_order_release);
+}
+
+void Trace::start() {
+    std::lock_guard<std::mutex> guard(RingsLock);
+    for (size_t r = 0; r < Rings.size(); r++) {
+    	Rings[r]->Base.store(Rings[r]->Head.load(std::memory_order_acquire), std::memory_order_relaxed);
+    }
+    Origin.store(now(), std::memory_order_relaxed);
+    Enabled.store(true, std::memory_order_release);
+}
+
+ssize_t Trace::stop(const char *path) {
+    Enabled.store(false, std::memory_order_release);
+
+    FILE *stream = fopen(path, "w");
+    if (stream == NULL) {
+    	fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+    	return -1;
+    }
+
+    uint64_t origin  = Origin.load(std::memory_order_relaxed);
+    ssize_t  written = 0;
+    fprintf(stream, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+
+    std::lock_guard<std::mutex> guard(RingsLock);
+    for (size_t r = 0; r < Rings.size(); r++) {
+    	Ring	*ring  = Rings[r];
+    	uint64_t head  = ring->Head.load(std::memory_order_acquire);
+    	uint64_t first = ring->Base.load(std::memory_order_relaxed);
+    	if (head - first > RING_EVENTS) {
+    	    first = head - RING_EVENTS;
+	}
+
+	for (uint64_t i = first; i < head; i++) {
+	    Event     &event = ring->Events[i % RING_EVENTS];
+	    const char *category = event.Category.load(std::memory_order_relaxed);
+	    const char *name	 = event.Name.load(std::memory_order_relaxed);
+	    uint64_t	start	 = event.Start.load(std::memory_order_relaxed);
+	    uint64_t	duration = event.Duration.load(std::memory_order_relaxed);
+	    int64_t	inode	 = event.Inode.load(std::memory_order_relaxed);
+	    int64_t	block	 = event.Block.load(std::memory_order_relaxed);
+	    int64_t	count	 = event.Count.load(std::memory_order_relaxed);
+
+	    // A span still finishing when tracing stopped may have lapped the
+	    // ring since head was read, leaving this event torn
+	    if (ring->Head.load(std::memory_order_acquire) - i >= RING_EVENTS || start < origin) {
+	    	continue;
+	    }
+
+	    fprintf(stream, "%s{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %lu, "
+	    	"\"ts\": %.3f, \"dur\": %.3f, \"args\": {",
+	    	written > 0 ? ",\n" : "", name, category, ring->Thread, (start - origin) / 1000.0, duration / 1000.0);
+
+	    const char *separator = "";
+	    if (inode >= 0) {
+	    	fprintf(stream, "\"inode\": %ld", inode);
+	    	separator = ", ";
+	    }
+	    if (block >= 0) {
+	    	fprintf(stream, "%s\"block\": %ld", separator, block);
+	    	separator = ", ";
+	    }
+	    if (count >= 0) {
+	    	fprintf(stream, "%s\"count\": %ld", separator, count);
+	    }
+	    fprintf(stream, "}}");
+	    written++;
+	}
+    }
+
+    fprintf(stream, "\n]}\n");
+    if (fclose(stream) != 0) {
+    	return -1;
+    }
+    return written;
+}
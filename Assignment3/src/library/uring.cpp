@@ -0,0 +1,170 @@
+// uring.cpp: Minimal io_uring submission and completion rings
+
+#include "sfs/uring.h"
+
+#include <linux/io_uring.h>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+bool Uring::setup(unsigned entries) {
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+    teardown();
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    RingDescriptor = syscall(__NR_io_uring_setup, entries, &params);
+    if (RingDescriptor < 0) {
+    	RingDescriptor = -1;
+    	return false;
+    }
+
+    SqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    CqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    	SqSize = CqSize = SqSize > CqSize ? SqSize : CqSize;
+    }
+
+    SqRing = mmap(NULL, SqSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, RingDescriptor, IORING_OFF_SQ_RING);
+    if (SqRing == MAP_FAILED) {
+    	SqRing = NULL;
+    	teardown();
+    	return false;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    	CqRing = SqRing;
+    } else {
+	CqRing = mmap(NULL, CqSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, RingDescriptor, IORING_OFF_CQ_RING);
+	if (CqRing == MAP_FAILED) {
+	    CqRing = NULL;
+	    teardown();
+	    return false;
+	}
+    }
+
+    SqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    void *sqes = mmap(NULL, SqesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, RingDescriptor, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+    	teardown();
+    	return false;
+    }
+    Sqes = (io_uring_sqe *)sqes;
+
+    char *sq = (char *)SqRing;
+    char *cq = (char *)CqRing;
+    SqHead  = (unsigned *)(sq + params.sq_off.head);
+    SqTail  = (unsigned *)(sq + params.sq_off.tail);
+    SqMask  = (unsigned *)(sq + params.sq_off.ring_mask);
+    SqArray = (unsigned *)(sq + params.sq_off.array);
+    CqHead  = (unsigned *)(cq + params.cq_off.head);
+    CqTail  = (unsigned *)(cq + params.cq_off.tail);
+    CqMask  = (unsigned *)(cq + params.cq_off.ring_mask);
+    Cqes    = (io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    Entries = params.sq_entries;
+    Pending = 0;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void Uring::teardown() {
+    if (Sqes != NULL) {
+    	munmap(Sqes, SqesSize);
+    	Sqes = NULL;
+    }
+    if (CqRing != NULL && CqRing != SqRing) {
+    	munmap(CqRing, CqSize);
+    }
+    CqRing = NULL;
+    if (SqRing != NULL) {
+    	munmap(SqRing, SqSize);
+    	SqRing = NULL;
+    }
+    if (RingDescriptor >= 0) {
+    	close(RingDescriptor);
+    	RingDescriptor = -1;
+    }
+    Entries = 0;
+    Pending = 0;
+}
+
+bool Uring::prepare(bool write, int fd, const struct iovec *iov, unsigned count, off_t offset, uint64_t user_data) {
+    unsigned head = __atomic_load_n(SqHead, __ATOMIC_ACQUIRE);
+    unsigned tail = *SqTail;
+
+    if (tail - head >= Entries) {
+    	return false;
+    }
+
+    unsigned	  index = tail & *SqMask;
+    io_uring_sqe *sqe	= &Sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode	   = write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd	   = fd;
+    sqe->addr	   = (uint64_t)(uintptr_t)iov;
+    sqe->len	   = count;
+    sqe->off	   = offset;
+    sqe->user_data = user_data;
+
+    SqArray[index] = index;
+    __atomic_store_n(SqTail, tail + 1, __ATOMIC_RELEASE);
+    Pending++;
+    return true;
+}
+
+int Uring::submit() {
+    int result;
+
+    do {
+    	result = syscall(__NR_io_uring_enter, RingDescriptor, Pending, 0, 0, NULL, 0);
+    } while (result < 0 && errno == EINTR);
+
+    if (result < 0) {
+    	return -errno;
+    }
+
+    Pending -= result < (int)Pending ? result : Pending;
+    return result;
+}
+
+unsigned Uring::discard() {
+    unsigned dropped = Pending;
+
+    __atomic_store_n(SqTail, *SqTail - dropped, __ATOMIC_RELEASE);
+    Pending = 0;
+    return dropped;
+}
+
+int Uring::wait() {
+    int result;
+
+    do {
+    	result = syscall(__NR_io_uring_enter, RingDescriptor, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    } while (result < 0 && errno == EINTR);
+
+    return result < 0 ? -errno : 0;
+}
+
+bool Uring::reap(uint64_t *user_data, int *result) {
+    unsigned head = *CqHead;
+    unsigned tail = __atomic_load_n(CqTail, __ATOMIC_ACQUIRE);
+
+    if (head == tail) {
+    	return false;
+    }
+
+    io_uring_cqe *cqe = &Cqes[head & *CqMask];
+    *user_data = cqe->user_data;
+    *result    = cqe->res;
+
+    __atomic_store_n(CqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
@@ -0,0 +1,119 @@
+// workload.cpp: Recorded sequences of file system calls
+
+#include "sfs/workload.h"
+
+#include <chrono>
+
+#include <errno.h>
+#include <string.h>
+
+std::atomic<bool>	Workload::Recording(false);
+std::mutex		Workload::Lock;
+FILE *			Workload::Stream = NULL;
+size_t			Workload::Records = 0;
+uint64_t		Workload::Origin = 0;
+std::atomic<uint32_t>	Workload::Threads(0);
+thread_local uint32_t	Workload::Thread = 0;
+
+uint64_t Workload::now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool Workload::start(const char *path) {
+    std::lock_guard<std::mutex> guard(Lock);
+    if (Stream != NULL) {
+    	fprintf(stderr, "Already recording\n");
+    	return false;
+    }
+
+    FILE *stream = fopen(path, "w");
+    if (stream == NULL) {
+    	fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+    	return false;
+    }
+
+    Header header = {MAGIC_NUMBER, VERSION};
+    if (fwrite(&header, sizeof(header), 1, stream) != 1) {
+    	fclose(stream);
+    	return false;
+    }
+
+    Stream  = stream;
+    Records = 0;
+    Origin  = now();
+    Recording.store(true, std::memory_order_release);
+    return true;
+}
+
+ssize_t Workload::stop() {
+    Recording.store(false, std::memory_order_release);
+
+    std::lock_guard<std::mutex> guard(Lock);
+    if (Stream == NULL) {
+    	return -1;
+    }
+
+    int result = fclose(Stream);
+    Stream = NULL;
+    return result == 0 ? (ssize_t)Records : -1;
+}
+
+void Workload::append(Operation operation, size_t inode, size_t length, size_t offset) {
+    if (Thread == 0) {
+    	Thread = Threads.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+
+    // Timestamps are taken under the lock, so they never go backwards
+    // through the trace
+    std::lock_guard<std::mutex> guard(Lock);
+    if (Stream == NULL) {
+    	return;
+    }
+
+    Record record = {now() - Origin, offset, (uint32_t)length, (uint32_t)inode, Thread, (uint32_t)operation};
+    if (fwrite(&record, sizeof(record), 1, Stream) == 1) {
+    	Records++;
+    }
+}
+
+bool Workload::load(const char *path, std::vector<Record> &records) {
+    FILE *stream = fopen(path, "r");
+    if (stream == NULL) {
+    	fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+    	return false;
+    }
+
+    Header header;
+    if (fread(&header, sizeof(header), 1, stream) != 1 || header.MagicNumber != MAGIC_NUMBER || header.Version != VERSION) {
+    	fprintf(stderr, "%s is not a workload trace\n", path);
+    	fclose(stream);
+    	return false;
+    }
+
+    Record record;
+    records.clear();
+    while (fread(&record, sizeof(record), 1, stream) == 1) {
+    	if (record.Operation >= OPERATIONS) {
+    	    fprintf(stderr, "%s has an unknown operation at record %lu\n", path, records.size());
+    	    fclose(stream);
+    	    return false;
+	}
+	records.push_back(record);
+    }
+
+    bool ok = !ferror(stream);
+    fclose(stream);
+    return ok;
+}
+
+const char *Workload::name(Operation operation) {
+    static const char *Names[OPERATIONS] = {
+    	"create",
+    	"remove",
+    	"stat",
+    	"read",
+    	"write",
+    	"sync",
+    };
+    return Names[operation];
+}
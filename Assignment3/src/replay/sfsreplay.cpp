@@ -0,0 +1,306 @@
+// sfsreplay.cpp: Replay a recorded workload against a fresh image
+
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+#include "sfs/stats.h"
+#include "sfs/workload.h"
+
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef std::chrono::steady_clock Clock;
+
+// Settings of a replay
+struct Options {
+    size_t	Threads;	// Replay threads
+    bool	Paced;		// Whether to keep the recorded pacing (true) or go as fast as possible (false)
+};
+
+// Latency and bytes of every operation replayed, and how many failed
+struct Totals {
+    Histogram		Latency[Workload::OPERATIONS];
+    std::atomic<size_t> Failures;
+
+    Totals() : Failures(0) {}
+};
+
+// Replay records in order on the calling thread.  Inodes are remapped
+// through inodes (recorded to replayed), whose entries for the inodes in
+// records only this thread touches.
+void replay(FileSystem &fs, const std::vector<Workload::Record> &records, std::vector<ssize_t> &inodes,
+    const Options &options, Clock::time_point start, Totals &totals) {
+    size_t length = 0;
+    for (size_t r = 0; r < records.size(); r++) {
+    	length = std::max(length, (size_t)records[r].Length);
+    }
+    std::vector<char> buffer(std::max(length, (size_t)1), 'w');
+
+    for (size_t r = 0; r < records.size(); r++) {
+    	const Workload::Record &record = records[r];
+    	if (options.Paced) {
+    	    std::this_thread::sleep_until(start + std::chrono::nanoseconds(record.Time));
+	}
+
+	ssize_t inumber = record.Inode < inodes.size() ? inodes[record.Inode] : -1;
+	bool	ok	= inumber >= 0 || record.Operation == Workload::CREATE || record.Operation == Workload::SYNC;
+	size_t	bytes	= 0;
+
+	Clock::time_point began = Clock::now();
+	if (ok) {
+	    switch (record.Operation) {
+	    	case Workload::CREATE:
+	    	    inumber = fs.create();
+	    	    ok	    = inumber >= 0;
+	    	    if (record.Inode < inodes.size()) {
+	    	    	inodes[record.Inode] = inumber;
+		    }
+		    break;
+		case Workload::REMOVE:
+		    ok = fs.remove(inumber);
+		    break;
+		case Workload::STAT:
+		    ok = fs.stat(inumber) >= 0;
+		    break;
+		case Workload::READ: {
+		    ssize_t result = fs.read(inumber, buffer.data(), record.Length, record.Offset);
+		    ok	  = result >= 0;
+		    bytes = ok ? result : 0;
+		    break;
+		}
+		case Workload::WRITE: {
+		    ssize_t result = fs.write(inumber, buffer.data(), record.Length, record.Offset);
+		    ok	  = result == (ssize_t)record.Length;
+		    bytes = result > 0 ? result : 0;
+		    break;
+		}
+		case Workload::SYNC:
+		    fs.sync();
+		    break;
+	    }
+	}
+	totals.Latency[record.Operation].record(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - began).count(), bytes);
+
+	if (!ok) {
+	    totals.Failures.fetch_add(1, std::memory_order_relaxed);
+	}
+    }
+}
+
+// Create the inodes the workload uses without creating them first (they
+// existed before recording started).  Their sizes were not recorded, so
+// each is made just large enough for its reads to start inside it.
+bool prepare(FileSystem &fs, const std::vector<Workload::Record> &records, std::vector<ssize_t> &inodes) {
+    std::vector<bool>	known(inodes.size(), false);
+    std::vector<size_t> sizes(inodes.size(), 0);
+    std::vector<bool>	existing(inodes.size(), false);
+
+    for (size_t r = 0; r < records.size(); r++) {
+    	const Workload::Record &record = records[r];
+    	if (record.Inode >= inodes.size()) {
+    	    continue;
+	}
+
+	if (record.Operation == Workload::CREATE) {
+	    known[record.Inode] = true;
+	} else if (!known[record.Inode]) {
+	    known[record.Inode]    = true;
+	    existing[record.Inode] = true;
+	}
+
+	if (existing[record.Inode] && record.Operation == Workload::READ) {
+	    size_t reach = record.Offset + std::min((size_t)record.Length, (size_t)Disk::BLOCK_SIZE);
+	    sizes[record.Inode] = std::max(sizes[record.Inode], reach);
+	}
+    }
+
+    std::vector<char> buffer(1024*1024, 'p');
+    for (size_t i = 0; i < inodes.size(); i++) {
+    	if (!existing[i]) {
+    	    continue;
+	}
+
+	inodes[i] = fs.create();
+	if (inodes[i] < 0) {
+	    fprintf(stderr, "Unable to create inode for recorded inode %lu\n", i);
+	    return false;
+	}
+
+	for (size_t offset = 0; offset < sizes[i]; offset += buffer.size()) {
+	    size_t length = std::min(buffer.size(), sizes[i] - offset);
+	    if (fs.write(inodes[i], buffer.data(), length, offset) != (ssize_t)length) {
+	    	fprintf(stderr, "Unable to fill inode for recorded inode %lu\n", i);
+	    	return false;
+	    }
+	}
+    }
+    return true;
+}
+
+// Main execution --------------------------------------------------------------
+
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [options] <trace> <diskfile> <nblocks>\n", program);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -b <backend>    Disk I/O backend: sync, uring or mmap (default: sync)\n");
+    fprintf(stderr, "    -c <blocks>     Number of blocks in block cache (default: %lu, 0 disables)\n", BlockCache::DEFAULT_CAPACITY);
+    fprintf(stderr, "    -m <geometry>   Model mechanical disk timing: hdd or key=value,... of tracks, rpm,\n");
+    fprintf(stderr, "                    settle (us), seek (ns per track), skew and zones (blocks per track, a:b:c)\n");
+    fprintf(stderr, "    -p              Keep the recorded pacing (default: as fast as possible)\n");
+    fprintf(stderr, "    -s <mode>       Durability: none, flush, always or a sync interval in ms (default: flush)\n");
+    fprintf(stderr, "    -S <policy>     Disk request scheduler: none, fifo, sstf, scan, cscan or deadline (default: none)\n");
+    fprintf(stderr, "    -t <threads>    Replay threads, each taking the calls of some inodes (default: 1)\n");
+}
+
+int main(int argc, char *argv[]) {
+    Options	     options	    = {1, false};
+    size_t	     cache_capacity = BlockCache::DEFAULT_CAPACITY;
+    Disk::Backend    backend	    = Disk::SYNC;
+    Disk::Durability durability	    = Disk::SYNC_ON_FLUSH;
+    size_t	     sync_interval  = Disk::DEFAULT_SYNC_INTERVAL;
+    Scheduler::Policy scheduler     = Scheduler::NONE;
+    DiskModel::Geometry geometry;
+    bool	     modeled	    = false;
+    int		     option;
+
+    while ((option = getopt(argc, argv, "b:c:m:ps:S:t:h")) != -1) {
+    	switch (option) {
+    	    case 'b':
+    	    	if (!Disk::parse(optarg, &backend)) {
+    	    	    usage(argv[0]);
+    	    	    return EXIT_FAILURE;
+		}
+    	    	break;
+    	    case 'c':
+    	    	cache_capacity = strtoul(optarg, NULL, 10);
+    	    	break;
+    	    case 'm':
+    	    	if (!DiskModel::parse(optarg, &geometry)) {
+    	    	    usage(argv[0]);
+    	    	    return EXIT_FAILURE;
+		}
+		modeled = true;
+    	    	break;
+    	    case 'p':
+    	    	options.Paced = true;
+    	    	break;
+    	    case 's':
+    	    	if (!Disk::parse(optarg, &durability, &sync_interval)) {
+    	    	    usage(argv[0]);
+    	    	    return EXIT_FAILURE;
+		}
+    	    	break;
+    	    case 'S':
+    	    	if (!Scheduler::parse(optarg, &scheduler)) {
+    	    	    usage(argv[0]);
+    	    	    return EXIT_FAILURE;
+		}
+    	    	break;
+    	    case 't':
+    	    	options.Threads = strtoul(optarg, NULL, 10);
+    	    	break;
+    	    default:
+    	    	usage(argv[0]);
+    	    	return EXIT_FAILURE;
+	}
+    }
+
+    if (argc - optind != 3 || options.Threads == 0) {
+    	usage(argv[0]);
+    	return EXIT_FAILURE;
+    }
+
+    std::vector<Workload::Record> records;
+    if (!Workload::load(argv[optind], records)) {
+    	return EXIT_FAILURE;
+    }
+
+    Disk       disk;
+    FileSystem fs(cache_capacity);
+    try {
+    	disk.open(argv[optind + 1], strtoul(argv[optind + 2], NULL, 10));
+    } catch (std::runtime_error &e) {
+    	fprintf(stderr, "Unable to open disk %s: %s\n", argv[optind + 1], e.what());
+    	return EXIT_FAILURE;
+    }
+
+    if (!disk.set_backend(backend)) {
+    	fprintf(stderr, "%s is unavailable, using synchronous I/O\n", backend == Disk::MMAP ? "mmap" : "io_uring");
+    }
+    disk.set_scheduler(scheduler);
+    if (modeled && !disk.set_model(geometry)) {
+    	fprintf(stderr, "Disk model cannot hold %s\n", argv[optind + 1]);
+    	return EXIT_FAILURE;
+    }
+    disk.set_durability(durability, sync_interval);
+
+    if (!fs.format(&disk) || !fs.mount(&disk)) {
+    	fprintf(stderr, "Unable to format and mount %s\n", argv[optind + 1]);
+    	return EXIT_FAILURE;
+    }
+
+    // Calls on one recorded inode all go to the same thread, in recorded
+    // order, so a file is created before it is used and removed after
+    size_t inodes_used = 0;
+    for (size_t r = 0; r < records.size(); r++) {
+    	if (records[r].Inode != Workload::NO_INODE) {
+    	    inodes_used = std::max(inodes_used, (size_t)records[r].Inode + 1);
+	}
+    }
+
+    std::vector<ssize_t> inodes(inodes_used, -1);
+    if (!prepare(fs, records, inodes)) {
+    	fs.unmount();
+    	return EXIT_FAILURE;
+    }
+
+    std::vector<std::vector<Workload::Record> > partitions(options.Threads);
+    for (size_t r = 0; r < records.size(); r++) {
+    	size_t thread = records[r].Inode == Workload::NO_INODE ? 0 : records[r].Inode % options.Threads;
+    	partitions[thread].push_back(records[r]);
+    }
+
+    // Model only the replay itself and the writeback at unmount
+    if (disk.model() != NULL) {
+    	disk.model()->reset();
+    }
+
+    Totals		     totals;
+    std::vector<std::thread> threads;
+    Clock::time_point	     start = Clock::now();
+    for (size_t t = 1; t < options.Threads; t++) {
+    	threads.push_back(std::thread(replay, std::ref(fs), std::cref(partitions[t]), std::ref(inodes),
+    	    std::cref(options), start, std::ref(totals)));
+    }
+    replay(fs, partitions[0], inodes, options, start, totals);
+    for (size_t t = 0; t < threads.size(); t++) {
+    	threads[t].join();
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    fs.unmount();
+
+    Histogram total;
+    printf("%-10s %10s %12s %10s %10s %10s %10s\n", "operation", "count", "ops/s", "MB/s", "p50 us", "p99 us", "p999 us");
+    for (size_t o = 0; o < Workload::OPERATIONS; o++) {
+    	const Histogram &latency = totals.Latency[o];
+    	printf("%-10s %10lu %12.0f %10.1f %10.1f %10.1f %10.1f\n", Workload::name((Workload::Operation)o), latency.count(),
+    	    latency.count() / seconds, latency.bytes() / seconds / (1024*1024),
+    	    latency.percentile(0.5) / 1000.0, latency.percentile(0.99) / 1000.0, latency.percentile(0.999) / 1000.0);
+	total.add(latency);
+    }
+    printf("%-10s %10lu %12.0f %10.1f %10.1f %10.1f %10.1f\n", "total", total.count(),
+    	total.count() / seconds, total.bytes() / seconds / (1024*1024),
+    	total.percentile(0.5) / 1000.0, total.percentile(0.99) / 1000.0, total.percentile(0.999) / 1000.0);
+    printf("%lu calls replayed on %lu threads, %lu failed\n", records.size(), options.Threads, totals.Failures.load());
+    if (disk.model() != NULL) {
+    	disk.model()->print(stdout);
+    }
+    return EXIT_SUCCESS;
+}
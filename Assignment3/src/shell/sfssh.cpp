@@ -1,51 +1,188 @@
 // sfssh.cpp: Simple file system shell
 
+#include "sfs/directory.h"
 #include "sfs/disk.h"
 #include "sfs/fs.h"
 
+#include <algorithm>
 #include <sstream>
 #include <string>
 #include <stdexcept>
+#include <vector>
 
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 // Macros
 
 #define streq(a, b) (strcmp((a), (b)) == 0)
 
+// Bytes moved per fs.write call by copyin, large enough for the file system
+// to batch each call into a few vectored disk requests
+#define COPY_BUFFER_SIZE (256*Disk::BLOCK_SIZE)
+
+// Bytes viewed per fs.pin call by copyout, well below what the default cache
+// will pin so one view never crowds everything else out of the cache
+#define VIEW_SIZE (32*Disk::BLOCK_SIZE)
+
+// Path prototypes
+
+ssize_t root_directory(FileSystem &fs, bool create);
+ssize_t resolve(FileSystem &fs, const char *path);
+bool resolve_parent(FileSystem &fs, const char *path, Directory &parent, std::string &name, bool create);
+
 // Command prototypes
 
 void do_debug(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_format(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_mount(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_unmount(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_cat(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_copyout(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_create(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_remove(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_stat(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_copyin(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_df(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_sync(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_stats(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_trace(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_model(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_record(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_mkdir(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_ls(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_link(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_unlink(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_help(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 
 bool copyout(FileSystem &fs, size_t inumber, const char *path);
 bool copyin(FileSystem &fs, const char *path, size_t inumber);
+bool write_all(int fd, std::vector<struct iovec> &iov);
 
 // Main execution
 
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [options] <diskfile> <nblocks>\n", program);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -a <access>     Disk access hint: normal, sequential or random (default: normal)\n");
+    fprintf(stderr, "    -b <backend>    Disk I/O backend: sync, uring or mmap (default: sync)\n");
+    fprintf(stderr, "    -c <blocks>     Number of blocks in block cache (default: %lu, 0 disables)\n", BlockCache::DEFAULT_CAPACITY);
+    fprintf(stderr, "    -m <geometry>   Model mechanical disk timing: hdd or key=value,... of tracks, rpm,\n");
+    fprintf(stderr, "                    settle (us), seek (ns per track), skew and zones (blocks per track, a:b:c)\n");
+    fprintf(stderr, "    -p <policy>     Block cache replacement policy: lru or clock (default: lru)\n");
+    fprintf(stderr, "    -q <depth>      Disk requests kept in flight (default: %lu)\n", Disk::DEFAULT_QUEUE_DEPTH);
+    fprintf(stderr, "    -r <blocks>     Largest readahead window (default: %lu, 0 disables)\n", FileSystem::DEFAULT_READAHEAD);
+    fprintf(stderr, "    -s <mode>       Durability: none, flush, always or a sync interval in ms (default: flush)\n");
+    fprintf(stderr, "    -S <policy>     Disk request scheduler: none, fifo, sstf, scan, cscan or deadline (default: none)\n");
+}
+
 int main(int argc, char *argv[]) {
-    Disk	disk;
-    FileSystem	fs;
+    size_t		cache_capacity = BlockCache::DEFAULT_CAPACITY;
+    BlockCache::Policy	cache_policy   = BlockCache::LRU;
+    Disk::Backend	backend	       = Disk::SYNC;
+    size_t		queue_depth    = Disk::DEFAULT_QUEUE_DEPTH;
+    Disk::Access	access	       = Disk::NORMAL;
+    size_t		readahead      = FileSystem::DEFAULT_READAHEAD;
+    Disk::Durability	durability     = Disk::SYNC_ON_FLUSH;
+    size_t		sync_interval  = Disk::DEFAULT_SYNC_INTERVAL;
+    Scheduler::Policy	scheduler      = Scheduler::NONE;
+    DiskModel::Geometry	geometry;
+    bool		modeled	       = false;
+    int			option;
+
+    while ((option = getopt(argc, argv, "a:b:c:m:p:q:r:s:S:h")) != -1) {
+    	switch (option) {
+    	    case 'a':
+    	    	if (streq(optarg, "normal")) {
+    	    	    access = Disk::NORMAL;
+		} else if (streq(optarg, "sequential")) {
+		    access = Disk::SEQUENTIAL;
+		} else if (streq(optarg, "random")) {
+		    access = Disk::RANDOM;
+		} else {
+		    usage(argv[0]);
+		    return EXIT_FAILURE;
+		}
+    	    	break;
+    	    case 'b':
+    	    	if (!Disk::parse(optarg, &backend)) {
+    	    	    usage(argv[0]);
+    	    	    return EXIT_FAILURE;
+		}
+    	    	break;
+    	    case 'c':
+    	    	cache_capacity = strtoul(optarg, NULL, 10);
+    	    	break;
+    	    case 'm':
+    	    	if (!DiskModel::parse(optarg, &geometry)) {
+    	    	    usage(argv[0]);
+    	    	    return EXIT_FAILURE;
+		}
+		modeled = true;
+    	    	break;
+    	    case 'p':
+    	    	if (streq(optarg, "lru")) {
+    	    	    cache_policy = BlockCache::LRU;
+		} else if (streq(optarg, "clock")) {
+		    cache_policy = BlockCache::CLOCK;
+		} else {
+		    usage(argv[0]);
+		    return EXIT_FAILURE;
+		}
+    	    	break;
+    	    case 'q':
+    	    	queue_depth = strtoul(optarg, NULL, 10);
+    	    	break;
+    	    case 'r':
+    	    	readahead = strtoul(optarg, NULL, 10);
+    	    	break;
+    	    case 's':
+    	    	if (!Disk::parse(optarg, &durability, &sync_interval)) {
+    	    	    usage(argv[0]);
+    	    	    return EXIT_FAILURE;
+		}
+    	    	break;
+    	    case 'S':
+    	    	if (!Scheduler::parse(optarg, &scheduler)) {
+    	    	    usage(argv[0]);
+    	    	    return EXIT_FAILURE;
+		}
+    	    	break;
+    	    default:
+    	    	usage(argv[0]);
+    	    	return EXIT_FAILURE;
+	}
+    }
 
-    if (argc != 3) {
-    	fprintf(stderr, "Usage: %s <diskfile> <nblocks>\n", argv[0]);
+    if (argc - optind != 2) {
+    	usage(argv[0]);
     	return EXIT_FAILURE;
     }
 
+    Disk	disk;
+    FileSystem	fs(cache_capacity, cache_policy);
+    fs.set_readahead(readahead);
+
     try {
-    	disk.open(argv[1], atoi(argv[2]));
+    	disk.open(argv[optind], atoi(argv[optind + 1]));
     } catch (std::runtime_error &e) {
-    	fprintf(stderr, "Unable to open disk %s: %s\n", argv[1], e.what());
+    	fprintf(stderr, "Unable to open disk %s: %s\n", argv[optind], e.what());
+    	return EXIT_FAILURE;
+    }
+
+    if (!disk.set_backend(backend, queue_depth)) {
+    	fprintf(stderr, "%s is unavailable, using synchronous I/O\n", backend == Disk::MMAP ? "mmap" : "io_uring");
+    }
+    disk.advise(access);
+    disk.set_durability(durability, sync_interval);
+    disk.set_scheduler(scheduler);
+    if (modeled && !disk.set_model(geometry)) {
+    	fprintf(stderr, "Disk model cannot hold %s\n", argv[optind]);
     	return EXIT_FAILURE;
     }
 
@@ -70,6 +207,8 @@ int main(int argc, char *argv[]) {
 	    do_format(disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "mount")) {
 	    do_mount(disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "unmount")) {
+	    do_unmount(disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "cat")) {
 	    do_cat(disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "copyout")) {
@@ -82,6 +221,26 @@ int main(int argc, char *argv[]) {
 	    do_stat(disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "copyin")) {
 	    do_copyin(disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "df")) {
+	    do_df(disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "sync")) {
+	    do_sync(disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "stats")) {
+	    do_stats(disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "trace")) {
+	    do_trace(disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "model")) {
+	    do_model(disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "record")) {
+	    do_record(disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "mkdir")) {
+	    do_mkdir(disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "ls")) {
+	    do_ls(disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "link")) {
+	    do_link(disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "unlink")) {
+	    do_unlink(disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "help")) {
 	    do_help(disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "exit") || streq(cmd, "quit")) {
@@ -92,6 +251,10 @@ int main(int argc, char *argv[]) {
 	}
     }
 
+    // Keep whatever was recorded before the input ran out
+    if (Workload::recording()) {
+    	Workload::stop();
+    }
     return EXIT_SUCCESS;
 }
 
@@ -132,24 +295,40 @@ void do_mount(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     }
 }
 
+void do_unmount(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 1) {
+    	printf("Usage: unmount\n");
+    	return;
+    }
+
+    if (disk.mounted()) {
+    	fs.unmount();
+    	printf("disk unmounted.\n");
+    } else {
+    	printf("unmount failed!\n");
+    }
+}
+
 void do_cat(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     if (args != 2) {
-    	printf("Usage: cat <inode>\n");
+    	printf("Usage: cat <inode|path>\n");
     	return;
     }
 
-    if (!copyout(fs, atoi(arg1), "/dev/stdout")) {
+    ssize_t inumber = resolve(fs, arg1);
+    if (inumber < 0 || !copyout(fs, inumber, "/dev/stdout")) {
     	printf("cat failed!\n");
     }
 }
 
 void do_copyout(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     if (args != 3) {
-    	printf("Usage: copyout <inode> <file>\n");
+    	printf("Usage: copyout <inode|path> <file>\n");
     	return;
     }
 
-    if (!copyout(fs, atoi(arg1), arg2)) {
+    ssize_t inumber = resolve(fs, arg1);
+    if (inumber < 0 || !copyout(fs, inumber, arg2)) {
     	printf("copyout failed!\n");
     }
 }
@@ -170,28 +349,40 @@ void do_create(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
 
 void do_remove(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     if (args != 2) {
-    	printf("Usage: remove <inode>\n");
+    	printf("Usage: remove <inode|path>\n");
     	return;
     }
 
-    ssize_t inumber = atoi(arg1);
-    if (fs.remove(inumber)) {
-    	printf("removed inode %ld.\n", inumber);
-    } else {
+    // A path loses its name as well, unless it is the root or a directory
+    // that still has entries; the name only goes once the inode is gone,
+    // so a failed remove leaves it in place
+    ssize_t	inumber = resolve(fs, arg1);
+    Directory	parent, directory;
+    std::string name;
+    if (arg1[0] == '/' && (inumber < 0 || !resolve_parent(fs, arg1, parent, name, false) ||
+    	(directory.open(&fs, inumber) && directory.size() != 0))) {
     	printf("remove failed!\n");
+    	return;
+    }
+
+    if (inumber < 0 || !fs.remove(inumber) || (arg1[0] == '/' && !parent.unlink(name.c_str()))) {
+    	printf("remove failed!\n");
+    } else {
+    	printf("removed inode %ld.\n", inumber);
     }
 }
 
 void do_stat(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     if (args != 2) {
-    	printf("Usage: stat <inode>\n");
+    	printf("Usage: stat <inode|path>\n");
     	return;
     }
 
-    ssize_t inumber = atoi(arg1);
-    ssize_t bytes   = fs.stat(inumber);
+    ssize_t inumber = resolve(fs, arg1);
+    size_t  blocks  = 0;
+    ssize_t bytes   = fs.stat(inumber, &blocks);
     if (bytes >= 0) {
-    	printf("inode %ld has size %ld bytes.\n", inumber, bytes);
+    	printf("inode %ld has size %ld bytes in %lu blocks.\n", inumber, bytes, blocks);
     } else {
     	printf("stat failed!\n");
     }
@@ -199,51 +390,221 @@ void do_stat(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
 
 void do_copyin(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     if (args != 3) {
-    	printf("Usage: copyin <inode> <file>\n");
+    	printf("Usage: copyin <file> <inode|path>\n");
     	return;
     }
 
-    if (!copyin(fs, arg1, atoi(arg2))) {
+    // Copying to a path that does not exist yet creates the file
+    ssize_t inumber = resolve(fs, arg2);
+    if (inumber < 0 && arg2[0] == '/') {
+    	Directory   parent;
+    	std::string name;
+    	if (resolve_parent(fs, arg2, parent, name, true) && (inumber = fs.create()) >= 0 && !parent.link(name.c_str(), inumber)) {
+    	    fs.remove(inumber);
+    	    inumber = -1;
+	}
+    }
+
+    if (inumber < 0 || !copyin(fs, arg1, inumber)) {
     	printf("copyin failed!\n");
     }
 }
 
+void do_df(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 1) {
+    	printf("Usage: df\n");
+    	return;
+    }
+
+    ssize_t free_blocks = fs.free_blocks();
+    ssize_t free_inodes = fs.free_inodes();
+    if (free_blocks < 0 || free_inodes < 0) {
+    	printf("df failed!\n");
+    	return;
+    }
+
+    printf("%lu blocks, %lu used, %ld free\n", disk.size(), disk.size() - free_blocks, free_blocks);
+    printf("%lu inodes, %lu used, %ld free\n", fs.inodes(), fs.inodes() - free_inodes, free_inodes);
+}
+
+void do_sync(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 1) {
+    	printf("Usage: sync\n");
+    	return;
+    }
+
+    if (disk.mounted()) {
+    	fs.sync();
+    	printf("disk synced.\n");
+    } else {
+    	printf("sync failed!\n");
+    }
+}
+
+void do_stats(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args > 2 || (args == 2 && !streq(arg1, "json") && !streq(arg1, "reset"))) {
+    	printf("Usage: stats [json|reset]\n");
+    	return;
+    }
+
+    if (args == 2 && streq(arg1, "reset")) {
+    	fs.stats().reset();
+    	disk.stats().reset();
+    	printf("stats reset.\n");
+    	return;
+    }
+
+    std::vector<const Stats *> sources;
+    sources.push_back(&fs.stats());
+    sources.push_back(&disk.stats());
+    Stats::print(stdout, sources, args == 2);
+}
+
+void do_trace(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args == 2 && streq(arg1, "start")) {
+    	Trace::start();
+    	printf("trace started.\n");
+    } else if (args == 3 && streq(arg1, "stop")) {
+    	ssize_t spans = Trace::stop(arg2);
+    	if (spans >= 0) {
+    	    printf("%ld spans written to %s.\n", spans, arg2);
+	} else {
+	    printf("trace failed!\n");
+	}
+    } else {
+    	printf("Usage: trace start|stop <file>\n");
+    }
+}
+
+void do_record(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args == 3 && streq(arg1, "start")) {
+    	if (Workload::start(arg2)) {
+    	    printf("recording to %s.\n", arg2);
+	} else {
+	    printf("record failed!\n");
+	}
+    } else if (args == 2 && streq(arg1, "stop")) {
+    	ssize_t calls = Workload::stop();
+    	if (calls >= 0) {
+    	    printf("%ld calls recorded.\n", calls);
+	} else {
+	    printf("record failed!\n");
+	}
+    } else {
+    	printf("Usage: record start <file>|stop\n");
+    }
+}
+
+void do_model(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args > 2 || (args == 2 && !streq(arg1, "reset"))) {
+    	printf("Usage: model [reset]\n");
+    	return;
+    }
+
+    if (disk.model() == NULL) {
+    	printf("model failed!\n");
+    } else if (args == 2) {
+    	disk.model()->reset();
+    	printf("model reset.\n");
+    } else {
+    	disk.model()->print(stdout);
+    }
+}
+
 void do_help(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     printf("Commands are:\n");
     printf("    format\n");
     printf("    mount\n");
+    printf("    unmount\n");
     printf("    debug\n");
     printf("    create\n");
-    printf("    remove  <inode>\n");
-    printf("    cat     <inode>\n");
-    printf("    stat    <inode>\n");
-    printf("    copyin  <file> <inode>\n");
-    printf("    copyout <inode> <file>\n");
+    printf("    remove  <inode|path>\n");
+    printf("    cat     <inode|path>\n");
+    printf("    stat    <inode|path>\n");
+    printf("    copyin  <file> <inode|path>\n");
+    printf("    copyout <inode|path> <file>\n");
+    printf("    mkdir   <path>\n");
+    printf("    ls      <path>\n");
+    printf("    link    <inode> <path>\n");
+    printf("    unlink  <path>\n");
+    printf("    df\n");
+    printf("    sync\n");
+    printf("    stats   [json|reset]\n");
+    printf("    trace   start|stop <file>\n");
+    printf("    record  start <file>|stop\n");
+    printf("    model   [reset]\n");
     printf("    help\n");
     printf("    quit\n");
     printf("    exit\n");
 }
 
 bool copyout(FileSystem &fs, size_t inumber, const char *path) {
-    FILE *stream = fopen(path, "w");
-    if (stream == nullptr) {
+    int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if (fd < 0) {
     	fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
     	return false;
     }
 
-    char buffer[4*BUFSIZ] = {0};
+    // Anything already printed must come before the file's contents
+    fflush(stdout);
+
+    // Write straight from views of the cached blocks, without copying them
+    FileSystem::View view;
     size_t offset = 0;
+    bool   copied = true;
     while (true) {
-    	ssize_t result = fs.read(inumber, buffer, sizeof(buffer), offset);
+    	ssize_t result = fs.pin(inumber, VIEW_SIZE, offset, view);
     	if (result <= 0) {
     	    break;
 	}
-	fwrite(buffer, 1, result, stream);
+
+	const std::vector<FileSystem::View::Span> &spans = view.spans();
+	std::vector<struct iovec> iov(spans.size());
+	for (size_t i = 0; i < spans.size(); i++) {
+	    iov[i].iov_base = (void *)spans[i].Data;
+	    iov[i].iov_len  = spans[i].Length;
+	}
+
+	if (!write_all(fd, iov)) {
+	    fprintf(stderr, "Unable to write %s: %s\n", path, strerror(errno));
+	    copied = false;
+	    break;
+	}
 	offset += result;
     }
+    fs.unpin(view);
+    close(fd);
+
+    if (copied) {
+    	printf("%lu bytes copied\n", offset);
+    }
+    return copied;
+}
+
+bool write_all(int fd, std::vector<struct iovec> &iov) {
+    size_t first = 0;
+
+    while (first < iov.size()) {
+    	size_t count = std::min(iov.size() - first, (size_t)IOV_MAX);
+    	ssize_t written = writev(fd, &iov[first], count);
+    	if (written < 0) {
+    	    if (errno == EINTR) {
+    	    	continue;
+	    }
+	    return false;
+	}
+
+	// Skip fully written buffers and trim a partially written one
+	while (first < iov.size() && written >= (ssize_t)iov[first].iov_len) {
+	    written -= iov[first].iov_len;
+	    first++;
+	}
+	if (written > 0) {
+	    iov[first].iov_base = (char *)iov[first].iov_base + written;
+	    iov[first].iov_len -= written;
+	}
+    }
 
-    printf("%lu bytes copied\n", offset);
-    fclose(stream);
     return true;
 }
 
@@ -254,10 +615,11 @@ bool copyin(FileSystem &fs, const char *path, size_t inumber) {
     	return false;
     }
 
-    char buffer[4*BUFSIZ] = {0};
+    std::vector<char> storage(COPY_BUFFER_SIZE);
+    char *buffer = storage.data();
     size_t offset = 0;
     while (true) {
-    	ssize_t result = fread(buffer, 1, sizeof(buffer), stream);
+    	ssize_t result = fread(buffer, 1, COPY_BUFFER_SIZE, stream);
     	if (result <= 0) {
     	    break;
 	}
@@ -278,3 +640,144 @@ bool copyin(FileSystem &fs, const char *path, size_t inumber) {
     fclose(stream);
     return true;
 }
+
+// Directory command functions
+
+void do_mkdir(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+    	printf("Usage: mkdir <path>\n");
+    	return;
+    }
+
+    Directory	parent;
+    std::string name;
+    if (!resolve_parent(fs, arg1, parent, name, true)) {
+    	printf("mkdir failed!\n");
+    	return;
+    }
+
+    ssize_t inumber = Directory::create(&fs);
+    if (inumber < 0) {
+    	printf("mkdir failed!\n");
+    } else if (!parent.link(name.c_str(), inumber)) {
+    	fs.remove(inumber);
+    	printf("mkdir failed!\n");
+    } else {
+    	printf("created directory %s as inode %ld.\n", arg1, inumber);
+    }
+}
+
+void do_ls(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+    	printf("Usage: ls <path>\n");
+    	return;
+    }
+
+    ssize_t inumber = resolve(fs, arg1);
+    Directory directory;
+    std::vector<Directory::Entry> entries;
+    if (inumber < 0 || !directory.open(&fs, inumber) || directory.readdir(entries) < 0) {
+    	printf("ls failed!\n");
+    	return;
+    }
+
+    // Entries come out in hash order
+    std::sort(entries.begin(), entries.end(), [](const Directory::Entry &a, const Directory::Entry &b) { return a.Name < b.Name; });
+    for (size_t i = 0; i < entries.size(); i++) {
+    	bool subdirectory = Directory::is_directory(&fs, entries[i].Inode);
+    	printf("%8lu %10ld %s%s\n", entries[i].Inode, fs.stat(entries[i].Inode), entries[i].Name.c_str(), subdirectory ? "/" : "");
+    }
+    printf("%lu entries\n", entries.size());
+}
+
+void do_link(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 3) {
+    	printf("Usage: link <inode> <path>\n");
+    	return;
+    }
+
+    ssize_t	inumber = resolve(fs, arg1);
+    Directory	parent;
+    std::string name;
+    if (inumber < 0 || fs.stat(inumber) < 0 || !resolve_parent(fs, arg2, parent, name, true) || !parent.link(name.c_str(), inumber)) {
+    	printf("link failed!\n");
+    } else {
+    	printf("linked inode %ld as %s.\n", inumber, arg2);
+    }
+}
+
+void do_unlink(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+    	printf("Usage: unlink <path>\n");
+    	return;
+    }
+
+    Directory	parent;
+    std::string name;
+    if (!resolve_parent(fs, arg1, parent, name, false) || !parent.unlink(name.c_str())) {
+    	printf("unlink failed!\n");
+    } else {
+    	printf("unlinked %s.\n", arg1);
+    }
+}
+
+// Path functions
+
+// Return the root directory, creating it if asked and there is none
+ssize_t root_directory(FileSystem &fs, bool create) {
+    ssize_t root = fs.root();
+    if (root >= 0 || !create) {
+    	return root;
+    }
+
+    root = Directory::create(&fs);
+    if (root >= 0 && !fs.set_root(root)) {
+    	fs.remove(root);
+    	root = -1;
+    }
+    return root;
+}
+
+// Return inode a path names: paths start with '/', anything else is an
+// inode number
+ssize_t resolve(FileSystem &fs, const char *path) {
+    if (path[0] != '/') {
+    	return atoi(path);
+    }
+
+    ssize_t inumber = root_directory(fs, false);
+    std::stringstream components(path);
+    std::string component;
+    while (inumber >= 0 && std::getline(components, component, '/')) {
+    	if (component.empty()) {
+    	    continue;
+	}
+
+	Directory directory;
+	inumber = directory.open(&fs, inumber) ? directory.lookup(component.c_str()) : -1;
+    }
+    return inumber;
+}
+
+// Open the directory holding a path's last component (creating the root
+// directory if asked and there is none) and return the component in name
+bool resolve_parent(FileSystem &fs, const char *path, Directory &parent, std::string &name, bool create) {
+    std::string directory(path);
+    while (directory.size() > 1 && directory[directory.size() - 1] == '/') {
+    	directory.erase(directory.size() - 1);
+    }
+
+    size_t slash = directory.rfind('/');
+    if (path[0] != '/' || slash == std::string::npos || slash + 1 == directory.size()) {
+    	return false;
+    }
+    name = directory.substr(slash + 1);
+    directory.erase(slash + 1);
+
+    if (root_directory(fs, create) < 0) {
+    	return false;
+    }
+
+    ssize_t inumber = resolve(fs, directory.c_str());
+    return inumber >= 0 && parent.open(&fs, inumber);
+}
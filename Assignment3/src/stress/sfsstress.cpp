@@ -0,0 +1,297 @@
+// sfsstress.cpp: Multi-threaded file system stress test
+
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Size of the file every thread reads while the others write
+#define SHARED_SIZE	(64*Disk::BLOCK_SIZE + 123)
+
+// Largest file a thread writes in one round
+#define MAX_FILE_SIZE	(24*Disk::BLOCK_SIZE)
+
+std::atomic<size_t> Failures(0);
+
+// Expected contents of byte position of a file owned by inumber
+char pattern(size_t inumber, size_t position) {
+    return (char)((inumber * 131 + position * 7 + position / Disk::BLOCK_SIZE) & 0xff);
+}
+
+void fail(const char *what, size_t inumber, size_t position) {
+    fprintf(stderr, "%s: inode %lu at %lu\n", what, inumber, position);
+    Failures++;
+}
+
+// Fill inumber with size bytes of its pattern, in chunks of random size
+bool fill(FileSystem &fs, size_t inumber, size_t size, unsigned int *seed) {
+    std::vector<char> buffer(size);
+    for (size_t position = 0; position < size; position++) {
+    	buffer[position] = pattern(inumber, position);
+    }
+
+    size_t offset = 0;
+    while (offset < size) {
+    	size_t  length = 1 + rand_r(seed) % (3*Disk::BLOCK_SIZE);
+    	ssize_t result = fs.write(inumber, buffer.data() + offset, std::min(length, size - offset), offset);
+    	if (result <= 0) {
+    	    fail("write failed", inumber, offset);
+    	    return false;
+	}
+	offset += result;
+    }
+    return true;
+}
+
+// Check that inumber holds size bytes of its pattern, read at random offsets
+bool verify(FileSystem &fs, size_t inumber, size_t size, unsigned int *seed) {
+    if (fs.stat(inumber) != (ssize_t)size) {
+    	fail("stat mismatch", inumber, size);
+    	return false;
+    }
+
+    std::vector<char> buffer(MAX_FILE_SIZE);
+    for (size_t i = 0; i < 8; i++) {
+    	size_t  offset = rand_r(seed) % size;
+    	size_t  length = 1 + rand_r(seed) % buffer.size();
+    	ssize_t result = fs.read(inumber, buffer.data(), length, offset);
+    	if (result != (ssize_t)std::min(length, size - offset)) {
+    	    fail("short read", inumber, offset);
+    	    return false;
+	}
+
+	for (ssize_t j = 0; j < result; j++) {
+	    if (buffer[j] != pattern(inumber, offset + j)) {
+	    	fail("corrupt data", inumber, offset + j);
+	    	return false;
+	    }
+	}
+    }
+    return true;
+}
+
+// Check the whole of inumber with one asynchronous read per block, all
+// queued before any is waited for
+bool verify_async(FileSystem &fs, size_t inumber, size_t size) {
+    std::vector<char>		      buffer(size);
+    std::vector<std::future<ssize_t> > requests;
+
+    for (size_t offset = 0; offset < size; offset += Disk::BLOCK_SIZE) {
+    	size_t length = std::min((size_t)Disk::BLOCK_SIZE, size - offset);
+    	requests.push_back(fs.read_async(inumber, buffer.data() + offset, length, offset));
+    }
+
+    bool ok = true;
+    for (size_t i = 0; i < requests.size(); i++) {
+    	size_t offset = i * Disk::BLOCK_SIZE;
+    	if (requests[i].get() != (ssize_t)std::min((size_t)Disk::BLOCK_SIZE, size - offset)) {
+    	    fail("short asynchronous read", inumber, offset);
+    	    ok = false;
+	}
+    }
+
+    for (size_t position = 0; ok && position < size; position++) {
+    	if (buffer[position] != pattern(inumber, position)) {
+    	    fail("corrupt asynchronous data", inumber, position);
+    	    ok = false;
+	}
+    }
+    return ok;
+}
+
+// Check a random range of inumber through a pinned view
+bool verify_view(FileSystem &fs, size_t inumber, size_t size, unsigned int *seed) {
+    FileSystem::View view;
+    size_t  offset = rand_r(seed) % size;
+    size_t  length = 1 + rand_r(seed) % MAX_FILE_SIZE;
+    ssize_t result = fs.pin(inumber, length, offset, view);
+    if (result != (ssize_t)std::min(length, size - offset)) {
+    	fail("short view", inumber, offset);
+    	return false;
+    }
+
+    size_t position = offset;
+    for (size_t s = 0; s < view.spans().size(); s++) {
+    	const FileSystem::View::Span &span = view.spans()[s];
+    	for (size_t j = 0; j < span.Length; j++, position++) {
+    	    if (span.Data[j] != pattern(inumber, position)) {
+    	    	fail("corrupt view", inumber, position);
+    	    	return false;
+	    }
+	}
+    }
+    fs.unpin(view);
+    return true;
+}
+
+// Create, fill, verify and remove files while reading the shared file;
+// the file from the last round is kept for the final check
+void worker(FileSystem &fs, size_t shared, size_t rounds, unsigned int seed, ssize_t *kept, size_t *kept_size) {
+    *kept = -1;
+
+    for (size_t round = 0; round < rounds; round++) {
+    	ssize_t inumber = fs.create();
+    	if (inumber < 0) {
+    	    fail("create failed", 0, round);
+    	    return;
+	}
+
+	size_t size = 1 + rand_r(&seed) % MAX_FILE_SIZE;
+	if (!fill(fs, inumber, size, &seed) || !verify(fs, inumber, size, &seed)) {
+	    return;
+	}
+
+	verify(fs, shared, SHARED_SIZE, &seed);
+	verify_async(fs, shared, SHARED_SIZE);
+	verify_view(fs, shared, SHARED_SIZE, &seed);
+
+	if (round + 1 == rounds) {
+	    *kept      = inumber;
+	    *kept_size = size;
+	} else if (!fs.remove(inumber)) {
+	    fail("remove failed", inumber, 0);
+	}
+    }
+}
+
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [options] <diskfile> <nblocks>\n", program);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -b <backend>    Disk I/O backend: sync, uring or mmap (default: sync)\n");
+    fprintf(stderr, "    -c <blocks>     Number of blocks in block cache (default: %lu, 0 disables)\n", BlockCache::DEFAULT_CAPACITY);
+    fprintf(stderr, "    -t <threads>    Number of threads (default: 8)\n");
+    fprintf(stderr, "    -r <rounds>     Files created per thread (default: 64)\n");
+    fprintf(stderr, "    -s <mode>       Durability: none, flush, always or a sync interval in ms (default: flush)\n");
+    fprintf(stderr, "    -S <policy>     Disk request scheduler: none, fifo, sstf, scan, cscan or deadline (default: none)\n");
+}
+
+int main(int argc, char *argv[]) {
+    size_t	  cache_capacity = BlockCache::DEFAULT_CAPACITY;
+    size_t	  threads	 = 8;
+    size_t	  rounds	 = 64;
+    Disk::Backend backend	 = Disk::SYNC;
+    Disk::Durability durability  = Disk::SYNC_ON_FLUSH;
+    size_t	  sync_interval  = Disk::DEFAULT_SYNC_INTERVAL;
+    Scheduler::Policy scheduler  = Scheduler::NONE;
+    int		  option;
+
+    while ((option = getopt(argc, argv, "b:c:t:r:s:S:h")) != -1) {
+    	switch (option) {
+    	    case 'b':
+    	    	if (!Disk::parse(optarg, &backend)) {
+    	    	    usage(argv[0]);
+    	    	    return EXIT_FAILURE;
+		}
+    	    	break;
+    	    case 'c':
+    	    	cache_capacity = strtoul(optarg, NULL, 10);
+    	    	break;
+    	    case 't':
+    	    	threads = strtoul(optarg, NULL, 10);
+    	    	break;
+    	    case 'r':
+    	    	rounds = strtoul(optarg, NULL, 10);
+    	    	break;
+    	    case 's':
+    	    	if (!Disk::parse(optarg, &durability, &sync_interval)) {
+    	    	    usage(argv[0]);
+    	    	    return EXIT_FAILURE;
+		}
+    	    	break;
+    	    case 'S':
+    	    	if (!Scheduler::parse(optarg, &scheduler)) {
+    	    	    usage(argv[0]);
+    	    	    return EXIT_FAILURE;
+		}
+    	    	break;
+    	    default:
+    	    	usage(argv[0]);
+    	    	return EXIT_FAILURE;
+	}
+    }
+
+    if (argc - optind != 2 || threads == 0 || rounds == 0) {
+    	usage(argv[0]);
+    	return EXIT_FAILURE;
+    }
+
+    Disk	disk;
+    FileSystem	fs(cache_capacity);
+
+    try {
+    	disk.open(argv[optind], atoi(argv[optind + 1]));
+    } catch (std::runtime_error &e) {
+    	fprintf(stderr, "Unable to open disk %s: %s\n", argv[optind], e.what());
+    	return EXIT_FAILURE;
+    }
+
+    if (!disk.set_backend(backend)) {
+    	fprintf(stderr, "%s is unavailable, using synchronous I/O\n", backend == Disk::MMAP ? "mmap" : "io_uring");
+    }
+    disk.set_scheduler(scheduler);
+    disk.set_durability(durability, sync_interval);
+
+    if (!fs.format(&disk) || !fs.mount(&disk)) {
+    	fprintf(stderr, "Unable to format and mount %s\n", argv[optind]);
+    	return EXIT_FAILURE;
+    }
+
+    unsigned int seed	    = 0;
+    ssize_t	 shared	    = fs.create();
+    ssize_t	 free_start = fs.free_blocks();
+    if (shared < 0 || !fill(fs, shared, SHARED_SIZE, &seed)) {
+    	return EXIT_FAILURE;
+    }
+    ssize_t free_shared = fs.free_blocks();
+
+    std::vector<std::thread> pool;
+    std::vector<ssize_t>     kept(threads);
+    std::vector<size_t>	     kept_size(threads);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t t = 0; t < threads; t++) {
+    	pool.push_back(std::thread(worker, std::ref(fs), shared, rounds, t + 1, &kept[t], &kept_size[t]));
+    }
+    for (size_t t = 0; t < threads; t++) {
+    	pool[t].join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    // Every kept file must survive a remount intact
+    fs.unmount();
+    if (!fs.mount(&disk)) {
+    	fprintf(stderr, "Unable to remount %s\n", argv[optind]);
+    	return EXIT_FAILURE;
+    }
+
+    verify(fs, shared, SHARED_SIZE, &seed);
+    for (size_t t = 0; t < threads; t++) {
+    	if (kept[t] >= 0 && verify(fs, kept[t], kept_size[t], &seed)) {
+    	    fs.remove(kept[t]);
+	}
+    }
+
+    // With only the shared file left, no block may have leaked
+    if (fs.free_blocks() != free_shared) {
+    	fprintf(stderr, "leaked %ld blocks\n", free_shared - fs.free_blocks());
+    	Failures++;
+    }
+
+    fs.remove(shared);
+    if (fs.free_blocks() != free_start || fs.free_inodes() != (ssize_t)fs.inodes()) {
+    	fprintf(stderr, "leaked blocks or inodes after removing every file\n");
+    	Failures++;
+    }
+
+    printf("%lu threads, %lu rounds, %lu failures\n", threads, rounds, Failures.load());
+    printf("%.0f files/s, %lu disk syncs\n", threads * rounds / elapsed.count(), disk.syncs());
+    return Failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
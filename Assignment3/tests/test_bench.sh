@@ -0,0 +1,24 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+echo -n "Testing bench baseline on $SCRATCH/image.2000 ... "
+if ./bin/sfsbench -r 1 -w $SCRATCH/baseline $SCRATCH/image.2000 2000 > $SCRATCH/test.log 2>&1 &&
+   [ $(grep -vc '^#' $SCRATCH/baseline) -eq 22 ] &&
+   ./bin/sfsbench -r 1 -T 100 -C $SCRATCH/baseline $SCRATCH/image.2000 2000 >> $SCRATCH/test.log 2>&1; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+echo -n "Testing bench regression on $SCRATCH/image.2000 ... "
+echo "create 1e15" > $SCRATCH/baseline
+if ! ./bin/sfsbench -r 1 -f create -C $SCRATCH/baseline $SCRATCH/image.2000 2000 > $SCRATCH/test.log 2>&1 &&
+   grep -q "^create .*REGRESSION" $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
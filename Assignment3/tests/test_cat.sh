@@ -10,8 +10,10 @@ image-5-output() {
 
 
 
+0 block cache hits
 0 disk block writes
-5 disk block reads
+1 block cache misses
+3 disk block reads
 965 bytes copied
 All mimsy were the borogoves,
 All mimsy were the borogoves,
@@ -219,7 +221,9 @@ image-20-output() {
 
 0 bytes copied
 0 disk block writes
-21 disk block reads
+11 block cache misses
+14 disk block reads
+1 block cache hits
 27160 bytes copied
 9546 bytes copied
    Abraham Clark
@@ -537,8 +537,10 @@ Inode 126:
 Inode 127:
     size: 0 bytes
     direct blocks:
-261 disk block reads
-127 disk block writes
+0 block cache hits
+0 block cache misses
+6 disk block reads
+1 disk block writes
 EOF
 }
 
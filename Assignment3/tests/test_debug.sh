@@ -78,3 +78,64 @@ test-debug() {
 test-debug data/image.5   5   image-5-output
 test-debug data/image.20  20  image-20-output
 test-debug data/image.200 200 image-200-output
+
+# Test: extent layout on a fragmented file system
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+cp data/image.20 $SCRATCH/image.20
+head -c 8192 data/image.200 > $SCRATCH/small
+head -c 49152 data/image.200 > $SCRATCH/large
+
+fragmented-input() {
+    echo format
+    echo mount
+    for inode in 0 1 2 3 4 5 6; do
+    	echo create
+    	echo copyin $SCRATCH/small $inode
+    done
+    echo remove 1
+    echo remove 3
+    echo remove 5
+    echo create
+    echo copyin $SCRATCH/large 1
+}
+
+fragmented-output() {
+    cat <<EOF
+SuperBlock:
+    magic number is valid
+    20 blocks
+    2 inode blocks
+    256 inodes
+    version 6
+    1 bitmap blocks
+    1 inode bitmap blocks
+    state is clean
+    1 initialized inode blocks
+    0 journal blocks
+Inode 0:
+    size: 8192 bytes
+    direct blocks: 5 6
+Inode 1:
+    size: 24576 bytes
+    direct blocks: 7 8
+    indirect block: 11
+    indirect data blocks: 15 16 19 12
+Inode 2:
+    size: 8192 bytes
+    direct blocks: 9 10
+Inode 4:
+    size: 8192 bytes
+    direct blocks: 13 14
+Inode 6:
+    size: 8192 bytes
+    direct blocks: 17 18
+3 disk block reads
+0 disk block writes
+EOF
+}
+
+fragmented-input | ./bin/sfssh $SCRATCH/image.20 20 > /dev/null 2>&1
+test-debug $SCRATCH/image.20 20 fragmented-output
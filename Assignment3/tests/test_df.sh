@@ -0,0 +1,85 @@
+#!/bin/bash
+
+image-5-input() {
+    cat <<EOF
+df
+mount
+df
+EOF
+}
+
+image-5-output() {
+    cat <<EOF
+df failed!
+disk mounted.
+5 blocks, 3 used, 2 free
+128 inodes, 1 used, 127 free
+0 block cache hits
+0 block cache misses
+2 disk block reads
+0 disk block writes
+EOF
+}
+
+image-20-input() {
+    cat <<EOF
+mount
+df
+remove 3
+df
+EOF
+}
+
+image-20-output() {
+    cat <<EOF
+disk mounted.
+20 blocks, 14 used, 6 free
+256 inodes, 2 used, 254 free
+removed inode 3.
+20 blocks, 11 used, 9 free
+256 inodes, 1 used, 255 free
+0 block cache hits
+1 block cache misses
+4 disk block reads
+1 disk block writes
+EOF
+}
+
+image-200-input() {
+    cat <<EOF
+mount
+df
+EOF
+}
+
+image-200-output() {
+    cat <<EOF
+disk mounted.
+200 blocks, 150 used, 50 free
+2560 inodes, 3 used, 2557 free
+0 block cache hits
+2 block cache misses
+23 disk block reads
+0 disk block writes
+EOF
+}
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+test-df() {
+    BLOCKS=$1
+
+    cp data/image.$BLOCKS $SCRATCH/image.$BLOCKS
+    echo -n "Testing df on data/image.$BLOCKS ... "
+    if diff -u <(image-$BLOCKS-input | ./bin/sfssh $SCRATCH/image.$BLOCKS $BLOCKS 2> /dev/null) <(image-$BLOCKS-output) > $SCRATCH/test.log; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat $SCRATCH/test.log
+    fi
+}
+
+test-df 5
+test-df 20
+test-df 200
@@ -0,0 +1,112 @@
+#!/bin/bash
+
+paths-input() {
+    cat <<EOF
+ls /
+format
+mount
+mkdir /docs
+mkdir /docs/notes
+copyin $SCRATCH/hello.txt /docs/hello.txt
+create
+link 4 /docs/notes/empty
+link 4 /docs/notes/empty
+link 99 /docs/nothing
+ls /docs
+ls /docs/notes
+stat /docs/hello.txt
+cat /docs/hello.txt
+remove /docs/notes
+unlink /docs/notes/empty
+remove /docs/notes
+remove /
+mkdir /docs/hello.txt/x
+cat /docs/missing
+unmount
+mount
+ls /
+EOF
+}
+
+paths-output() {
+    cat <<EOF
+ls failed!
+disk formatted.
+disk mounted.
+created directory /docs as inode 1.
+created directory /docs/notes as inode 2.
+17 bytes copied
+created inode 4.
+linked inode 4 as /docs/notes/empty.
+link failed!
+link failed!
+       3         17 hello.txt
+       2       8192 notes/
+2 entries
+       4          0 empty
+1 entries
+inode 3 has size 17 bytes in 1 blocks.
+hello, directory
+17 bytes copied
+remove failed!
+unlinked /docs/notes/empty.
+removed inode 2.
+remove failed!
+mkdir failed!
+cat failed!
+disk unmounted.
+disk mounted.
+       1       8192 docs/
+1 entries
+EOF
+}
+
+large-input() {
+    echo format
+    echo mount
+    echo mkdir /big
+    echo create
+    for i in $(seq 30000); do
+    	echo link 2 /big/file-$i
+    done
+    for i in 1 15000 30000; do
+    	echo stat /big/file-$i
+    done
+    echo unlink /big/file-15000
+    echo stat /big/file-15000
+    echo ls /big
+}
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+echo "hello, directory" > $SCRATCH/hello.txt
+echo -n "Testing paths on $SCRATCH/image.200 ... "
+if diff -u <(paths-input | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null | grep -v "block cache\|disk block\|amplification") <(paths-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+echo -n "Testing root directory on $SCRATCH/image.200 ... "
+echo debug | ./bin/sfssh $SCRATCH/image.200 200 > $SCRATCH/test.log 2> /dev/null
+if grep -q "root directory is inode 0" $SCRATCH/test.log &&
+   [ $(grep -c "^    type: directory" $SCRATCH/test.log) -eq 2 ]; then
+    echo "Success"
+else
+    echo "Failure"
+fi
+
+# Enough entries to fill the root of the index and move it down a level
+echo -n "Testing large directory on $SCRATCH/image.2000 ... "
+large-input | ./bin/sfssh $SCRATCH/image.2000 2000 > $SCRATCH/test.log 2> /dev/null
+if [ $(grep -c "^linked inode 2 as" $SCRATCH/test.log) -eq 30000 ] &&
+   [ $(grep -c "^inode 2 has size 0 bytes" $SCRATCH/test.log) -eq 3 ] &&
+   [ $(grep -c "^stat failed!" $SCRATCH/test.log) -eq 1 ] &&
+   grep -q "^29999 entries" $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    tail -20 $SCRATCH/test.log
+fi
@@ -8,8 +8,14 @@ SuperBlock:
     5 blocks
     1 inode blocks
     128 inodes
-2 disk block reads
-5 disk block writes
+    version 6
+    1 bitmap blocks
+    1 inode bitmap blocks
+    state is clean
+    0 initialized inode blocks
+    0 journal blocks
+1 disk block reads
+3 disk block writes
 EOF
 }
 
@@ -21,8 +27,14 @@ SuperBlock:
     20 blocks
     2 inode blocks
     256 inodes
-3 disk block reads
-20 disk block writes
+    version 6
+    1 bitmap blocks
+    1 inode bitmap blocks
+    state is clean
+    0 initialized inode blocks
+    0 journal blocks
+1 disk block reads
+3 disk block writes
 EOF
 }
 
@@ -34,8 +46,14 @@ SuperBlock:
     200 blocks
     20 inode blocks
     2560 inodes
-21 disk block reads
-200 disk block writes
+    version 6
+    1 bitmap blocks
+    1 inode bitmap blocks
+    state is clean
+    0 initialized inode blocks
+    0 journal blocks
+1 disk block reads
+3 disk block writes
 EOF
 }
 
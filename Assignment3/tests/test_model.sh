@@ -0,0 +1,53 @@
+#!/bin/bash
+
+image-20-input() {
+    cat <<EOF
+model
+mount
+model reset
+copyout 2 $SCRATCH/2.txt
+model
+model bogus
+EOF
+}
+
+image-20-output() {
+    cat <<EOF
+modeled disk: 20 tracks, 7200 rpm, 30 blocks
+0 requests in 0.000 ms (seek 0.0%, rotation 0.0%, transfer 0.0%)
+disk mounted.
+model reset.
+27160 bytes copied
+modeled disk: 20 tracks, 7200 rpm, 30 blocks
+2 requests in 70.833 ms (seek 7.1%, rotation 51.7%, transfer 41.2%)
+per request             mean        p50        p99        max
+service ms            35.417     25.166     45.833     45.833
+seek tracks              3.5          3          4          4
+rotation ms           18.326     14.680     21.992     21.992
+Usage: model [reset]
+1 block cache hits
+8 block cache misses
+11 disk block reads
+0 disk block writes
+EOF
+}
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Twenty tracks, the outer ten holding two blocks each and the inner ten one
+cp data/image.20 $SCRATCH/image.20
+echo -n "Testing model on data/image.20 ... "
+if diff -u <(image-20-input | ./bin/sfssh -m tracks=20,zones=2:1,skew=0 $SCRATCH/image.20 20 2> /dev/null) <(image-20-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+echo -n "Testing model that cannot hold data/image.20 ... "
+if ! ./bin/sfssh -m tracks=2,zones=4 $SCRATCH/image.20 20 < /dev/null > /dev/null 2>&1; then
+    echo "Success"
+else
+    echo "Failure"
+fi
@@ -11,6 +11,8 @@ EOF
 mount-output() {
     cat <<EOF
 disk mounted.
+0 block cache hits
+0 block cache misses
 2 disk block reads
 0 disk block writes
 EOF
@@ -27,6 +29,8 @@ mount-mount-output() {
     cat <<EOF
 disk mounted.
 mount failed!
+0 block cache hits
+0 block cache misses
 2 disk block reads
 0 disk block writes
 EOF
@@ -43,6 +47,8 @@ mount-format-output() {
     cat <<EOF
 disk mounted.
 format failed!
+0 block cache hits
+0 block cache misses
 2 disk block reads
 0 disk block writes
 EOF
@@ -141,3 +147,66 @@ else
     echo "Failure"
     cat $SCRATCH/test.log
 fi
+
+# Test: persistent bitmaps after clean and unclean unmount
+
+cp data/image.20 $SCRATCH/image.20
+cat <<EOF | ./bin/sfssh $SCRATCH/image.20 20 > /dev/null 2>&1
+format
+mount
+create
+copyin README.md 0
+EOF
+
+clean-mount-input() {
+    cat <<EOF
+mount
+df
+stat 0
+EOF
+}
+
+clean-mount-output() {
+    cat <<EOF
+disk mounted.
+20 blocks, 7 used, 13 free
+256 inodes, 1 used, 255 free
+inode 0 has size 7628 bytes in 2 blocks.
+0 block cache hits
+0 block cache misses
+4 disk block reads
+2 disk block writes
+EOF
+}
+
+echo -n "Testing clean-mount on $SCRATCH/image.20 ... "
+if diff -u <(clean-mount-input | ./bin/sfssh $SCRATCH/image.20 20 2> /dev/null) <(clean-mount-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Mark the superblock dirty, as if the file system was never unmounted
+echo -n -e $(printf '\\x%x\\x%x\\x%x\\x%x' 0x54 0x52 0x49 0x44) | dd of=$SCRATCH/image.20 bs=1 seek=20 conv=notrunc 2> /dev/null
+
+dirty-mount-output() {
+    cat <<EOF
+disk mounted.
+20 blocks, 7 used, 13 free
+256 inodes, 1 used, 255 free
+inode 0 has size 7628 bytes in 2 blocks.
+0 block cache hits
+0 block cache misses
+2 disk block reads
+4 disk block writes
+EOF
+}
+
+echo -n "Testing dirty-mount on $SCRATCH/image.20 ... "
+if diff -u <(clean-mount-input | ./bin/sfssh $SCRATCH/image.20 20 2> /dev/null) <(dirty-mount-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
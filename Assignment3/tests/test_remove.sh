@@ -62,8 +62,10 @@ SuperBlock:
 Inode 2:
     size: 0 bytes
     direct blocks:
-25 disk block reads
-8 disk block writes
+0 block cache hits
+0 block cache misses
+8 disk block reads
+2 disk block writes
 EOF
 }
 
@@ -156,8 +158,11 @@ Inode 1:
 Inode 2:
     size: 965 bytes
     direct blocks: 4
-27 disk block reads
-10 disk block writes
+0 block cache hits
+1 block cache misses
+11 disk block reads
+6 disk block writes
+8.49 write amplification
 EOF
 }
 
@@ -230,8 +235,11 @@ Inode 2:
     direct blocks: 4 5 6 7 8
     indirect block: 9
     indirect data blocks: 13 14
-41 disk block reads
-18 disk block writes
+1 block cache hits
+8 block cache misses
+24 disk block reads
+10 disk block writes
+1.51 write amplification
 EOF
 }
 
@@ -0,0 +1,75 @@
+#!/bin/bash
+
+image-20-input() {
+    cat <<EOF
+record
+record start $SCRATCH/workload.trace
+mount
+stat 2
+copyout 2 $SCRATCH/2.txt
+create
+copyin $SCRATCH/1.txt 0
+remove 0
+sync
+record stop
+EOF
+}
+
+image-20-output() {
+    cat <<EOF
+Usage: record start <file>|stop
+recording to $SCRATCH/workload.trace.
+disk mounted.
+inode 2 has size 27160 bytes in 8 blocks.
+27160 bytes copied
+created inode 0.
+965 bytes copied
+removed inode 0.
+disk synced.
+7 calls recorded.
+EOF
+}
+
+replay-output() {
+    cat <<EOF
+create 1
+remove 1
+stat 1
+read 2
+write 1
+sync 1
+total 7
+7 calls replayed on $1 threads, 0 failed
+EOF
+}
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+cp data/image.20 $SCRATCH/image.20
+head -c 965 /dev/zero > $SCRATCH/1.txt
+echo -n "Testing record on data/image.20 ... "
+if diff -u <(image-20-input | ./bin/sfssh $SCRATCH/image.20 20 2> /dev/null | head -n 10) <(image-20-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Latencies vary from run to run, so only counts are compared
+for threads in 1 4; do
+    echo -n "Testing replay on $threads threads ... "
+    if diff -u <(./bin/sfsreplay -t $threads $SCRATCH/workload.trace $SCRATCH/image.200 200 2> /dev/null | head -n 9 | awk 'NR > 1 && NF == 7 { print $1, $2; next } NR > 1 { print }') <(replay-output $threads) > $SCRATCH/test.log; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat $SCRATCH/test.log
+    fi
+done
+
+echo -n "Testing paced replay ... "
+if ./bin/sfsreplay -p $SCRATCH/workload.trace $SCRATCH/image.200 200 2> /dev/null | grep -q "^7 calls replayed on 1 threads, 0 failed$"; then
+    echo "Success"
+else
+    echo "Failure"
+fi
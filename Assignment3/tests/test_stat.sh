@@ -12,10 +12,12 @@ EOF
 image-5-output() {
     cat <<EOF
 disk mounted.
-inode 1 has size 965 bytes.
+inode 1 has size 965 bytes in 1 blocks.
 stat failed!
 stat failed!
-5 disk block reads
+0 block cache hits
+0 block cache misses
+2 disk block reads
 0 disk block writes
 EOF
 }
@@ -33,9 +35,11 @@ image-20-output() {
     cat <<EOF
 disk mounted.
 stat failed!
-inode 2 has size 27160 bytes.
-inode 3 has size 9546 bytes.
-7 disk block reads
+inode 2 has size 27160 bytes in 8 blocks.
+inode 3 has size 9546 bytes in 3 blocks.
+1 block cache hits
+1 block cache misses
+4 disk block reads
 0 disk block writes
 EOF
 }
@@ -53,11 +57,13 @@ EOF
 image-200-output() {
     cat <<EOF
 disk mounted.
-inode 1 has size 1523 bytes.
-inode 2 has size 105421 bytes.
+inode 1 has size 1523 bytes in 1 blocks.
+inode 2 has size 105421 bytes in 27 blocks.
 stat failed!
-inode 9 has size 409305 bytes.
-27 disk block reads
+inode 9 has size 409305 bytes in 101 blocks.
+2 block cache hits
+2 block cache misses
+23 disk block reads
 0 disk block writes
 EOF
 }
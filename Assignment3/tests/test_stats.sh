@@ -0,0 +1,71 @@
+#!/bin/bash
+
+image-5-input() {
+    cat <<EOF
+stats
+mount
+stats reset
+stat 1
+copyout 1 $SCRATCH/1.txt
+create
+copyin $SCRATCH/1.txt 0
+stats
+stats reset
+stats json
+stats bogus
+EOF
+}
+
+image-5-output() {
+    cat <<EOF
+operation             count          bytes     p50 us     p99 us    p999 us     max us
+create 0 0
+remove 0 0
+stat 0 0
+read 0 0
+write 0 0
+load_inode 0 0
+allocate_block 0 0
+disk_read 0 0
+disk_write 0 0
+disk_sync 0 0
+disk mounted.
+stats reset.
+inode 1 has size 965 bytes in 1 blocks.
+965 bytes copied
+created inode 0.
+965 bytes copied
+operation             count          bytes     p50 us     p99 us    p999 us     max us
+create 1 0
+remove 0 0
+stat 1 0
+read 2 965
+write 1 965
+load_inode 4 0
+allocate_block 1 0
+disk_read 1 4096
+disk_write 0 0
+disk_sync 0 0
+stats reset.
+{"create": {"count": 0, "bytes": 0, "total_ns": 0, "p50_ns": 0, "p99_ns": 0, "p999_ns": 0, "max_ns": 0}, "remove": {"count": 0, "bytes": 0, "total_ns": 0, "p50_ns": 0, "p99_ns": 0, "p999_ns": 0, "max_ns": 0}, "stat": {"count": 0, "bytes": 0, "total_ns": 0, "p50_ns": 0, "p99_ns": 0, "p999_ns": 0, "max_ns": 0}, "read": {"count": 0, "bytes": 0, "total_ns": 0, "p50_ns": 0, "p99_ns": 0, "p999_ns": 0, "max_ns": 0}, "write": {"count": 0, "bytes": 0, "total_ns": 0, "p50_ns": 0, "p99_ns": 0, "p999_ns": 0, "max_ns": 0}, "load_inode": {"count": 0, "bytes": 0, "total_ns": 0, "p50_ns": 0, "p99_ns": 0, "p999_ns": 0, "max_ns": 0}, "allocate_block": {"count": 0, "bytes": 0, "total_ns": 0, "p50_ns": 0, "p99_ns": 0, "p999_ns": 0, "max_ns": 0}, "disk_read": {"count": 0, "bytes": 0, "total_ns": 0, "p50_ns": 0, "p99_ns": 0, "p999_ns": 0, "max_ns": 0}, "disk_write": {"count": 0, "bytes": 0, "total_ns": 0, "p50_ns": 0, "p99_ns": 0, "p999_ns": 0, "max_ns": 0}, "disk_sync": {"count": 0, "bytes": 0, "total_ns": 0, "p50_ns": 0, "p99_ns": 0, "p999_ns": 0, "max_ns": 0}}
+Usage: stats [json|reset]
+0 block cache hits
+1 block cache misses
+3 disk block reads
+2 disk block writes
+8.49 write amplification
+EOF
+}
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Latencies vary from run to run, so only counts and bytes are compared
+cp data/image.5 $SCRATCH/image.5
+echo -n "Testing stats on data/image.5 ... "
+if diff -u <(image-5-input | ./bin/sfssh $SCRATCH/image.5 5 2> /dev/null | awk 'NF == 7 { print $1, $2, $3; next } { print }') <(image-5-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -0,0 +1,33 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+test-stress() {
+    THREADS=$1
+    CACHE=$2
+    BACKEND=${3:-sync}
+    SCHEDULER=${4:-none}
+
+    echo -n "Testing stress with $THREADS threads (cache $CACHE, $BACKEND, $SCHEDULER) ... "
+    rm -f $SCRATCH/image.4000
+    if ./bin/sfsstress -r 24 -t $THREADS -c $CACHE -b $BACKEND -S $SCHEDULER $SCRATCH/image.4000 4000 > $SCRATCH/test.log 2>&1; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat $SCRATCH/test.log
+    fi
+}
+
+test-stress 1 256
+test-stress 8 256
+test-stress 8 16
+test-stress 8 0
+test-stress 8 256 uring
+test-stress 8 16 uring
+test-stress 8 16 mmap
+test-stress 8 16 sync fifo
+test-stress 8 16 sync sstf
+test-stress 8 16 sync scan
+test-stress 8 16 uring cscan
+test-stress 8 16 sync deadline
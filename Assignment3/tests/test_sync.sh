@@ -0,0 +1,93 @@
+#!/bin/bash
+
+image-20-input() {
+    cat <<EOF
+sync
+mount
+remove 3
+sync
+df
+EOF
+}
+
+image-20-output() {
+    cat <<EOF
+sync failed!
+disk mounted.
+removed inode 3.
+disk synced.
+20 blocks, 11 used, 9 free
+256 inodes, 1 used, 255 free
+0 block cache hits
+1 block cache misses
+4 disk block reads
+1 disk block writes
+EOF
+}
+
+journal-input() {
+    cat <<EOF
+format
+mount
+create
+sync
+debug
+EOF
+}
+
+journal-output() {
+    cat <<EOF
+disk formatted.
+disk mounted.
+created inode 0.
+disk synced.
+SuperBlock:
+    magic number is valid
+    400 blocks
+    40 inode blocks
+    5120 inodes
+    version 6
+    1 bitmap blocks
+    1 inode bitmap blocks
+    state is journaled
+    1 initialized inode blocks
+    25 journal blocks
+Inode 0:
+    size: 0 bytes
+    direct blocks:
+0 block cache hits
+0 block cache misses
+7 disk block reads
+14 disk block writes
+EOF
+}
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+test-sync() {
+    DURABILITY=$1
+
+    cp data/image.20 $SCRATCH/image.20
+    echo -n "Testing sync on data/image.20 (durability $DURABILITY) ... "
+    if diff -u <(image-20-input | ./bin/sfssh -s $DURABILITY $SCRATCH/image.20 20 2> /dev/null) <(image-20-output) > $SCRATCH/test.log; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat $SCRATCH/test.log
+    fi
+}
+
+test-sync flush
+test-sync always
+test-sync none
+test-sync 10
+
+rm -f $SCRATCH/image.400
+echo -n "Testing sync on journaled $SCRATCH/image.400 ... "
+if diff -u <(journal-input | ./bin/sfssh $SCRATCH/image.400 400 2> /dev/null) <(journal-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
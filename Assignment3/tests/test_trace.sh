@@ -0,0 +1,52 @@
+#!/bin/bash
+
+image-5-input() {
+    cat <<EOF
+trace
+trace start
+mount
+stat 1
+create
+copyin $SCRATCH/1.txt 0
+trace stop $SCRATCH/trace.json
+EOF
+}
+
+image-5-output() {
+    cat <<EOF
+Usage: trace start|stop <file>
+trace started.
+disk mounted.
+inode 1 has size 965 bytes in 1 blocks.
+created inode 0.
+965 bytes copied
+11 spans written to $SCRATCH/trace.json.
+{"displayTimeUnit": "ns", "traceEvents": [
+{"name": "disk_read", "cat": "disk", "ph": "X", "pid": 1, "tid": 1, "args": {"block": 0}},
+{"name": "disk_read", "cat": "disk", "ph": "X", "pid": 1, "tid": 1, "args": {"block": 1}},
+{"name": "mount", "cat": "fs", "ph": "X", "pid": 1, "tid": 1, "args": {}},
+{"name": "load_inode", "cat": "fs", "ph": "X", "pid": 1, "tid": 1, "args": {"inode": 1}},
+{"name": "stat", "cat": "fs", "ph": "X", "pid": 1, "tid": 1, "args": {"inode": 1}},
+{"name": "save_inode", "cat": "fs", "ph": "X", "pid": 1, "tid": 1, "args": {"inode": 0}},
+{"name": "create", "cat": "fs", "ph": "X", "pid": 1, "tid": 1, "args": {"inode": 0}},
+{"name": "load_inode", "cat": "fs", "ph": "X", "pid": 1, "tid": 1, "args": {"inode": 0}},
+{"name": "allocate_free_block", "cat": "fs", "ph": "X", "pid": 1, "tid": 1, "args": {"block": 3}},
+{"name": "save_inode", "cat": "fs", "ph": "X", "pid": 1, "tid": 1, "args": {"inode": 0}},
+{"name": "write", "cat": "fs", "ph": "X", "pid": 1, "tid": 1, "args": {"inode": 0}}
+]}
+EOF
+}
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Span times vary from run to run, so only names and tags are compared
+cp data/image.5 $SCRATCH/image.5
+head -c 965 /dev/zero > $SCRATCH/1.txt
+echo -n "Testing trace on data/image.5 ... "
+if diff -u <(image-5-input | ./bin/sfssh $SCRATCH/image.5 5 2> /dev/null | head -n 7; sed -E 's/"ts": [0-9.]+, "dur": [0-9.]+, //' $SCRATCH/trace.json) <(image-5-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi